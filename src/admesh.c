@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
@@ -29,20 +30,28 @@
 #include "stl.h"
 
 static void usage(int status, char *program_name);
+static void transform_rotate(double m[12], int a, int b, float angle);
+static void transform_rotate_axis(double m[12], float axis[3], float angle);
+static void transform_scale(double m[12], float x, float y, float z);
 
 int
 main(int argc, char **argv) {
   stl_file stl_in;
+  stl_mass_properties properties;
   float    tolerance = 0;
   float    increment = 0;
   float    x_trans;
   float    y_trans;
   float    z_trans;
   float    scale_versor[3];
+  double   transform[12] = {1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0};
+  int      transforms;
   float    scale_factor = 0;
   float    rotate_x_angle = 0;
   float    rotate_y_angle = 0;
   float    rotate_z_angle = 0;
+  float    rotate_axis[3];
+  float    rotate_axis_angle = 0;
   float    str_x_min = 0;
   float    str_x_max = 0;
   float    str_x     = 0;
@@ -62,8 +71,13 @@ main(int argc, char **argv) {
   char     *vrml_name = NULL;
   int      fixall_flag = 1;	       /* Default behavior is to fix all. */
   int      exact_flag = 0;	       /* All checks turned off by default. */
+  int      sort_edges_flag = 0;
+  int      edge_table_stats_flag = 0;
+  int      mass_properties_flag = 0;
   int      tolerance_flag = 0;	       /* Is tolerance specified on cmdline */
   int      nearby_flag = 0;
+  int      nearby_grid_flag = 0;
+  int      nearby_weld_flag = 0;
   int      remove_unconnected_flag = 0;
   int      fill_holes_flag = 0;
   int      normal_directions_flag = 0;
@@ -72,6 +86,7 @@ main(int argc, char **argv) {
   int      write_binary_stl_flag = 0;
   int      write_ascii_stl_flag = 0;
   int      generate_shared_vertices_flag = 0;
+  int      hash_vertices_flag = 0;
   int      write_off_flag = 0;
   int      write_dxf_flag = 0;
   int      write_vrml_flag = 0;
@@ -83,6 +98,7 @@ main(int argc, char **argv) {
   int      rotate_x_flag = 0;
   int      rotate_y_flag = 0;
   int      rotate_z_flag = 0;
+  int      rotate_axis_flag = 0;
   int      mirror_xy_flag = 0;
   int      mirror_yz_flag = 0;
   int      mirror_xz_flag = 0;
@@ -98,12 +114,18 @@ main(int argc, char **argv) {
 
   enum {rotate_x = 1000, rotate_y, rotate_z, merge, help, version,
         mirror_xy, mirror_yz, mirror_xz, scale, translate, translate_rel,
-        stretch, reverse_all, off_file, dxf_file, vrml_file, scale_xyz
+        stretch, reverse_all, off_file, dxf_file, vrml_file, scale_xyz,
+        sort_edges, edge_table_stats, nearby_grid, nearby_weld, hash_vertices,
+        axis_rotate, threads, mass_properties
        };
 
   struct option long_options[] = {
     {"exact",              no_argument,       NULL, 'e'},
+    {"sort-edges",         no_argument,       NULL, sort_edges},
+    {"edge-table-stats",   no_argument,       NULL, edge_table_stats},
     {"nearby",             no_argument,       NULL, 'n'},
+    {"nearby-grid",        no_argument,       NULL, nearby_grid},
+    {"nearby-weld",        no_argument,       NULL, nearby_weld},
     {"tolerance",          required_argument, NULL, 't'},
     {"iterations",         required_argument, NULL, 'i'},
     {"increment",          required_argument, NULL, 'm'},
@@ -118,6 +140,7 @@ main(int argc, char **argv) {
     {"write-off",          required_argument, NULL, off_file},
     {"write-dxf",          required_argument, NULL, dxf_file},
     {"write-vrml",         required_argument, NULL, vrml_file},
+    {"hash-vertices",      no_argument,       NULL, hash_vertices},
     {"translate",          required_argument, NULL, translate},
     {"translate-rel",      required_argument, NULL, translate_rel},
     {"stretch",            required_argument, NULL, stretch},
@@ -126,10 +149,13 @@ main(int argc, char **argv) {
     {"x-rotate",           required_argument, NULL, rotate_x},
     {"y-rotate",           required_argument, NULL, rotate_y},
     {"z-rotate",           required_argument, NULL, rotate_z},
+    {"axis-rotate",        required_argument, NULL, axis_rotate},
     {"xy-mirror",          no_argument,       NULL, mirror_xy},
     {"yz-mirror",          no_argument,       NULL, mirror_yz},
     {"xz-mirror",          no_argument,       NULL, mirror_xz},
     {"merge",              required_argument, NULL, merge},
+    {"threads",            required_argument, NULL, threads},
+    {"mass-properties",    no_argument,       NULL, mass_properties},
     {"help",               no_argument,       NULL, help},
     {"version",            no_argument,       NULL, version},
     {NULL, 0, NULL, 0}
@@ -145,10 +171,22 @@ main(int argc, char **argv) {
       exact_flag = 1;
       fixall_flag = 0;
       break;
+    case sort_edges:
+      sort_edges_flag = 1;
+      break;
+    case edge_table_stats:
+      edge_table_stats_flag = 1;
+      break;
     case 'n':
       nearby_flag = 1;
       fixall_flag = 0;
       break;
+    case nearby_grid:
+      nearby_grid_flag = 1;
+      break;
+    case nearby_weld:
+      nearby_weld_flag = 1;
+      break;
     case 't':
       tolerance_flag = 1;
       tolerance = atof(optarg);
@@ -201,6 +239,25 @@ main(int argc, char **argv) {
       write_vrml_flag = 1;
       vrml_name = optarg;
       break;
+    case hash_vertices:
+      hash_vertices_flag = 1;
+      break;
+    case threads:
+      {
+        char *end;
+        long count = strtol(optarg, &end, 10);
+
+        if(end == optarg || *end != '\0' || count < 0 || count > INT_MAX) {
+          printf("Incorrect threads argument.\n");
+          usage(1, program_name);
+          return 1;
+        }
+        stl_set_thread_count((int)count);
+      }
+      break;
+    case mass_properties:
+      mass_properties_flag = 1;
+      break;
     case dxf_file:
       write_dxf_flag = 1;
       dxf_name = optarg;
@@ -278,6 +335,15 @@ main(int argc, char **argv) {
       rotate_z_flag = 1;
       rotate_z_angle = atof(optarg);
       break;
+    case axis_rotate:
+      rotate_axis_flag = 1;
+      if(sscanf(optarg, "%f,%f,%f,%f", &rotate_axis[0], &rotate_axis[1],
+                &rotate_axis[2], &rotate_axis_angle) != 4) {
+        printf("Incorrect axis-rotate arguments.\n");
+        usage(1, program_name);
+        return 1;
+      }
+      break;
     case mirror_xy:
       mirror_xy_flag = 1;
       break;
@@ -329,38 +395,76 @@ redistribute it under certain conditions.  See the file COPYING for details.\n")
   printf("Opening %s\n", input_file);
   stl_open(&stl_in, input_file);
   stl_exit_on_error(&stl_in);
+  if(sort_edges_flag) stl_set_edge_engine(&stl_in, edges_sort);
+  if(edge_table_stats_flag) stl_set_probe_log(&stl_in, stderr);
+  if(nearby_grid_flag) stl_set_nearby_grid(&stl_in, 1);
+  if(nearby_weld_flag) stl_set_nearby_weld(&stl_in, 1);
+  stl_exit_on_error(&stl_in);
 
+  /* A single rotation, mirror or scale goes through its own function,
+     which gives the same results it always has.  Two or more are put
+     together in this order and applied in one pass. */
+  transforms = rotate_x_flag + rotate_y_flag + rotate_z_flag
+               + rotate_axis_flag + mirror_xy_flag + mirror_yz_flag
+               + mirror_xz_flag + scale_flag + scale_versor_flag;
   if(rotate_x_flag) {
     printf("Rotating about the x axis by %f degrees...\n", rotate_x_angle);
-    stl_rotate_x(&stl_in, rotate_x_angle);
+    if(transforms == 1) stl_rotate_x(&stl_in, rotate_x_angle);
+    else transform_rotate(transform, 1, 2, rotate_x_angle);
   }
   if(rotate_y_flag) {
     printf("Rotating about the y axis by %f degrees...\n", rotate_y_angle);
-    stl_rotate_y(&stl_in, rotate_y_angle);
+    if(transforms == 1) stl_rotate_y(&stl_in, rotate_y_angle);
+    else transform_rotate(transform, 2, 0, rotate_y_angle);
   }
   if(rotate_z_flag) {
     printf("Rotating about the z axis by %f degrees...\n", rotate_z_angle);
-    stl_rotate_z(&stl_in, rotate_z_angle);
+    if(transforms == 1) stl_rotate_z(&stl_in, rotate_z_angle);
+    else transform_rotate(transform, 0, 1, rotate_z_angle);
+  }
+  if(rotate_axis_flag) {
+    printf("Rotating about the axis %f %f %f by %f degrees...\n",
+           rotate_axis[0], rotate_axis[1], rotate_axis[2], rotate_axis_angle);
+    if(transforms == 1) {
+      stl_rotate_axis(&stl_in, rotate_axis, rotate_axis_angle);
+    } else {
+      transform_rotate_axis(transform, rotate_axis, rotate_axis_angle);
+    }
   }
   if(mirror_xy_flag) {
     printf("Mirroring about the xy plane...\n");
-    stl_mirror_xy(&stl_in);
+    if(transforms == 1) stl_mirror_xy(&stl_in);
+    else transform_scale(transform, 1, 1, -1);
   }
   if(mirror_yz_flag) {
     printf("Mirroring about the yz plane...\n");
-    stl_mirror_yz(&stl_in);
+    if(transforms == 1) stl_mirror_yz(&stl_in);
+    else transform_scale(transform, -1, 1, 1);
   }
   if(mirror_xz_flag) {
     printf("Mirroring about the xz plane...\n");
-    stl_mirror_xz(&stl_in);
+    if(transforms == 1) stl_mirror_xz(&stl_in);
+    else transform_scale(transform, 1, -1, 1);
   }
   if(scale_flag) {
     printf("Scaling by factor %f...\n", scale_factor);
-    stl_scale(&stl_in, scale_factor);
+    if(transforms == 1) {
+      stl_scale(&stl_in, scale_factor);
+    } else {
+      transform_scale(transform, scale_factor, scale_factor, scale_factor);
+    }
   }
   if(scale_versor_flag) {
     printf("Scaling by %f %f %f...\n", scale_versor[0], scale_versor[1], scale_versor[2]);
-    stl_scale_versor(&stl_in, scale_versor);
+    if(transforms == 1) {
+      stl_scale_versor(&stl_in, scale_versor);
+    } else {
+      transform_scale(transform, scale_versor[0], scale_versor[1],
+                      scale_versor[2]);
+    }
+  }
+  if(transforms > 1) {
+    stl_transform(&stl_in, transform);
   }
   if(translate_flag) {
     printf("Translating to %f, %f, %f ...\n", x_trans, y_trans, z_trans);
@@ -399,7 +503,10 @@ redistribute it under certain conditions.  See the file COPYING for details.\n")
 
   if(generate_shared_vertices_flag) {
     printf("Generating shared vertices...\n");
-    stl_generate_shared_vertices(&stl_in);
+    if(hash_vertices_flag)
+      stl_generate_shared_vertices_hash(&stl_in);
+    else
+      stl_generate_shared_vertices(&stl_in);
   }
 
   if(write_off_flag) {
@@ -451,6 +558,11 @@ redistribute it under certain conditions.  See the file COPYING for details.\n")
 
   stl_stats_out(&stl_in, stdout, input_file);
 
+  if(mass_properties_flag) {
+    stl_calculate_mass_properties(&stl_in, &properties);
+    stl_mass_properties_out(&properties, stdout);
+  }
+
   stl_close(&stl_in);
 
   if (ret)
@@ -459,6 +571,88 @@ redistribute it under certain conditions.  See the file COPYING for details.\n")
   return ret;
 }
 
+/* Turns the transformation m further by angle degrees, from axis a
+   towards axis b */
+static void
+transform_rotate(double m[12], int a, int b, float angle) {
+  double radian_angle;
+  double c;
+  double s;
+  double row_a;
+  double row_b;
+  int    j;
+
+  radian_angle = (angle / 180.0) * M_PI;
+  c = cos(radian_angle);
+  s = sin(radian_angle);
+  for(j = 0; j < 4; j++) {
+    row_a = m[4 * a + j];
+    row_b = m[4 * b + j];
+    m[4 * a + j] = c * row_a - s * row_b;
+    m[4 * b + j] = s * row_a + c * row_b;
+  }
+}
+
+/* Turns the transformation m further by angle degrees about the axis
+   through the origin in the direction of axis, as stl_rotate_axis does */
+static void
+transform_rotate_axis(double m[12], float axis[3], float angle) {
+  double r[9];
+  double u[3];
+  double column[3];
+  double length;
+  double radian_angle;
+  double c;
+  double s;
+  int    i;
+  int    j;
+
+  length = sqrt((double)axis[0] * axis[0] + (double)axis[1] * axis[1] +
+                (double)axis[2] * axis[2]);
+  if(length == 0) return;
+  for(i = 0; i < 3; i++) {
+    u[i] = axis[i] / length;
+  }
+
+  radian_angle = (angle / 180.0) * M_PI;
+  c = cos(radian_angle);
+  s = sin(radian_angle);
+  for(i = 0; i < 3; i++) {
+    for(j = 0; j < 3; j++) {
+      r[3 * i + j] = (1 - c) * u[i] * u[j];
+    }
+    r[4 * i] += c;
+  }
+  r[1] -= s * u[2];
+  r[2] += s * u[1];
+  r[3] += s * u[2];
+  r[5] -= s * u[0];
+  r[6] -= s * u[1];
+  r[7] += s * u[0];
+
+  for(j = 0; j < 4; j++) {
+    for(i = 0; i < 3; i++) {
+      column[i] = r[3 * i] * m[j] + r[3 * i + 1] * m[4 + j] +
+                  r[3 * i + 2] * m[8 + j];
+    }
+    for(i = 0; i < 3; i++) {
+      m[4 * i + j] = column[i];
+    }
+  }
+}
+
+/* Scales the result of the transformation m along the axes */
+static void
+transform_scale(double m[12], float x, float y, float z) {
+  int j;
+
+  for(j = 0; j < 4; j++) {
+    m[j] *= x;
+    m[4 + j] *= y;
+    m[8 + j] *= z;
+  }
+}
+
 static void
 usage(int status, char *program_name) {
   if(status != 0) {
@@ -472,6 +666,9 @@ usage(int status, char *program_name) {
     printf("     --x-rotate=angle     Rotate CCW about x-axis by angle degrees\n");
     printf("     --y-rotate=angle     Rotate CCW about y-axis by angle degrees\n");
     printf("     --z-rotate=angle     Rotate CCW about z-axis by angle degrees\n");
+    printf("     --axis-rotate=x,y,z,angle\n");
+    printf("                          Rotate CCW about the axis x,y,z through the\n");
+    printf("                          origin by angle degrees\n");
     printf("     --xy-mirror          Mirror about the xy plane\n");
     printf("     --yz-mirror          Mirror about the yz plane\n");
     printf("     --xz-mirror          Mirror about the xz plane\n");
@@ -482,7 +679,11 @@ usage(int status, char *program_name) {
     printf("     --stretch=xmin:xmax:x,ymin:ymax:y,zmin:zmax:z     Translate the file by x, y, z but only within the given bounding box\n");
     printf("     --merge=name         Merge file called name with input file\n");
     printf(" -e, --exact              Only check for perfectly matched edges\n");
+    printf("     --sort-edges         Match edges by sorting them instead of hashing\n");
+    printf("     --edge-table-stats   Print how the edge table fared in every pass\n");
     printf(" -n, --nearby             Find and connect nearby facets. Correct bad facets\n");
+    printf("     --nearby-grid        Let the nearby check match vertices in neighboring cells\n");
+    printf("     --nearby-weld        Merge the vertices after each nearby check in one go\n");
     printf(" -t, --tolerance=tol      Initial tolerance to use for nearby check = tol\n");
     printf(" -i, --iterations=i       Number of iterations for nearby check = i\n");
     printf(" -m, --increment=inc      Amount to increment tolerance after iteration=inc\n");
@@ -497,6 +698,9 @@ usage(int status, char *program_name) {
     printf("     --write-off=name     Output a Geomview OFF format file called name\n");
     printf("     --write-dxf=name     Output a DXF format file called name\n");
     printf("     --write-vrml=name    Output a VRML format file called name\n");
+    printf("     --hash-vertices      Share vertices by their coordinates for OFF and VRML\n");
+    printf("     --mass-properties    Print the centroid and inertia tensor too\n");
+    printf("     --threads=n          Split big meshes across n threads\n");
     printf("     --help               Display this help and exit\n");
     printf("     --version            Output version information and exit\n");
     printf("\n");
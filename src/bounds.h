@@ -0,0 +1,41 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/admesh/admesh/issues
+ */
+
+#ifndef __admesh_bounds__
+#define __admesh_bounds__
+
+#include "stl.h"
+
+/* Internal bounding box kernels, not part of the installed API */
+
+/* Widens min and max to take in the vertices of count facets.  The result
+   is exactly that of taking the vertices in order with STL_MIN and STL_MAX,
+   NaNs and signed zeros included. */
+extern void stl_facets_bounds(const stl_facet *facets, stl_index count,
+                              stl_vertex *min, stl_vertex *max);
+
+/* The same for facets start to end of the copy in soa */
+extern void stl_soa_bounds(const stl_soa *soa, stl_index start,
+                           stl_index end,
+                           stl_vertex *min, stl_vertex *max);
+
+#endif
@@ -20,13 +20,38 @@
  *           https://github.com/admesh/admesh/issues
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
 
+#include "hash.h"
 #include "stl.h"
-
+#include "threads.h"
+
+/* The bucketed exact check loads every edge of the mesh at once, about
+   190 bytes per facet on top of the mesh, where the serial hash table only
+   holds the edges still waiting for a match.  The hash engine stays serial
+   when that would take more than this, or cannot be allocated. */
+#define STL_EXACT_BUCKETS_MAX_BYTES (2048ULL << 20)
+
+struct stl_weld;
+
+struct stl_check_state {
+  stl_edge_engine edge_engine;
+  FILE          *probe_log;   /* if set, each edge table pass reports here */
+  int           nearby_grid;  /* nearby checks match edges in neighboring
+                                 cells too */
+  int           nearby_weld;  /* nearby checks merge vertices at the end */
+  struct stl_weld *weld;      /* the merges of the running nearby check */
+};
+
+/* What the checks do while stl->check is NULL */
+static const struct stl_check_state stl_default_check = {
+  edges_hash, NULL, 0, 0, NULL
+};
 
 static void stl_match_neighbors_exact(stl_file *stl,
                                       stl_hash_edge *edge_a, stl_hash_edge *edge_b);
@@ -34,29 +59,99 @@ static void stl_match_neighbors_nearby(stl_file *stl,
                                        stl_hash_edge *edge_a, stl_hash_edge *edge_b);
 static void stl_record_neighbors(stl_file *stl,
                                  stl_hash_edge *edge_a, stl_hash_edge *edge_b);
+static void stl_link_neighbors(stl_neighbors *neighbors,
+                               const stl_hash_edge *edge_a,
+                               const stl_hash_edge *edge_b);
 static void stl_initialize_facet_check_exact(stl_file *stl);
+static int stl_check_facets_exact_buckets(stl_file *stl, int required);
+static unsigned long long stl_exact_buckets_bytes(stl_index num_facets);
+static int stl_facet_is_degenerate(const stl_facet *facet);
 static void stl_initialize_facet_check_nearby(stl_file *stl);
 static void stl_load_edge_exact(stl_file *stl, stl_hash_edge *edge,
                                 stl_vertex *a, stl_vertex *b);
+static float stl_load_edge_key(stl_hash_edge *edge,
+                               const stl_vertex *a, const stl_vertex *b);
 static int stl_load_edge_nearby(stl_file *stl, stl_hash_edge *edge,
                                 stl_vertex *a, stl_vertex *b, float tolerance);
 static void insert_hash_edge(stl_file *stl, stl_hash_edge edge,
                              void (*match_neighbors)(stl_file *stl,
                                  stl_hash_edge *edge_a, stl_hash_edge *edge_b));
-static int stl_get_hash_for_edge(int M, stl_hash_edge *edge);
+static stl_index stl_get_hash_for_edge(stl_index M, const stl_hash_edge *edge);
+static void stl_initialize_edge_table(stl_file *stl, stl_index num_edges,
+                                      const char *caller);
 static int stl_compare_function(stl_hash_edge *edge_a, stl_hash_edge *edge_b);
-static void stl_free_edges(stl_file *stl);
-static void stl_remove_facet(stl_file *stl, int facet_number);
-static void stl_change_vertices(stl_file *stl, int facet_num, int vnot,
+static void stl_free_edges(stl_file *stl, const char *pass);
+static void stl_remove_facet(stl_file *stl, stl_index facet_number);
+static void stl_change_vertices(stl_file *stl, stl_index facet_num, int vnot,
                                 stl_vertex new_vertex);
 static void stl_which_vertices_to_change(stl_file *stl, stl_hash_edge *edge_a,
-    stl_hash_edge *edge_b, int *facet1, int *vertex1,
-    int *facet2, int *vertex2,
-    stl_vertex *new_vertex1, stl_vertex *new_vertex2);
-static void stl_remove_degenerate(stl_file *stl, int facet);
+    stl_hash_edge *edge_b, stl_index *facet1, int *vertex1,
+    stl_index *facet2, int *vertex2,
+    stl_vertex *new_vertex1, stl_vertex *new_vertex2,
+    stl_index *source1, stl_index *source2);
+static void stl_weld_begin(stl_file *stl);
+static void stl_weld_add(stl_file *stl, stl_index corner, stl_index source);
+static void stl_weld_end(stl_file *stl);
+static void stl_remove_degenerate(stl_file *stl, stl_index facet);
 extern int stl_check_normal_vector(stl_file *stl,
-                                   int facet_num, int normal_fix_flag);
-static void stl_update_connects_remove_1(stl_file *stl, int facet_num);
+                                   stl_index facet_num, int normal_fix_flag);
+static void stl_update_connects_remove_1(stl_file *stl, stl_index facet_num);
+
+static const struct stl_check_state *
+stl_check_settings(const stl_file *stl) {
+  return stl->check != NULL ? stl->check : &stl_default_check;
+}
+
+/* stl->check, allocated with the defaults the first time */
+static struct stl_check_state *
+stl_check_state(stl_file *stl) {
+  if(stl->check == NULL) {
+    stl->check = (struct stl_check_state*)malloc(sizeof(*stl->check));
+    if(stl->check == NULL) {
+      perror("stl_check_state");
+      stl->error = 1;
+      return NULL;
+    }
+    *stl->check = stl_default_check;
+  }
+  return stl->check;
+}
+
+void
+stl_set_edge_engine(stl_file *stl, stl_edge_engine engine) {
+  struct stl_check_state *check;
+
+  if (stl->error) return;
+  check = stl_check_state(stl);
+  if(check != NULL) check->edge_engine = engine;
+}
+
+void
+stl_set_probe_log(stl_file *stl, FILE *log) {
+  struct stl_check_state *check;
+
+  if (stl->error) return;
+  check = stl_check_state(stl);
+  if(check != NULL) check->probe_log = log;
+}
+
+void
+stl_set_nearby_grid(stl_file *stl, int grid) {
+  struct stl_check_state *check;
+
+  if (stl->error) return;
+  check = stl_check_state(stl);
+  if(check != NULL) check->nearby_grid = grid;
+}
+
+void
+stl_set_nearby_weld(stl_file *stl, int weld) {
+  struct stl_check_state *check;
+
+  if (stl->error) return;
+  check = stl_check_state(stl);
+  if(check != NULL) check->nearby_weld = weld;
+}
 
 
 void
@@ -68,7 +163,7 @@ stl_check_facets_exact(stl_file *stl) {
 
   stl_hash_edge  edge;
   stl_facet      facet;
-  int            i;
+  stl_index      i;
   int            j;
 
   if (stl->error) return;
@@ -78,18 +173,25 @@ stl_check_facets_exact(stl_file *stl) {
   stl->stats.connected_facets_2_edge = 0;
   stl->stats.connected_facets_3_edge = 0;
 
+  if(stl_check_settings(stl)->edge_engine == edges_sort) {
+    stl_check_facets_exact_buckets(stl, 1);
+    return;
+  }
+  if(stl_thread_count() > 1
+      && stl->stats.number_of_facets >= stl_parallel_min_facets()
+      && stl_exact_buckets_bytes(stl->stats.number_of_facets)
+         <= STL_EXACT_BUCKETS_MAX_BYTES
+      && stl_check_facets_exact_buckets(stl, 0)) {
+    return;
+  }
+
   stl_initialize_facet_check_exact(stl);
 
   for(i = 0; i < stl->stats.number_of_facets; i++) {
     facet = stl->facet_start[i];
 
     /* If any two of the three vertices are found to be exactally the same, call them degenerate and remove the facet. */
-    if(   !memcmp(&facet.vertex[0], &facet.vertex[1],
-                  sizeof(stl_vertex))
-          || !memcmp(&facet.vertex[1], &facet.vertex[2],
-                     sizeof(stl_vertex))
-          || !memcmp(&facet.vertex[0], &facet.vertex[2],
-                     sizeof(stl_vertex))) {
+    if(stl_facet_is_degenerate(&facet)) {
       stl->stats.degenerate_facets += 1;
       stl_remove_facet(stl, i);
       i--;
@@ -105,26 +207,512 @@ stl_check_facets_exact(stl_file *stl) {
       insert_hash_edge(stl, edge, stl_match_neighbors_exact);
     }
   }
-  stl_free_edges(stl);
+  stl_free_edges(stl, "exact");
+}
+
+static int
+stl_facet_is_degenerate(const stl_facet *facet) {
+  return !memcmp(&facet->vertex[0], &facet->vertex[1], sizeof(stl_vertex))
+         || !memcmp(&facet->vertex[1], &facet->vertex[2], sizeof(stl_vertex))
+         || !memcmp(&facet->vertex[0], &facet->vertex[2], sizeof(stl_vertex));
+}
+
+/* Counts a lookup in the edge table that probed past probe slots */
+static void
+stl_count_probe(stl_probe_stats *probes, stl_index probe) {
+  probes->lookups++;
+  probes->histogram[STL_MIN(probe, STL_PROBE_HISTOGRAM - 1)]++;
+  if(probe > probes->max_probe) probes->max_probe = probe;
+}
+
+static void
+stl_count_load(stl_probe_stats *probes, stl_index edges, stl_index slots) {
+  float load = (float)edges / slots;
+
+  if(load > probes->max_load) probes->max_load = load;
+}
+
+static void
+stl_log_probe_stats(stl_file *stl, const char *pass) {
+  stl_probe_stats *probes = &stl->stats.probes;
+  FILE            *log = stl_check_settings(stl)->probe_log;
+  int             i;
+
+  if(log == NULL) return;
+  fprintf(log, "\
+Edge table (%s): %" STL_INDEX_FORMAT " lookups, %" STL_INDEX_FORMAT " slots, \
+max load %.2f, max probe %" STL_INDEX_FORMAT "\n",
+          pass, probes->lookups, probes->slots, probes->max_load,
+          probes->max_probe);
+  fprintf(log, "  Slots probed past:");
+  for(i = 0; i < STL_PROBE_HISTOGRAM; i++) {
+    fprintf(log, " %d%s: %" STL_INDEX_FORMAT, i,
+            i == STL_PROBE_HISTOGRAM - 1 ? "+" : "", probes->histogram[i]);
+  }
+  fprintf(log, "\n");
+}
+
+/* The bucketed exact check, used by the sort engine and by the hash engine
+   when it has several threads.  The edges are split into STL_EDGE_BUCKETS
+   buckets by the top bits of a fingerprint of their keys.  Edges with
+   equal keys land in the same bucket, still in the order they were
+   loaded, so the buckets can be matched independently and pairing each
+   edge with the oldest waiting one gives the same neighbors as inserting
+   the edges into one hash table. */
+#define STL_EDGE_BUCKET_BITS   11
+#define STL_EDGE_BUCKETS       (1 << STL_EDGE_BUCKET_BITS)
+
+/* The sort engine sorts the keys a byte at a time */
+#define STL_EDGE_KEY_DIGITS    SIZEOF_EDGE_SORT
+
+typedef struct {
+  uint64_t fingerprint;
+  stl_index edge;             /* index into the edge array */
+} stl_edge_ref;
+
+typedef struct {
+  stl_file      *stl;
+  stl_hash_edge *edges;       /* in load order, scratch space once scattered */
+  stl_hash_edge *sorted_edges; /* sort engine: grouped by bucket */
+  stl_edge_ref  *refs;        /* hash engine: in load order, then scratch */
+  stl_edge_ref  *sorted;      /* hash engine: grouped by bucket */
+  stl_index     *offsets;     /* [part][bucket] where a part's edges go */
+  stl_index     bucket_start[STL_EDGE_BUCKETS + 1];
+  int           num_parts;
+  float         *shortest;    /* [part] */
+  stl_index     *counts;      /* [part][3] facets with 1, 2 and 3 neighbors */
+  stl_index     *malloced;    /* [bucket] */
+  stl_index     *freed;       /* [bucket] */
+  stl_index     *collisions;  /* [bucket] */
+  stl_probe_stats *probes;    /* [bucket] */
+} stl_exact_job;
+
+uint64_t
+stl_hash_words(const unsigned *words, int n) {
+  uint64_t hash = 0;
+  int      i;
+
+  for(i = 0; i < n; i++) {
+    hash = (hash ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+static uint64_t
+stl_edge_fingerprint(const stl_hash_edge *edge) {
+  return stl_hash_words(edge->key, 6);
+}
+
+static unsigned
+stl_edge_bucket(uint64_t fingerprint) {
+  return (unsigned)(fingerprint >> (64 - STL_EDGE_BUCKET_BITS));
+}
+
+static stl_index
+stl_facet_range(const stl_exact_job *job, int part) {
+  return (stl_index)((long long)job->stl->stats.number_of_facets * part
+                     / job->num_parts);
+}
+
+/* Loads the edges of one part of the facets and counts them per bucket */
+static void
+stl_exact_load_part(void *arg, int part) {
+  stl_exact_job *job = (stl_exact_job*)arg;
+  stl_index     *count = job->offsets + (size_t)part * STL_EDGE_BUCKETS;
+  stl_facet     *facet;
+  stl_hash_edge *edge;
+  uint64_t      fingerprint;
+  float         shortest;
+  float         max_diff;
+  stl_index     end = stl_facet_range(job, part + 1);
+  stl_index     i;
+  int           j;
+  stl_index     k;
+
+  memset(count, 0, STL_EDGE_BUCKETS * sizeof(stl_index));
+  shortest = job->stl->stats.shortest_edge;
+  for(i = stl_facet_range(job, part); i < end; i++) {
+    facet = &job->stl->facet_start[i];
+    for(j = 0; j < 3; j++) {
+      k = 3 * i + j;
+      edge = &job->edges[k];
+      edge->facet_number = i;
+      edge->which_edge = j;
+      max_diff = stl_load_edge_key(edge, &facet->vertex[j],
+                                   &facet->vertex[(j + 1) % 3]);
+      shortest = STL_MIN(max_diff, shortest);
+      fingerprint = stl_edge_fingerprint(edge);
+      if(job->refs != NULL) {
+        job->refs[k].fingerprint = fingerprint;
+        job->refs[k].edge = k;
+      }
+      count[stl_edge_bucket(fingerprint)]++;
+    }
+  }
+  job->shortest[part] = shortest;
+}
+
+static void
+stl_exact_scatter_part(void *arg, int part) {
+  stl_exact_job *job = (stl_exact_job*)arg;
+  stl_index     *offset = job->offsets + (size_t)part * STL_EDGE_BUCKETS;
+  stl_index     end = 3 * stl_facet_range(job, part + 1);
+  stl_index     k;
+
+  for(k = 3 * stl_facet_range(job, part); k < end; k++) {
+    if(job->refs != NULL) {
+      job->sorted[offset[stl_edge_bucket(job->refs[k].fingerprint)]++] =
+        job->refs[k];
+    } else {
+      job->sorted_edges[offset[stl_edge_bucket(
+        stl_edge_fingerprint(&job->edges[k]))]++] = job->edges[k];
+    }
+  }
+}
+
+/* Byte digit of the key, digit 0 being the lowest byte of the last word */
+static unsigned
+stl_edge_key_digit(const stl_hash_edge *edge, int digit) {
+  return (edge->key[5 - digit / 4] >> (8 * (digit % 4))) & 0xff;
+}
+
+/* Stable LSD radix sort of the edges on their whole keys, so that equal
+   keys end up next to each other and keep the order they were loaded in.
+   tmp must hold n edges. */
+static void
+stl_radix_sort_edges(stl_hash_edge *edges, stl_hash_edge *tmp, stl_index n) {
+  stl_index     count[STL_EDGE_KEY_DIGITS][256];
+  stl_hash_edge *src = edges;
+  stl_hash_edge *dst = tmp;
+  stl_hash_edge *swap;
+  stl_index     sum;
+  stl_index     c;
+  int           digit;
+  stl_index     i;
+
+  if(n < 2) return;
+
+  memset(count, 0, sizeof(count));
+  for(i = 0; i < n; i++) {
+    for(digit = 0; digit < STL_EDGE_KEY_DIGITS; digit++) {
+      count[digit][stl_edge_key_digit(&edges[i], digit)]++;
+    }
+  }
+
+  for(digit = 0; digit < STL_EDGE_KEY_DIGITS; digit++) {
+    /* Nothing to do if every edge has the same digit, as the high bytes
+       of nearby coordinates mostly do */
+    if(count[digit][stl_edge_key_digit(&src[0], digit)] == n) continue;
+    for(i = 0, sum = 0; i < 256; i++) {
+      c = count[digit][i];
+      count[digit][i] = sum;
+      sum += c;
+    }
+    for(i = 0; i < n; i++) {
+      dst[count[digit][stl_edge_key_digit(&src[i], digit)]++] = src[i];
+    }
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if(src != edges) memcpy(edges, src, (size_t)n * sizeof(stl_hash_edge));
+}
+
+/* Sorts a bucket and pairs its edges the way insert_hash_edge would.  With
+   the degenerate facets gone no facet has two edges with the same key, so
+   at most one edge of a key is ever waiting, and each edge either takes it
+   or waits itself. */
+static void
+stl_match_bucket_sort(stl_exact_job *job, int bucket, stl_hash_edge *edges,
+                      stl_hash_edge *scratch, stl_index n) {
+  stl_index waiting = -1;
+  stl_index i;
+
+  stl_radix_sort_edges(edges, scratch, n);
+  for(i = 0; i < n; i++) {
+    if(waiting != -1
+        && !memcmp(edges[i].key, edges[waiting].key, SIZEOF_EDGE_SORT)) {
+      stl_link_neighbors(job->stl->neighbors_start, &edges[i],
+                         &edges[waiting]);
+      job->freed[bucket]++;
+      waiting = -1;
+    } else {
+      job->malloced[bucket]++;
+      waiting = i;
+    }
+  }
+}
+
+static int
+stl_bucket_slot(uint64_t fingerprint, int M) {
+  return (int)(((fingerprint & 0xffffffffu) * (unsigned)M) >> 32);
+}
+
+/* A small version of the edge table for one bucket.  The slots hold
+   positions in refs, linear probing and deleting by shifting back keep
+   equal keys in load order like in insert_hash_edge. */
+static void
+stl_match_bucket_hash(stl_exact_job *job, int bucket, stl_edge_ref *refs,
+                      int *slots, int n) {
+  stl_hash_edge   *edges = job->edges;
+  stl_probe_stats *probes = &job->probes[bucket];
+  int             M = 2 * n + 1;
+  int             i;
+  int             j;
+  int             k;
+  int             m;
+  int             h;
+  int             probe;
+
+  for(k = 0; k < M; k++) slots[k] = -1;
+  probes->slots = M;
+
+  for(i = 0; i < n; i++) {
+    k = stl_bucket_slot(refs[i].fingerprint, M);
+    for(probe = 0; (j = slots[k]) != -1; probe++) {
+      if(refs[j].fingerprint == refs[i].fingerprint
+          && !stl_compare_function(&edges[refs[i].edge],
+                                   &edges[refs[j].edge])) break;
+      job->collisions[bucket]++;
+      if(++k == M) k = 0;
+    }
+    stl_count_probe(probes, probe);
+    if(j == -1) {
+      slots[k] = i;
+      job->malloced[bucket]++;
+      stl_count_load(probes, job->malloced[bucket] - job->freed[bucket], M);
+      continue;
+    }
+
+    stl_link_neighbors(job->stl->neighbors_start,
+                       &edges[refs[i].edge], &edges[refs[j].edge]);
+    job->freed[bucket]++;
+    /* Same backward shift as stl_delete_hash_edge */
+    for(m = k;;) {
+      if(++m == M) m = 0;
+      if(slots[m] == -1) break;
+      h = stl_bucket_slot(refs[slots[m]].fingerprint, M);
+      if(k <= m ? (k < h && h <= m) : (k < h || h <= m)) continue;
+      slots[k] = slots[m];
+      k = m;
+    }
+    slots[k] = -1;
+  }
+}
+
+static void
+stl_exact_match_bucket(void *arg, int bucket) {
+  stl_exact_job *job = (stl_exact_job*)arg;
+  stl_index     start = job->bucket_start[bucket];
+  stl_index     n = job->bucket_start[bucket + 1] - start;
+
+  if(n == 0) return;
+  /* What was loaded is not needed anymore, the bucket's share of it is
+     scratch space: n edges for the sort, room for 2n + 1 int slots for the
+     hash.  The hash engine only comes here within
+     STL_EXACT_BUCKETS_MAX_BYTES, far too few edges for the slots to
+     overflow an int. */
+  if(job->refs == NULL) {
+    stl_match_bucket_sort(job, bucket, job->sorted_edges + start,
+                          job->edges + start, n);
+  } else {
+    stl_match_bucket_hash(job, bucket, job->sorted + start,
+                          (int*)(job->refs + start), (int)n);
+  }
+}
+
+/* The connection counts stl_record_neighbors keeps as it goes, worked out
+   afterwards as the linking order differs between the buckets */
+static void
+stl_exact_count_part(void *arg, int part) {
+  stl_exact_job *job = (stl_exact_job*)arg;
+  stl_neighbors *neighbors;
+  stl_index     *counts = job->counts + 3 * part;
+  stl_index     end = stl_facet_range(job, part + 1);
+  stl_index     i;
+  int           j;
+
+  counts[0] = counts[1] = counts[2] = 0;
+  for(i = stl_facet_range(job, part); i < end; i++) {
+    neighbors = &job->stl->neighbors_start[i];
+    j = (neighbors->neighbor[0] != -1) + (neighbors->neighbor[1] != -1)
+        + (neighbors->neighbor[2] != -1);
+    if(j > 0) counts[j - 1]++;
+  }
+}
+
+/* The scratch space stl_check_facets_exact_buckets allocates for the hash
+   engine */
+static unsigned long long
+stl_exact_buckets_bytes(stl_index num_facets) {
+  unsigned long long num_edges = 3 * (unsigned long long)num_facets;
+
+  return (num_edges + 1) * sizeof(stl_hash_edge)
+         + (2 * num_edges + 1) * sizeof(stl_edge_ref);
+}
+
+/* Returns 0, having changed nothing, if the scratch space cannot be
+   allocated and the check is not required to go this way.  Otherwise
+   that is an error. */
+static int
+stl_check_facets_exact_buckets(stl_file *stl, int required) {
+  stl_exact_job job;
+  stl_index     num_edges;
+  int           allocated;
+  int           part;
+  stl_index     i;
+  stl_index     sum;
+  stl_index     c;
+
+  /* Degenerate facets only ever make the mesh smaller, so there is room
+     for what is left of it */
+  job.stl = stl;
+  job.num_parts = (int)STL_MAX(1, STL_MIN(stl_thread_count(),
+                                          stl->stats.number_of_facets));
+  num_edges = stl->stats.number_of_facets * 3;
+  job.refs = NULL;
+  job.sorted = NULL;
+  job.sorted_edges = NULL;
+  if(stl_check_settings(stl)->edge_engine == edges_sort) {
+    job.edges = (stl_hash_edge*)malloc((2 * (size_t)num_edges + 1)
+                                       * sizeof(stl_hash_edge));
+    if(job.edges != NULL) job.sorted_edges = job.edges + num_edges;
+  } else {
+    job.edges = (stl_hash_edge*)malloc((num_edges + 1)
+                                       * sizeof(stl_hash_edge));
+    job.refs = (stl_edge_ref*)malloc((2 * (size_t)num_edges + 1)
+                                     * sizeof(stl_edge_ref));
+    if(job.refs != NULL) job.sorted = job.refs + num_edges;
+  }
+  job.offsets = (stl_index*)malloc((size_t)job.num_parts * STL_EDGE_BUCKETS
+                                   * sizeof(stl_index));
+  job.shortest = (float*)malloc(job.num_parts * sizeof(float));
+  job.counts = (stl_index*)malloc(3 * job.num_parts * sizeof(stl_index));
+  job.malloced = (stl_index*)calloc(3 * STL_EDGE_BUCKETS, sizeof(stl_index));
+  job.freed = job.malloced + STL_EDGE_BUCKETS;
+  job.collisions = job.freed + STL_EDGE_BUCKETS;
+  job.probes = (stl_probe_stats*)calloc(STL_EDGE_BUCKETS,
+                                        sizeof(stl_probe_stats));
+  allocated = job.edges != NULL
+              && (job.refs != NULL || job.sorted_edges != NULL)
+              && job.offsets != NULL
+              && job.shortest != NULL && job.counts != NULL
+              && job.malloced != NULL && job.probes != NULL;
+  if(!allocated) {
+    if(required) {
+      perror("stl_check_facets_exact");
+      stl->error = 1;
+    }
+  } else {
+    for(i = 0; i < stl->stats.number_of_facets; i++) {
+      stl->neighbors_start[i].neighbor[0] = -1;
+      stl->neighbors_start[i].neighbor[1] = -1;
+      stl->neighbors_start[i].neighbor[2] = -1;
+    }
+    /* Take degenerate facets out first, in the order the serial check
+       would */
+    for(i = 0; i < stl->stats.number_of_facets; i++) {
+      if(stl_facet_is_degenerate(&stl->facet_start[i])) {
+        stl->stats.degenerate_facets += 1;
+        stl_remove_facet(stl, i);
+        i--;
+      }
+    }
+    job.num_parts = (int)STL_MAX(1, STL_MIN(job.num_parts,
+                                            stl->stats.number_of_facets));
+
+    stl_parallel_for(job.num_parts, stl_exact_load_part, &job);
+
+    /* Buckets in order, and within a bucket the parts in order */
+    for(i = 0, sum = 0; i < STL_EDGE_BUCKETS; i++) {
+      job.bucket_start[i] = sum;
+      for(part = 0; part < job.num_parts; part++) {
+        c = job.offsets[(size_t)part * STL_EDGE_BUCKETS + i];
+        job.offsets[(size_t)part * STL_EDGE_BUCKETS + i] = sum;
+        sum += c;
+      }
+    }
+    job.bucket_start[STL_EDGE_BUCKETS] = sum;
+
+    stl_parallel_for(job.num_parts, stl_exact_scatter_part, &job);
+    stl_parallel_for(STL_EDGE_BUCKETS, stl_exact_match_bucket, &job);
+    stl_parallel_for(job.num_parts, stl_exact_count_part, &job);
+
+    stl->stats.malloced = 0;
+    stl->stats.collisions = 0;
+    memset(&stl->stats.probes, 0, sizeof(stl_probe_stats));
+    for(i = 0; i < STL_EDGE_BUCKETS; i++) {
+      stl->stats.malloced += job.malloced[i];
+      stl->stats.connected_edges += 2 * job.freed[i];
+      stl->stats.collisions += job.collisions[i];
+      stl->stats.probes.lookups += job.probes[i].lookups;
+      for(part = 0; part < STL_PROBE_HISTOGRAM; part++) {
+        stl->stats.probes.histogram[part] += job.probes[i].histogram[part];
+      }
+      stl->stats.probes.max_probe = STL_MAX(job.probes[i].max_probe,
+                                            stl->stats.probes.max_probe);
+      stl->stats.probes.slots += job.probes[i].slots;
+      stl->stats.probes.max_load = STL_MAX(job.probes[i].max_load,
+                                           stl->stats.probes.max_load);
+    }
+    stl->stats.freed = stl->stats.malloced;
+    for(part = 0; part < job.num_parts; part++) {
+      stl->stats.shortest_edge = STL_MIN(job.shortest[part],
+                                         stl->stats.shortest_edge);
+      /* A facet with 3 neighbors went through 1 and 2 on the way */
+      stl->stats.connected_facets_1_edge += job.counts[3 * part]
+                                            + job.counts[3 * part + 1]
+                                            + job.counts[3 * part + 2];
+      stl->stats.connected_facets_2_edge += job.counts[3 * part + 1]
+                                            + job.counts[3 * part + 2];
+      stl->stats.connected_facets_3_edge += job.counts[3 * part + 2];
+    }
+  }
+
+  free(job.edges);
+  free(job.refs);
+  free(job.offsets);
+  free(job.shortest);
+  free(job.counts);
+  free(job.malloced);
+  free(job.probes);
+  if(!allocated) return required;
+
+  /* The sort engine has no table to report on */
+  if(!stl->error && stl_check_settings(stl)->edge_engine == edges_hash) {
+    stl_log_probe_stats(stl, "exact");
+  }
+  return 1;
 }
 
 static void
 stl_load_edge_exact(stl_file *stl, stl_hash_edge *edge,
                     stl_vertex *a, stl_vertex *b) {
+  float max_diff;
+
+  if (stl->error) return;
+
+  max_diff = stl_load_edge_key(edge, a, b);
+  stl->stats.shortest_edge = STL_MIN(max_diff, stl->stats.shortest_edge);
+}
+
+/* Stores the edge from a to b with its vertices in canonical order and
+   returns its length along the longest axis */
+static float
+stl_load_edge_key(stl_hash_edge *edge, const stl_vertex *a,
+                  const stl_vertex *b) {
 
   float diff_x;
   float diff_y;
   float diff_z;
   float max_diff;
 
-  if (stl->error) return;
-
   diff_x = ABS(a->x - b->x);
   diff_y = ABS(a->y - b->y);
   diff_z = ABS(a->z - b->z);
   max_diff = STL_MAX(diff_x, diff_y);
   max_diff = STL_MAX(diff_z, max_diff);
-  stl->stats.shortest_edge = STL_MIN(max_diff, stl->stats.shortest_edge);
 
   if(diff_x == max_diff) {
     if(a->x > b->x) {
@@ -154,21 +742,15 @@ stl_load_edge_exact(stl_file *stl, stl_hash_edge *edge,
       edge->which_edge += 3; /* this edge is loaded backwards */
     }
   }
+  return max_diff;
 }
 
 static void
 stl_initialize_facet_check_exact(stl_file *stl) {
-  int i;
+  stl_index i;
 
   if (stl->error) return;
 
-  stl->stats.malloced = 0;
-  stl->stats.freed = 0;
-  stl->stats.collisions = 0;
-
-
-  stl->M = 81397;
-
   for(i = 0; i < stl->stats.number_of_facets ; i++) {
     /* initialize neighbors list to -1 to mark unconnected edges */
     stl->neighbors_start[i].neighbor[0] = -1;
@@ -176,17 +758,100 @@ stl_initialize_facet_check_exact(stl_file *stl) {
     stl->neighbors_start[i].neighbor[2] = -1;
   }
 
-  stl->heads = (stl_hash_edge**)calloc(stl->M, sizeof(*stl->heads));
-  if(stl->heads == NULL) perror("stl_initialize_facet_check_exact");
+  stl_initialize_edge_table(stl, stl->stats.number_of_facets * 3,
+                            "stl_initialize_facet_check_exact");
+}
 
-  stl->tail = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-  if(stl->tail == NULL) perror("stl_initialize_facet_check_exact");
+/* Returns a table size that keeps num_edges edges at most half full */
+static stl_index
+stl_edge_table_size(stl_index num_edges) {
+  return 2 * num_edges + 1024;
+}
 
-  stl->tail->next = stl->tail;
+static stl_hash_edge *
+stl_allocate_edge_table(stl_index M) {
+  stl_hash_edge *table;
+  stl_index     i;
 
-  for(i = 0; i < stl->M; i++) {
-    stl->heads[i] = stl->tail;
+  table = (stl_hash_edge*)malloc((size_t)M * sizeof(stl_hash_edge));
+  if(table == NULL) return NULL;
+  for(i = 0; i < M; i++) {
+    table[i].facet_number = -1;	/* marks an empty slot */
   }
+  return table;
+}
+
+static void
+stl_initialize_edge_table(stl_file *stl, stl_index num_edges,
+                          const char *caller) {
+  stl->stats.malloced = 0;
+  stl->stats.freed = 0;
+  stl->stats.collisions = 0;
+  memset(&stl->stats.probes, 0, sizeof(stl_probe_stats));
+
+  /* Matched edges leave the table.  In a mesh stored in a sensible order
+     only a narrow front of edges is waiting for a match, and a small table
+     that stays in cache is fastest, so start small and grow as needed. */
+  stl->M = stl_edge_table_size(STL_MIN(num_edges, 1024));
+  stl->edge_table = stl_allocate_edge_table(stl->M);
+  if(stl->edge_table == NULL) {
+    perror(caller);
+    stl->error = 1;
+  }
+}
+
+/* Moves the edges into a table twice the size.  Every cluster is copied in
+   probe order, starting after an empty slot, so edges with equal keys keep
+   their order. */
+static void
+stl_grow_edge_table(stl_file *stl) {
+  stl_hash_edge *old_table = stl->edge_table;
+  stl_index     old_M = stl->M;
+  stl_index     start;
+  stl_index     i;
+  stl_index     j;
+  stl_index     k;
+
+  stl->M = stl_edge_table_size(2 * (stl->stats.malloced - stl->stats.freed));
+  stl->edge_table = stl_allocate_edge_table(stl->M);
+  if(stl->edge_table == NULL) {
+    perror("stl_grow_edge_table");
+    stl->edge_table = old_table;
+    stl->M = old_M;
+    stl->error = 1;
+    return;
+  }
+
+  for(start = 0; old_table[start].facet_number != -1; start++);
+  for(i = 0, j = start; i < old_M; i++) {
+    if(++j == old_M) j = 0;
+    if(old_table[j].facet_number == -1) continue;
+    k = stl_get_hash_for_edge(stl->M, &old_table[j]);
+    while(stl->edge_table[k].facet_number != -1) {
+      if(++k == stl->M) k = 0;
+    }
+    stl->edge_table[k] = old_table[j];
+  }
+  free(old_table);
+}
+
+/* Empties slot i, moving later edges of the cluster back so that every edge
+   stays reachable from its hash without tombstones */
+static void
+stl_delete_hash_edge(stl_file *stl, stl_index i) {
+  stl_index j = i;
+  stl_index k;
+
+  for(;;) {
+    if(++j == stl->M) j = 0;
+    if(stl->edge_table[j].facet_number == -1) break;
+    k = stl_get_hash_for_edge(stl->M, &stl->edge_table[j]);
+    /* The edge at j stays if its hash lies cyclically in (i, j] */
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    stl->edge_table[i] = stl->edge_table[j];
+    i = j;
+  }
+  stl->edge_table[i].facet_number = -1;
 }
 
 static void
@@ -194,70 +859,46 @@ insert_hash_edge(stl_file *stl, stl_hash_edge edge,
                  void (*match_neighbors)(stl_file *stl,
                      stl_hash_edge *edge_a, stl_hash_edge *edge_b)) {
   stl_hash_edge *link;
-  stl_hash_edge *new_edge;
-  stl_hash_edge *temp;
-  int            chain_number;
+  stl_index      i;
+  stl_index      probe;
 
   if (stl->error) return;
 
-  chain_number = stl_get_hash_for_edge(stl->M, &edge);
-
-  link = stl->heads[chain_number];
-
-  if(link == stl->tail) {
-    /* This list doesn't have any edges currently in it.  Add this one. */
-    new_edge = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-    if(new_edge == NULL) perror("insert_hash_edge");
-    stl->stats.malloced++;
-    *new_edge = edge;
-    new_edge->next = stl->tail;
-    stl->heads[chain_number] = new_edge;
-    return;
-  } else  if(!stl_compare_function(&edge, link)) {
-    /* This is a match.  Record result in neighbors list. */
-    match_neighbors(stl, &edge, link);
-    /* Delete the matched edge from the list. */
-    stl->heads[chain_number] = link->next;
-    free(link);
-    stl->stats.freed++;
-    return;
-  } else {
-    /* Continue through the rest of the list */
-    for(;;) {
-      if(link->next == stl->tail) {
-        /* This is the last item in the list. Insert a new edge. */
-        new_edge = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-        if(new_edge == NULL) perror("insert_hash_edge");
-        stl->stats.malloced++;
-        *new_edge = edge;
-        new_edge->next = stl->tail;
-        link->next = new_edge;
-        stl->stats.collisions++;
-        return;
-      } else  if(!stl_compare_function(&edge, link->next)) {
-        /* This is a match.  Record result in neighbors list. */
-        match_neighbors(stl, &edge, link->next);
-
-        /* Delete the matched edge from the list. */
-        temp = link->next;
-        link->next = link->next->next;
-        free(temp);
-        stl->stats.freed++;
-        return;
-      } else {
-        /* This is not a match.  Go to the next link */
-        link = link->next;
-        stl->stats.collisions++;
-      }
+  /* Linear probing keeps edges with equal keys in the order they came in,
+     so an edge is matched with the oldest one */
+  i = stl_get_hash_for_edge(stl->M, &edge);
+  for(probe = 0;; probe++) {
+    link = &stl->edge_table[i];
+    if(link->facet_number == -1) break;
+    if(!stl_compare_function(&edge, link)) {
+      stl_count_probe(&stl->stats.probes, probe);
+      /* This is a match.  Record result in neighbors list. */
+      match_neighbors(stl, &edge, link);
+      /* Delete the matched edge from the table. */
+      stl_delete_hash_edge(stl, i);
+      stl->stats.freed++;
+      return;
     }
+    /* This is not a match.  Go to the next slot */
+    stl->stats.collisions++;
+    if(++i == stl->M) i = 0;
+  }
+
+  /* No match, the edge goes into the empty slot */
+  stl_count_probe(&stl->stats.probes, probe);
+  *link = edge;
+  stl->stats.malloced++;
+  if(stl->stats.malloced - stl->stats.freed > stl->M / 2) {
+    stl_grow_edge_table(stl);
   }
+  stl_count_load(&stl->stats.probes, stl->stats.malloced - stl->stats.freed,
+                 stl->M);
 }
 
 
-static int
-stl_get_hash_for_edge(int M, stl_hash_edge *edge) {
-  return ((edge->key[0] / 23 + edge->key[1] / 19 + edge->key[2] / 17
-           + edge->key[3] /13  + edge->key[4] / 11 + edge->key[5] / 7 ) % M);
+static stl_index
+stl_get_hash_for_edge(stl_index M, const stl_hash_edge *edge) {
+  return STL_HASH_SLOT(stl_edge_fingerprint(edge), M);
 }
 
 static int
@@ -269,14 +910,227 @@ stl_compare_function(stl_hash_edge *edge_a, stl_hash_edge *edge_b) {
   }
 }
 
+/* The nearby grid.  A vertex falls into a cube with sides of the tolerance,
+   and a vertex within the tolerance of it can only be in the same cube or
+   in one of the 26 around it.  Waiting edges are filed under the cube of
+   their first vertex, so a new edge finds every edge with both ends within
+   the tolerance of its own ends by looking at 27 cubes around each of its
+   ends, one for each way round the edges can be paired. */
+typedef struct {
+  stl_vertex a;               /* vertex which_edge of the facet */
+  stl_vertex b;               /* the vertex after it */
+  stl_index  facet_number;    /* -1 once matched */
+  int        which_edge;
+  stl_index  next;            /* next edge in the same cube */
+} stl_grid_edge;
+
+typedef struct {
+  unsigned   cell[3];
+  stl_index  head;            /* -1 marks an empty slot */
+  stl_index  tail;
+} stl_grid_cell;
+
+typedef struct {
+  stl_grid_edge *edges;
+  stl_index     num_edges;
+  stl_grid_cell *cells;
+  stl_index     M;
+  float         tolerance;
+  stl_vertex    min;
+} stl_nearby_grid;
+
+static void
+stl_grid_cell_of(const stl_nearby_grid *grid, const stl_vertex *v,
+                 unsigned cell[3]) {
+  cell[0] = (unsigned)((v->x - grid->min.x) / grid->tolerance);
+  cell[1] = (unsigned)((v->y - grid->min.y) / grid->tolerance);
+  cell[2] = (unsigned)((v->z - grid->min.z) / grid->tolerance);
+}
+
+/* Returns the slot of the cube, or of the empty slot where it would go */
+static stl_grid_cell *
+stl_grid_find_cell(stl_file *stl, stl_nearby_grid *grid,
+                   const unsigned cell[3]) {
+  stl_grid_cell *slot;
+  stl_index     i;
+  stl_index     probe;
+
+  i = STL_HASH_SLOT(stl_hash_words(cell, 3), grid->M);
+  for(probe = 0;; probe++) {
+    slot = &grid->cells[i];
+    if(slot->head == -1 || !memcmp(slot->cell, cell, sizeof(slot->cell))) {
+      break;
+    }
+    stl->stats.collisions++;
+    if(++i == grid->M) i = 0;
+  }
+  stl_count_probe(&stl->stats.probes, probe);
+  return slot;
+}
+
+static float
+stl_vertex_distance(const stl_vertex *a, const stl_vertex *b) {
+  float d = ABS(a->x - b->x);
+
+  d = STL_MAX(d, ABS(a->y - b->y));
+  return STL_MAX(d, ABS(a->z - b->z));
+}
+
+static void
+stl_grid_initialize(stl_file *stl, stl_nearby_grid *grid,
+                    stl_index max_edges, float tolerance) {
+  stl_index i;
+
+  stl->stats.malloced = 0;
+  stl->stats.freed = 0;
+  stl->stats.collisions = 0;
+  memset(&stl->stats.probes, 0, sizeof(stl_probe_stats));
+
+  grid->num_edges = 0;
+  grid->tolerance = tolerance;
+  grid->min = stl->stats.min;
+  /* Every waiting edge adds at most one cube */
+  grid->M = 2 * max_edges + 1;
+  grid->edges = (stl_grid_edge*)malloc((max_edges + 1)
+                                       * sizeof(stl_grid_edge));
+  grid->cells = (stl_grid_cell*)malloc((size_t)grid->M
+                                       * sizeof(stl_grid_cell));
+  if(grid->edges == NULL || grid->cells == NULL) {
+    perror("stl_grid_initialize");
+    stl->error = 1;
+    return;
+  }
+  for(i = 0; i < grid->M; i++) {
+    grid->cells[i].head = -1;
+  }
+}
+
+static void
+stl_grid_free(stl_file *stl, stl_nearby_grid *grid) {
+  stl->stats.freed = stl->stats.malloced;
+  stl->stats.probes.slots = grid->cells != NULL ? grid->M : 0;
+  free(grid->edges);
+  free(grid->cells);
+  if(!stl->error) stl_log_probe_stats(stl, "nearby grid");
+}
+
+/* Matches edge j of the facet with the closest waiting edge, the oldest of
+   equally close ones, or else files it to wait for a match */
+static void
+stl_grid_insert_edge(stl_file *stl, stl_nearby_grid *grid,
+                     const stl_facet *facet, stl_index facet_number,
+                     int j) {
+  const stl_vertex *ends[2];
+  stl_grid_cell    *slot;
+  stl_grid_edge    *other;
+  stl_hash_edge    edge_a;
+  stl_hash_edge    edge_b;
+  unsigned         cell[3];
+  unsigned         around[3];
+  float            distance;
+  float            best_distance = 0;
+  stl_index        best = -1;
+  int              best_reversed = 0;
+  int              reversed;
+  int              d;
+  stl_index        k;
+
+  if (stl->error) return;
+
+  ends[0] = &facet->vertex[j];
+  ends[1] = &facet->vertex[(j + 1) % 3];
+  /* Like stl_load_edge_nearby, leave out edges shorter than the tolerance,
+     it could not tell their ends apart */
+  if(stl_vertex_distance(ends[0], ends[1]) <= grid->tolerance) return;
+
+  for(reversed = 0; reversed < 2; reversed++) {
+    stl_grid_cell_of(grid, ends[reversed], cell);
+    for(d = 0; d < 27; d++) {
+      around[0] = cell[0] + d % 3 - 1;
+      around[1] = cell[1] + d / 3 % 3 - 1;
+      around[2] = cell[2] + d / 9 - 1;
+      slot = stl_grid_find_cell(stl, grid, around);
+      for(k = slot->head; k != -1; k = other->next) {
+        other = &grid->edges[k];
+        if(other->facet_number == -1 || other->facet_number == facet_number) {
+          continue;
+        }
+        if(stl_vertex_distance(&other->a, ends[reversed]) > grid->tolerance
+            || stl_vertex_distance(&other->b, ends[!reversed])
+               > grid->tolerance) continue;
+        distance = stl_vertex_distance(&other->a, ends[reversed])
+                   + stl_vertex_distance(&other->b, ends[!reversed]);
+        if(best == -1 || distance < best_distance
+            || (distance == best_distance && k < best)) {
+          best = k;
+          best_distance = distance;
+          best_reversed = reversed;
+        }
+      }
+    }
+  }
+
+  if(best != -1) {
+    other = &grid->edges[best];
+    /* The first vertex of an edge goes with the first vertex of the other
+       one, which_edge + 3 marks an edge that is the other way round */
+    edge_a.facet_number = facet_number;
+    edge_a.which_edge = j + 3 * best_reversed;
+    edge_b.facet_number = other->facet_number;
+    edge_b.which_edge = other->which_edge;
+    other->facet_number = -1;
+    stl_match_neighbors_nearby(stl, &edge_a, &edge_b);
+    stl->stats.freed++;
+    return;
+  }
+
+  k = grid->num_edges++;
+  other = &grid->edges[k];
+  other->a = *ends[0];
+  other->b = *ends[1];
+  other->facet_number = facet_number;
+  other->which_edge = j;
+  other->next = -1;
+  stl_grid_cell_of(grid, ends[0], cell);
+  slot = stl_grid_find_cell(stl, grid, cell);
+  if(slot->head == -1) {
+    memcpy(slot->cell, cell, sizeof(slot->cell));
+    slot->head = k;
+  } else {
+    grid->edges[slot->tail].next = k;
+  }
+  slot->tail = k;
+  stl->stats.malloced++;
+}
+
 void
 stl_check_facets_nearby(stl_file *stl, float tolerance) {
-  stl_hash_edge  edge[3];
+  stl_edge_worklist worklist = {NULL, 0};
+
+  stl_check_facets_nearby_worklist(stl, tolerance, &worklist);
+  stl_free_edge_worklist(&worklist);
+}
+
+/* A nearby check that only goes through the edges in the worklist and
+   leaves the ones that are still unconnected in it.  A nearby check never
+   disconnects or renumbers facets, so checks with growing tolerance can
+   pass the list on as long as nothing else changes the mesh in between.
+   Later checks then cost time in proportion to the edges left. */
+void
+stl_check_facets_nearby_worklist(stl_file *stl, float tolerance,
+                                 stl_edge_worklist *worklist) {
+  const struct stl_check_state *check = stl_check_settings(stl);
+  stl_hash_edge  edge;
   stl_facet      facet;
-  int            i;
+  stl_nearby_grid grid;
+  stl_index      facet_number = -1;
+  stl_index      i;
   int            j;
+  stl_index      k;
+  stl_index      n;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   if(   (stl->stats.connected_facets_1_edge == stl->stats.number_of_facets)
         && (stl->stats.connected_facets_2_edge == stl->stats.number_of_facets)
@@ -285,25 +1139,77 @@ stl_check_facets_nearby(stl_file *stl, float tolerance) {
     return;
   }
 
-  stl_initialize_facet_check_nearby(stl);
-
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    facet = stl->facet_start[i];
-    for(j = 0; j < 3; j++) {
-      if(stl->neighbors_start[i].neighbor[j] == -1) {
-        edge[j].facet_number = i;
-        edge[j].which_edge = j;
-        if(stl_load_edge_nearby(stl, &edge[j], &facet.vertex[j],
-                                &facet.vertex[(j + 1) % 3],
-                                tolerance)) {
-          /* only insert edges that have different keys */
-          insert_hash_edge(stl, edge[j], stl_match_neighbors_nearby);
+  if(worklist->edges == NULL) {
+    worklist->edges = (stl_index*)malloc((stl->stats.number_of_facets * 3 + 1)
+                                         * sizeof(stl_index));
+    if(worklist->edges == NULL) {
+      perror("stl_check_facets_nearby_worklist");
+      stl->error = 1;
+      return;
+    }
+    worklist->count = 0;
+    for(i = 0; i < stl->stats.number_of_facets; i++) {
+      for(j = 0; j < 3; j++) {
+        if(stl->neighbors_start[i].neighbor[j] == -1) {
+          worklist->edges[worklist->count++] = 3 * i + j;
         }
       }
     }
   }
 
-  stl_free_edges(stl);
+  if(check->nearby_grid) {
+    stl_grid_initialize(stl, &grid, worklist->count, tolerance);
+  } else {
+    stl_initialize_facet_check_nearby(stl);
+  }
+  if(check->nearby_weld) stl_weld_begin(stl);
+
+  for(k = 0; k < worklist->count; k++) {
+    i = worklist->edges[k] / 3;
+    j = (int)(worklist->edges[k] % 3);
+    /* All edges of a facet are loaded from the vertices it had before the
+       first of them was matched */
+    if(i != facet_number) {
+      facet = stl->facet_start[i];
+      facet_number = i;
+    }
+    /* An earlier match in this check may have connected the edge */
+    if(stl->neighbors_start[i].neighbor[j] != -1) continue;
+    if(check->nearby_grid) {
+      stl_grid_insert_edge(stl, &grid, &facet, i, j);
+    } else {
+      edge.facet_number = i;
+      edge.which_edge = j;
+      if(stl_load_edge_nearby(stl, &edge, &facet.vertex[j],
+                              &facet.vertex[(j + 1) % 3],
+                              tolerance)) {
+        /* only insert edges that have different keys */
+        insert_hash_edge(stl, edge, stl_match_neighbors_nearby);
+      }
+    }
+  }
+
+  if(check->nearby_grid) {
+    stl_grid_free(stl, &grid);
+  } else {
+    stl_free_edges(stl, "nearby");
+  }
+  stl_weld_end(stl);
+
+  for(k = 0, n = 0; k < worklist->count; k++) {
+    if(stl->neighbors_start[worklist->edges[k] / 3].
+        neighbor[worklist->edges[k] % 3] == -1) {
+      worklist->edges[n++] = worklist->edges[k];
+    }
+  }
+  worklist->count = n;
+}
+
+void
+stl_free_edge_worklist(stl_edge_worklist *worklist) {
+  free(worklist->edges);
+  worklist->edges = NULL;
+  worklist->count = 0;
 }
 
 static int
@@ -369,78 +1275,49 @@ stl_load_edge_nearby(stl_file *stl, stl_hash_edge *edge,
 }
 
 static void
-stl_free_edges(stl_file *stl) {
-  int i;
-  stl_hash_edge *temp;
-
-  if (stl->error) return;
-
-  if(stl->stats.malloced != stl->stats.freed) {
-    for(i = 0; i < stl->M; i++) {
-      for(temp = stl->heads[i]; stl->heads[i] != stl->tail;
-          temp = stl->heads[i]) {
-        stl->heads[i] = stl->heads[i]->next;
-        free(temp);
-        stl->stats.freed++;
-      }
-    }
-  }
-  free(stl->heads);
-  free(stl->tail);
+stl_free_edges(stl_file *stl, const char *pass) {
+  /* The table is released in one go, even after an error.  Whatever is
+     left in it counts as freed. */
+  stl->stats.freed = stl->stats.malloced;
+  stl->stats.probes.slots = stl->edge_table != NULL ? stl->M : 0;
+  free(stl->edge_table);
+  stl->edge_table = NULL;
+  if(!stl->error) stl_log_probe_stats(stl, pass);
 }
 
 static void
 stl_initialize_facet_check_nearby(stl_file *stl) {
-  int i;
-
   if (stl->error) return;
 
-  stl->stats.malloced = 0;
-  stl->stats.freed = 0;
-  stl->stats.collisions = 0;
-
   /*  tolerance = STL_MAX(stl->stats.shortest_edge, tolerance);*/
   /*  tolerance = STL_MAX((stl->stats.bounding_diameter / 500000.0), tolerance);*/
   /*  tolerance *= 0.5;*/
 
-  stl->M = 81397;
-
-  stl->heads = (stl_hash_edge**)calloc(stl->M, sizeof(*stl->heads));
-  if(stl->heads == NULL) perror("stl_initialize_facet_check_nearby");
-
-  stl->tail = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-  if(stl->tail == NULL) perror("stl_initialize_facet_check_nearby");
-
-  stl->tail->next = stl->tail;
-
-  for(i = 0; i < stl->M; i++) {
-    stl->heads[i] = stl->tail;
-  }
+  stl_initialize_edge_table(stl, stl->stats.number_of_facets * 3,
+                            "stl_initialize_facet_check_nearby");
 }
 
 
 
+/* Makes facets a and b neighbors along the matched edge.  Different
+   matches only write different neighbor slots, see
+   stl_check_facets_exact_buckets. */
 static void
-stl_record_neighbors(stl_file *stl,
-                     stl_hash_edge *edge_a, stl_hash_edge *edge_b) {
-  int i;
-  int j;
-
-  if (stl->error) return;
-
+stl_link_neighbors(stl_neighbors *neighbors,
+                   const stl_hash_edge *edge_a, const stl_hash_edge *edge_b) {
   /* Facet a's neighbor is facet b */
-  stl->neighbors_start[edge_a->facet_number].neighbor[edge_a->which_edge % 3] =
+  neighbors[edge_a->facet_number].neighbor[edge_a->which_edge % 3] =
     edge_b->facet_number;	/* sets the .neighbor part */
 
-  stl->neighbors_start[edge_a->facet_number].
+  neighbors[edge_a->facet_number].
   which_vertex_not[edge_a->which_edge % 3] =
     (edge_b->which_edge + 2) % 3; /* sets the .which_vertex_not part */
 
   /* Facet b's neighbor is facet a */
-  stl->neighbors_start[edge_b->facet_number].neighbor[edge_b->which_edge % 3] =
+  neighbors[edge_b->facet_number].neighbor[edge_b->which_edge % 3] =
     edge_a->facet_number;	/* sets the .neighbor part */
 
-  stl->neighbors_start[edge_b->facet_number].
+  neighbors[edge_b->facet_number].
   which_vertex_not[edge_b->which_edge % 3] =
     (edge_a->which_edge + 2) % 3; /* sets the .which_vertex_not part */
 
@@ -448,12 +1325,22 @@ stl_record_neighbors(stl_file *stl,
         || ((edge_a->which_edge > 2) && (edge_b->which_edge > 2))) {
     /* these facets are oriented in opposite directions.  */
     /*  their normals are probably messed up. */
-    stl->neighbors_start[edge_a->facet_number].
+    neighbors[edge_a->facet_number].
     which_vertex_not[edge_a->which_edge % 3] += 3;
-    stl->neighbors_start[edge_b->facet_number].
+    neighbors[edge_b->facet_number].
     which_vertex_not[edge_b->which_edge % 3] += 3;
   }
+}
+
+static void
+stl_record_neighbors(stl_file *stl,
+                     stl_hash_edge *edge_a, stl_hash_edge *edge_b) {
+  int i;
+  int j;
 
+  if (stl->error) return;
+
+  stl_link_neighbors(stl->neighbors_start, edge_a, edge_b);
 
   /* Count successful connects */
   /* Total connects */
@@ -491,20 +1378,30 @@ stl_match_neighbors_exact(stl_file *stl,
 static void
 stl_match_neighbors_nearby(stl_file *stl,
                            stl_hash_edge *edge_a, stl_hash_edge *edge_b) {
-  int facet1;
-  int facet2;
+  stl_index facet1;
+  stl_index facet2;
   int vertex1;
   int vertex2;
   int vnot1;
   int vnot2;
   stl_vertex new_vertex1;
   stl_vertex new_vertex2;
+  stl_index source1;
+  stl_index source2;
 
   if (stl->error) return;
 
   stl_record_neighbors(stl, edge_a, edge_b);
   stl_which_vertices_to_change(stl, edge_a, edge_b, &facet1, &vertex1,
-                               &facet2, &vertex2, &new_vertex1, &new_vertex2);
+                               &facet2, &vertex2, &new_vertex1, &new_vertex2,
+                               &source1, &source2);
+  if(stl->check != NULL && stl->check->weld != NULL) {
+    /* The vertices are merged when the check is done */
+    if(facet1 != -1) stl_weld_add(stl, 3 * facet1 + vertex1, source1);
+    if(facet2 != -1) stl_weld_add(stl, 3 * facet2 + vertex2, source2);
+    stl->stats.edges_fixed += 2;
+    return;
+  }
   if(facet1 != -1) {
     if(facet1 == edge_a->facet_number) {
       vnot1 = (edge_a->which_edge + 2) % 3;
@@ -532,9 +1429,9 @@ stl_match_neighbors_nearby(stl_file *stl,
 
 
 static void
-stl_change_vertices(stl_file *stl, int facet_num, int vnot,
+stl_change_vertices(stl_file *stl, stl_index facet_num, int vnot,
                     stl_vertex new_vertex) {
-  int first_facet;
+  stl_index first_facet;
   int direction;
   int next_edge;
   int pivot_vertex;
@@ -583,11 +1480,142 @@ Try using a smaller tolerance or don't do a nearby check\n");
 }
 
 
+/* Vertex welding for the nearby check.  Instead of walking the fan around
+   a vertex for every match, the merges are collected while the check runs.
+   At the end the corners (3 * facet + vertex) that have to end up in the
+   same place are joined in a union-find structure, and facet_start is
+   rewritten in one pass.  Every set moves to the position of its root,
+   which the merges keep at the corner whose position wins. */
+struct stl_weld {
+  stl_index *merges;          /* corner and source corner, in match order */
+  stl_index num_merges;
+  stl_index max_merges;
+};
+
+static void
+stl_weld_begin(stl_file *stl) {
+  struct stl_weld *weld;
+
+  weld = (struct stl_weld*)malloc(sizeof(struct stl_weld));
+  if(weld == NULL) {
+    perror("stl_weld_begin");
+    stl->error = 1;
+    return;
+  }
+  weld->merges = NULL;
+  weld->num_merges = 0;
+  weld->max_merges = 0;
+  stl->check->weld = weld;
+}
+
+static void
+stl_weld_add(stl_file *stl, stl_index corner, stl_index source) {
+  struct stl_weld *weld = stl->check->weld;
+  stl_index       *merges;
+  stl_index       max_merges;
+
+  if(weld->num_merges == weld->max_merges) {
+    max_merges = 2 * weld->max_merges + 256;
+    merges = (stl_index*)realloc(weld->merges,
+                                 2 * (size_t)max_merges * sizeof(stl_index));
+    if(merges == NULL) {
+      perror("stl_weld_add");
+      stl->error = 1;
+      return;
+    }
+    weld->merges = merges;
+    weld->max_merges = max_merges;
+  }
+  weld->merges[2 * weld->num_merges] = corner;
+  weld->merges[2 * weld->num_merges + 1] = source;
+  weld->num_merges++;
+}
+
+static stl_index
+stl_weld_find(stl_index *parent, stl_index corner) {
+  while(parent[corner] != corner) {
+    parent[corner] = parent[parent[corner]];
+    corner = parent[corner];
+  }
+  return corner;
+}
+
+static void
+stl_weld_end(stl_file *stl) {
+  struct stl_weld *weld;
+  stl_facet       *facets = stl->facet_start;
+  stl_index       num_corners = 3 * stl->stats.number_of_facets;
+  stl_index       *parent = NULL;
+  stl_index       i;
+  int             j;
+  stl_index       k;
+  stl_index       n;
+  int             v;
+  stl_index       a;
+  stl_index       b;
+
+  if(stl->check == NULL || stl->check->weld == NULL) return;
+  weld = stl->check->weld;
+  stl->check->weld = NULL;
+
+  if(!stl->error && weld->num_merges > 0) {
+    parent = (stl_index*)malloc(num_corners * sizeof(stl_index));
+    if(parent == NULL) {
+      perror("stl_weld_end");
+      stl->error = 1;
+    }
+  }
+
+  if(parent != NULL) {
+    for(i = 0; i < num_corners; i++) {
+      parent[i] = i;
+    }
+
+    /* Corners that neighbors already share are one vertex */
+    for(i = 0; i < stl->stats.number_of_facets; i++) {
+      for(j = 0; j < 3; j++) {
+        n = stl->neighbors_start[i].neighbor[j];
+        if(n <= i) continue;
+        for(v = j; v != (j + 2) % 3; v = (v + 1) % 3) {
+          for(k = 0; k < 3; k++) {
+            if(!memcmp(&facets[i].vertex[v], &facets[n].vertex[k],
+                       sizeof(stl_vertex))) break;
+          }
+          if(k == 3) continue;
+          a = stl_weld_find(parent, 3 * i + v);
+          b = stl_weld_find(parent, 3 * n + k);
+          if(a != b) parent[a] = b;
+        }
+      }
+    }
+
+    /* A merge moves the corner's set to where the source's set is.  Like
+       the changes stl_change_vertices used to make, later ones win. */
+    for(i = 0; i < weld->num_merges; i++) {
+      a = stl_weld_find(parent, weld->merges[2 * i]);
+      b = stl_weld_find(parent, weld->merges[2 * i + 1]);
+      if(a != b) parent[a] = b;
+    }
+
+    /* Every corner takes the position of the root of its set.  The root
+       keeps its own, so it is never overwritten before it is read. */
+    for(i = 0; i < num_corners; i++) {
+      k = stl_weld_find(parent, i);
+      if(k != i) facets[i / 3].vertex[i % 3] = facets[k / 3].vertex[k % 3];
+    }
+  }
+
+  free(parent);
+  free(weld->merges);
+  free(weld);
+}
+
 static void
 stl_which_vertices_to_change(stl_file *stl, stl_hash_edge *edge_a,
-                             stl_hash_edge *edge_b, int *facet1, int *vertex1,
-                             int *facet2, int *vertex2,
-                             stl_vertex *new_vertex1, stl_vertex *new_vertex2) {
+                             stl_hash_edge *edge_b, stl_index *facet1,
+                             int *vertex1, stl_index *facet2, int *vertex2,
+                             stl_vertex *new_vertex1, stl_vertex *new_vertex2,
+                             stl_index *source1, stl_index *source2) {
   int v1a;			/* pair 1, facet a */
   int v1b;			/* pair 1, facet b */
   int v2a;			/* pair 2, facet a */
@@ -623,10 +1651,12 @@ stl_which_vertices_to_change(stl_file *stl, stl_hash_edge *edge_a,
       *facet1 = edge_a->facet_number;
       *vertex1 = v1a;
       *new_vertex1 = stl->facet_start[edge_b->facet_number].vertex[v1b];
+      *source1 = 3 * edge_b->facet_number + v1b;
     } else {
       *facet1 = edge_b->facet_number;
       *vertex1 = v1b;
       *new_vertex1 = stl->facet_start[edge_a->facet_number].vertex[v1a];
+      *source1 = 3 * edge_a->facet_number + v1a;
     }
   }
 
@@ -644,22 +1674,25 @@ stl_which_vertices_to_change(stl_file *stl, stl_hash_edge *edge_a,
       *facet2 = edge_a->facet_number;
       *vertex2 = v2a;
       *new_vertex2 = stl->facet_start[edge_b->facet_number].vertex[v2b];
+      *source2 = 3 * edge_b->facet_number + v2b;
     } else {
       *facet2 = edge_b->facet_number;
       *vertex2 = v2b;
       *new_vertex2 = stl->facet_start[edge_a->facet_number].vertex[v2a];
+      *source2 = 3 * edge_a->facet_number + v2a;
     }
   }
 }
 
 static void
-stl_remove_facet(stl_file *stl, int facet_number) {
-  int neighbor[3];
+stl_remove_facet(stl_file *stl, stl_index facet_number) {
+  stl_index neighbor[3];
   int vnot[3];
   int i;
   int j;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   stl->stats.facets_removed += 1;
   /* Update list of connected edges */
@@ -694,7 +1727,8 @@ stl_remove_facet(stl_file *stl, int facet_number) {
       if(stl->neighbors_start[neighbor[i]].neighbor[(vnot[i] + 1)% 3] !=
           stl->stats.number_of_facets) {
         printf("\
-in stl_remove_facet: neighbor = %d numfacets = %d this is wrong\n",
+in stl_remove_facet: neighbor = %" STL_INDEX_FORMAT " numfacets = %" \
+STL_INDEX_FORMAT " this is wrong\n",
                stl->neighbors_start[neighbor[i]].neighbor[(vnot[i] + 1)% 3],
                stl->stats.number_of_facets);
         return;
@@ -713,9 +1747,10 @@ stl_remove_unconnected_facets(stl_file *stl) {
   /* be done is to remove any degenerate facets that were created during */
   /* stl_check_facets_nearby(). */
 
-  int i;
+  stl_index i;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   /* remove degenerate facets */
   for(i = 0; i < stl->stats.number_of_facets; i++) {
@@ -745,13 +1780,13 @@ stl_remove_unconnected_facets(stl_file *stl) {
 }
 
 static void
-stl_remove_degenerate(stl_file *stl, int facet) {
+stl_remove_degenerate(stl_file *stl, stl_index facet) {
   int edge1;
   int edge2;
   int edge3;
-  int neighbor1;
-  int neighbor2;
-  int neighbor3;
+  stl_index neighbor1;
+  stl_index neighbor2;
+  stl_index neighbor3;
   int vnot1;
   int vnot2;
   int vnot3;
@@ -822,7 +1857,7 @@ stl_remove_degenerate(stl_file *stl, int facet) {
 }
 
 void
-stl_update_connects_remove_1(stl_file *stl, int facet_num) {
+stl_update_connects_remove_1(stl_file *stl, stl_index facet_num) {
   int j;
 
   if (
@@ -847,20 +1882,21 @@ void
 stl_fill_holes(stl_file *stl) {
   stl_facet facet;
   stl_facet new_facet;
-  int neighbors_initial[3];
+  stl_index neighbors_initial[3];
   stl_hash_edge edge;
-  int first_facet;
+  stl_index first_facet;
   int direction;
-  int facet_num;
+  stl_index facet_num;
   int vnot;
   int next_edge;
   int pivot_vertex;
-  int next_facet;
-  int i;
+  stl_index next_facet;
+  stl_index i;
   int j;
   int k;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   /* Insert all unconnected edges into hash list */
   stl_initialize_facet_check_nearby(stl);
@@ -943,18 +1979,26 @@ stl_fill_holes(stl_file *stl) {
           printf("\
 Back to the first facet filling holes: probably a mobius part.\n\
 Try using a smaller tolerance or don't do a nearby check\n");
+          stl_free_edges(stl, "fill holes");
           return;
         }
       }
     }
   }
-  free(stl->heads);
-  free(stl->tail);
+  stl_free_edges(stl, "fill holes");
 }
 
 void
 stl_add_facet(stl_file *stl, stl_facet *new_facet) {
   if (stl->error) return;
+  stl_invalidate_soa(stl);
+
+  if(stl->stats.number_of_facets >= STL_MAX_FACETS) {
+    fprintf(stderr, "stl_add_facet: no more than %" STL_INDEX_FORMAT
+            " facets fit in a mesh\n", (stl_index)STL_MAX_FACETS);
+    stl->error = 1;
+    return;
+  }
 
   stl->stats.facets_added += 1;
   if(stl->stats.facets_malloced < stl->stats.number_of_facets + 1) {
@@ -0,0 +1,348 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/admesh/admesh/issues
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "stl.h"
+#include "format.h"
+#include "threads.h"
+
+/* Size of the buffer stl_text_writer collects output in */
+#define STL_TEXT_BUFFER_SIZE (1 << 18)
+/* Items a thread formats in one go when the work is split */
+#define STL_TEXT_BATCH_ITEMS 4096
+
+/* Every power of ten up to 1e22 is exact in a double */
+static const double stl_format_powers[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Sets *scaled to value * 10^k with a single rounding, returns 0 if k is
+   out of the exact range */
+static int
+stl_format_scale(double value, int k, double *scaled) {
+  if(k > 22 || k < -22) return 0;
+  if(k >= 0) {
+    *scaled = value * stl_format_powers[k];
+  } else {
+    *scaled = value / stl_format_powers[-k];
+  }
+  return 1;
+}
+
+static char *
+stl_format_digits(char *out, uint64_t value, int width) {
+  char digits[24];
+  int  n = 0;
+
+  do {
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+  } while(value != 0 || n < width);
+  while(n > 0) *out++ = digits[--n];
+  return out;
+}
+
+char *
+stl_format_exp(char *out, double value) {
+  double   a = fabs(value);
+  double   scaled;
+  double   frac;
+  uint64_t n;
+  int      e10;
+  char     *p;
+
+  if(value != value || value - value != 0) {
+    return out + snprintf(out, STL_FORMAT_MAX, "% .8E", value);
+  }
+
+  *out = signbit(value) ? '-' : ' ';
+  if(a == 0) {
+    memcpy(out + 1, "0.00000000E+00", 14);
+    return out + 15;
+  }
+
+  /* Scale to nine digits before the point, log10 may be one off */
+  e10 = (int)floor(log10(a));
+  if(!stl_format_scale(a, 8 - e10, &scaled)) goto slow;
+  if(scaled >= 1e9) {
+    e10++;
+    if(!stl_format_scale(a, 8 - e10, &scaled)) goto slow;
+  } else if(scaled < 1e8) {
+    e10--;
+    if(!stl_format_scale(a, 8 - e10, &scaled)) goto slow;
+  }
+
+  /* scaled is off by at most half an ulp, about 1e-7 here.  Halfway cases
+     and anything that close to one need the exact expansion. */
+  frac = scaled - floor(scaled);
+  if(fabs(frac - 0.5) < 1e-6) goto slow;
+  n = (uint64_t)floor(scaled) + (frac > 0.5);
+  if(n == 1000000000) {
+    n = 100000000;
+    e10++;
+  }
+
+  p = stl_format_digits(out + 1, n, 9);
+  /* Make room for the point after the first digit */
+  memmove(out + 3, out + 2, 8);
+  out[2] = '.';
+  p++;
+  *p++ = 'E';
+  *p++ = e10 < 0 ? '-' : '+';
+  return stl_format_digits(p, e10 < 0 ? -e10 : e10, 2);
+
+slow:
+  return out + snprintf(out, STL_FORMAT_MAX, "% .8E", value);
+}
+
+char *
+stl_format_fixed(char *out, double value, int precision) {
+  double   a = fabs(value);
+  double   scaled;
+  double   frac;
+  uint64_t n;
+  uint64_t unit;
+  char     *p;
+
+  if(value != value || value - value != 0 || precision < 0 || precision > 9) {
+    goto slow;
+  }
+
+  scaled = a * stl_format_powers[precision];
+  /* Below 2^52 the fraction of scaled is exact, and scaled itself is off by
+     at most half an ulp */
+  if(scaled >= 4503599627370496.0) goto slow;
+  frac = scaled - floor(scaled);
+  if(fabs(frac - 0.5) <= scaled * 1e-15) goto slow;
+  n = (uint64_t)floor(scaled) + (frac > 0.5);
+
+  p = out;
+  if(signbit(value)) *p++ = '-';
+  unit = (uint64_t)stl_format_powers[precision];
+  p = stl_format_digits(p, n / unit, 1);
+  if(precision > 0) {
+    *p++ = '.';
+    p = stl_format_digits(p, n % unit, precision);
+  }
+  return p;
+
+slow:
+  return out + snprintf(out, STL_FORMAT_MAX, "%.*f", precision, value);
+}
+
+char *
+stl_format_int(char *out, int value) {
+  return stl_format_index(out, value);
+}
+
+char *
+stl_format_index(char *out, stl_index value) {
+  if(value < 0) {
+    *out++ = '-';
+    return stl_format_digits(out, -(uint64_t)value, 1);
+  }
+  return stl_format_digits(out, (uint64_t)value, 1);
+}
+
+char *
+stl_format_str(char *out, const char *text) {
+  size_t len = strlen(text);
+
+  memcpy(out, text, len);
+  return out + len;
+}
+
+void
+stl_text_begin(stl_text_writer *w, FILE *fp) {
+  size_t size = STL_TEXT_BUFFER_SIZE;
+
+  w->fp = fp;
+  w->error = 0;
+  w->buffer = (char*)malloc(size);
+  if(w->buffer == NULL) {
+    /* Still works, just with more fwrite calls */
+    w->buffer = w->fallback;
+    size = sizeof(w->fallback);
+  }
+  w->p = w->buffer;
+  w->end = w->buffer + size;
+}
+
+void
+stl_text_flush(stl_text_writer *w) {
+  size_t len = w->p - w->buffer;
+
+  if(len > 0 && fwrite(w->buffer, 1, len, w->fp) != len) w->error = 1;
+  w->p = w->buffer;
+}
+
+int
+stl_text_end(stl_text_writer *w) {
+  stl_text_flush(w);
+  if(w->buffer != w->fallback) free(w->buffer);
+  w->buffer = NULL;
+  return w->error;
+}
+
+void
+stl_text_write(stl_text_writer *w, const char *text, size_t len) {
+  size_t room;
+
+  while(len > 0) {
+    if(w->p == w->end) stl_text_flush(w);
+    room = w->end - w->p;
+    if(room > len) room = len;
+    memcpy(w->p, text, room);
+    w->p += room;
+    text += room;
+    len -= room;
+  }
+}
+
+void
+stl_text_str(stl_text_writer *w, const char *text) {
+  stl_text_write(w, text, strlen(text));
+}
+
+/* Text of STL_TEXT_BATCH_ITEMS consecutive items */
+typedef struct {
+  char   *text;
+  size_t len;
+  size_t size;
+  int    error;
+} stl_text_batch;
+
+/* Each round, tasks 1 to num_batches format the next items into one set of
+   batches while task 0 writes out the set filled the round before */
+typedef struct {
+  stl_text_writer    *w;
+  stl_text_item_func func;
+  const void         *arg;
+  stl_index          count;
+  stl_index          round;
+  int                num_batches;
+  stl_text_batch     *batches[2];
+} stl_text_job;
+
+static void
+stl_text_write_batches(stl_text_writer *w, stl_text_batch *batches,
+                       int num_batches) {
+  int i;
+
+  for(i = 0; i < num_batches; i++) {
+    if(batches[i].error) w->error = 1;
+    if(batches[i].len > 0 && !w->error &&
+       fwrite(batches[i].text, 1, batches[i].len, w->fp) != batches[i].len) {
+      w->error = 1;
+    }
+    batches[i].len = 0;
+  }
+}
+
+static void
+stl_text_format_batch(stl_text_job *job, stl_text_batch *batch,
+                      stl_index first) {
+  char      *text;
+  size_t    size;
+  stl_index last = first + STL_TEXT_BATCH_ITEMS;
+  stl_index i;
+
+  if(last > job->count) last = job->count;
+  for(i = first; i < last && !batch->error; i++) {
+    if(batch->size - batch->len < STL_TEXT_ITEM_MAX) {
+      size = batch->size * 2 + STL_TEXT_BATCH_ITEMS * 64;
+      text = (char*)realloc(batch->text, size);
+      if(text == NULL) {
+        batch->error = 1;
+        break;
+      }
+      batch->text = text;
+      batch->size = size;
+    }
+    batch->len = job->func(batch->text + batch->len, job->arg, i)
+                 - batch->text;
+  }
+}
+
+static void
+stl_text_task(void *arg, int task) {
+  stl_text_job *job = (stl_text_job*)arg;
+  int          set = (int)(job->round & 1);
+
+  if(task == 0) {
+    if(job->round > 0) {
+      stl_text_write_batches(job->w, job->batches[!set], job->num_batches);
+    }
+    return;
+  }
+  task--;
+  stl_text_format_batch(job, &job->batches[set][task],
+                        (job->round * job->num_batches + task)
+                        * STL_TEXT_BATCH_ITEMS);
+}
+
+void
+stl_text_items(stl_text_writer *w, stl_index count, stl_text_item_func func,
+               const void *arg) {
+  stl_text_job job;
+  int          num_batches;
+  stl_index    i;
+
+  num_batches = stl_thread_count();
+  if(num_batches > count / STL_TEXT_BATCH_ITEMS) {
+    num_batches = (int)(count / STL_TEXT_BATCH_ITEMS);
+  }
+
+  if(num_batches >= 2) {
+    job.w = w;
+    job.func = func;
+    job.arg = arg;
+    job.count = count;
+    job.num_batches = num_batches;
+    job.batches[0] = (stl_text_batch*)
+                     calloc(2 * num_batches, sizeof(stl_text_batch));
+    if(job.batches[0] != NULL) {
+      job.batches[1] = job.batches[0] + num_batches;
+      stl_text_flush(w);
+      for(job.round = 0;
+          job.round * num_batches * STL_TEXT_BATCH_ITEMS < count; job.round++) {
+        stl_parallel_for(num_batches + 1, stl_text_task, &job);
+      }
+      stl_text_write_batches(w, job.batches[!(job.round & 1)], num_batches);
+      for(i = 0; i < 2 * num_batches; i++) {
+        free(job.batches[0][i].text);
+      }
+      free(job.batches[0]);
+      return;
+    }
+  }
+
+  for(i = 0; i < count; i++) {
+    if(w->end - w->p < STL_TEXT_ITEM_MAX) stl_text_flush(w);
+    w->p = func(w->p, arg, i);
+  }
+}
@@ -0,0 +1,75 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/admesh/admesh/issues
+ */
+
+#ifndef __admesh_format__
+#define __admesh_format__
+
+#include <stdio.h>
+
+#include "stl.h"
+
+/* Internal number formatting for the text writers, not part of the
+   installed API.  The output is byte for byte what printf gives in the C
+   locale, cases the fast paths cannot decide exactly go to snprintf. */
+
+/* Room a single formatted number may take, terminating NUL included */
+#define STL_FORMAT_MAX 64
+
+/* Longest text an stl_text_item_func may produce for one item */
+#define STL_TEXT_ITEM_MAX 1024
+
+/* Each of these writes at most STL_FORMAT_MAX - 1 characters at out, without
+   a terminating NUL, and returns the position after the last one */
+extern char *stl_format_exp(char *out, double value);       /* "% .8E" */
+extern char *stl_format_fixed(char *out, double value,
+                              int precision);              /* "%.*f" */
+extern char *stl_format_int(char *out, int value);          /* "%d" */
+extern char *stl_format_index(char *out, stl_index value);  /* the same */
+/* Copies text without its NUL */
+extern char *stl_format_str(char *out, const char *text);
+
+/* Formats item number item of arg at out, like the functions above */
+typedef char *(*stl_text_item_func)(char *out, const void *arg,
+                                    stl_index item);
+
+/* Buffered output to a stdio stream */
+typedef struct {
+  FILE *fp;
+  char *buffer;
+  char *p;
+  char *end;
+  int  error;
+  char fallback[2 * STL_TEXT_ITEM_MAX];
+} stl_text_writer;
+
+extern void stl_text_begin(stl_text_writer *w, FILE *fp);
+/* Flushes and frees the buffer, returns nonzero if a write failed */
+extern int stl_text_end(stl_text_writer *w);
+extern void stl_text_flush(stl_text_writer *w);
+extern void stl_text_write(stl_text_writer *w, const char *text, size_t len);
+extern void stl_text_str(stl_text_writer *w, const char *text);
+/* Writes func(arg, 0) to func(arg, count - 1) in this order.  Large jobs
+   are formatted on several threads. */
+extern void stl_text_items(stl_text_writer *w, stl_index count,
+                           stl_text_item_func func, const void *arg);
+
+#endif
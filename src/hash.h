@@ -0,0 +1,50 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/admesh/admesh/issues
+ */
+
+#ifndef __admesh_hash__
+#define __admesh_hash__
+
+#include <stdint.h>
+
+#include "stl.h"
+
+/* Internal hashing helpers, not part of the installed API */
+
+/* Multiply-xorshift hash of n 32 bit words, used for the edge tables, the
+   nearby grid and the shared vertices.  Coordinates on a regular grid
+   share most of their bits, so every word is mixed into all the bits of
+   the hash. */
+extern uint64_t stl_hash_words(const unsigned *words, int n);
+
+/* Scales the top 32 bits of a hash to a slot in [0, M) without a division.
+   Only a table of more than 2^32 slots, which takes STL_INDEX_64, needs the
+   whole hash and the division. */
+#ifdef STL_INDEX_64
+#define STL_HASH_SLOT(hash, M) \
+  ((M) > 0xffffffffLL ? (stl_index)((hash) % (uint64_t)(M)) \
+   : (stl_index)((((hash) >> 32) * (uint64_t)(M)) >> 32))
+#else
+#define STL_HASH_SLOT(hash, M) \
+  ((stl_index)((((hash) >> 32) * (uint64_t)(M)) >> 32))
+#endif
+
+#endif
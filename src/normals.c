@@ -26,20 +26,21 @@
 #include <math.h>
 
 #include "stl.h"
+#include "threads.h"
 
-static void stl_reverse_facet(stl_file *stl, int facet_num);
+static void stl_reverse_facet(stl_file *stl, stl_index facet_num);
 static void stl_reverse_vector(float v[]);
-int stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag);
+static int stl_check_facet_normal(stl_facet *facet, int normal_fix_flag);
+int stl_check_normal_vector(stl_file *stl, stl_index facet_num,
+                            int normal_fix_flag);
 
 static void
-stl_reverse_facet(stl_file *stl, int facet_num) {
+stl_reverse_facet(stl_file *stl, stl_index facet_num) {
   stl_vertex tmp_vertex;
   /*  int tmp_neighbor;*/
-  int neighbor[3];
+  stl_index neighbor[3];
   int vnot[3];
 
-  stl->stats.facets_reversed += 1;
-
   neighbor[0] = stl->neighbors_start[facet_num].neighbor[0];
   neighbor[1] = stl->neighbors_start[facet_num].neighbor[1];
   neighbor[2] = stl->neighbors_start[facet_num].neighbor[2];
@@ -84,50 +85,37 @@ stl_reverse_facet(stl_file *stl, int facet_num) {
     (stl->neighbors_start[facet_num].which_vertex_not[2] + 3) % 6;
 }
 
-void
-stl_fix_normal_directions(stl_file *stl) {
-  char *norm_sw;
-  /*  int edge_num;*/
-  /*  int vnot;*/
-  int checked = 0;
-  int facet_num;
-  /*  int next_facet;*/
-  int i;
+/* Facets still to be fixed, taken from the top.  A facet can be on the
+   stack several times, so it grows when it has to. */
+typedef struct {
+  stl_index *facets;
+  stl_index size;
+  stl_index top;
+} stl_facet_stack;
+
+/* Fixes the directions of all facets that can be reached from first, so
+   that they agree with first.  Returns the number of facets reversed, or -1
+   if the stack could not grow.  Everything it reads or changes belongs to
+   the part of first, so parts can be fixed at the same time. */
+static stl_index
+stl_fix_part_directions(stl_file *stl, stl_index first, char *norm_sw,
+                        stl_facet_stack *stack) {
+  stl_index facet_num = first;
+  stl_index reversed = 0;
+  stl_index *new_facets;
   int j;
-  struct stl_normal {
-    int               facet_num;
-    struct stl_normal *next;
-  };
-  struct stl_normal *head;
-  struct stl_normal *tail;
-  struct stl_normal *newn;
-  struct stl_normal *temp;
-
-  if (stl->error) return;
-
-  /* Initialize linked list. */
-  head = (struct stl_normal*)malloc(sizeof(struct stl_normal));
-  if(head == NULL) perror("stl_fix_normal_directions");
-  tail = (struct stl_normal*)malloc(sizeof(struct stl_normal));
-  if(tail == NULL) perror("stl_fix_normal_directions");
-  head->next = tail;
-  tail->next = tail;
 
-  /* Initialize list that keeps track of already fixed facets. */
-  norm_sw = (char*)calloc(stl->stats.number_of_facets, sizeof(char));
-  if(norm_sw == NULL) perror("stl_fix_normal_directions");
-
-
-  facet_num = 0;
   /* If normal vector is not within tolerance and backwards:
-     Arbitrarily starts at face 0.  If this one is wrong, we're screwed.  Thankfully, the chances
-     of it being wrong randomly are low if most of the triangles are right: */
-  if(stl_check_normal_vector(stl, 0, 0) == 2)
-    stl_reverse_facet(stl, 0);
+     Arbitrarily starts at the first facet of the part.  If this one is
+     wrong, we're screwed.  Thankfully, the chances of it being wrong
+     randomly are low if most of the triangles are right: */
+  if(stl_check_normal_vector(stl, first, 0) == 2) {
+    stl_reverse_facet(stl, first);
+    reversed++;
+  }
 
   /* Say that we've fixed this facet: */
-  norm_sw[facet_num] = 1;
-  checked++;
+  norm_sw[first] = 1;
 
   for(;;) {
     /* Add neighbors_to_list.
@@ -139,6 +127,7 @@ stl_fix_normal_directions(stl_file *stl) {
         if(stl->neighbors_start[facet_num].neighbor[j] != -1) {
           stl_reverse_facet
           (stl, stl->neighbors_start[facet_num].neighbor[j]);
+          reversed++;
         }
       }
       /* If this edge of the facet is connected: */
@@ -146,56 +135,375 @@ stl_fix_normal_directions(stl_file *stl) {
          stl->neighbors_start[facet_num].neighbor[j] < stl->stats.number_of_facets*(int)sizeof(char)) {
         /* If we haven't fixed this facet yet, add it to the list: */
         if(norm_sw[stl->neighbors_start[facet_num].neighbor[j]] != 1) {
-          /* Add node to beginning of list. */
-          newn = (struct stl_normal*)malloc(sizeof(struct stl_normal));
-          if(newn == NULL) perror("stl_fix_normal_directions");
-          newn->facet_num = stl->neighbors_start[facet_num].neighbor[j];
-          newn->next = head->next;
-          head->next = newn;
+          /* Push it on the stack. */
+          if(stack->top == stack->size) {
+            new_facets = (stl_index*)realloc(stack->facets,
+                                             2 * (size_t)stack->size
+                                             * sizeof(stl_index));
+            if(new_facets == NULL) return -1;
+            stack->facets = new_facets;
+            stack->size *= 2;
+          }
+          stack->facets[stack->top++] =
+            stl->neighbors_start[facet_num].neighbor[j];
         }
       }
     }
-    /* Get next facet to fix from top of list. */
-    if(head->next != tail) {
-      facet_num = head->next->facet_num;
-      if(norm_sw[facet_num] != 1) { /* If facet is in list mutiple times */
-        norm_sw[facet_num] = 1; /* Record this one as being fixed. */
-        checked++;
+    /* Get next facet to fix from top of the stack.  If we ran out of
+       facets to fix, all of the facets in this part have been fixed. */
+    if(stack->top == 0) break;
+    facet_num = stack->facets[--stack->top];
+    norm_sw[facet_num] = 1; /* Record this one as being fixed. */
+  }
+  return reversed;
+}
+
+/* Labelling splits the facets into one chunk per thread.  Every chunk joins
+   the facets it links to within itself, then the links between chunks are
+   joined on one thread.  A part's root is always its lowest facet, so the
+   parts are numbered in the order of their lowest facets. */
+typedef struct {
+  stl_file *stl;
+  stl_index *parent;
+  stl_index *part_ids;
+  stl_index *roots;           /* [chunk] roots, then the number of the
+                                 chunk's first part */
+  int      num_chunks;
+} stl_label_job;
+
+static stl_index
+stl_chunk_start(const stl_label_job *job, int chunk) {
+  return (stl_index)((long long)job->stl->stats.number_of_facets * chunk
+                     / job->num_chunks);
+}
+
+/* Union-find with path halving */
+static stl_index
+stl_find_part(stl_index *parent, stl_index facet) {
+  while(parent[facet] != facet) {
+    parent[facet] = parent[parent[facet]];
+    facet = parent[facet];
+  }
+  return facet;
+}
+
+static void
+stl_join_parts(stl_index *parent, stl_index a, stl_index b) {
+  a = stl_find_part(parent, a);
+  b = stl_find_part(parent, b);
+  if(a < b) parent[b] = a;
+  else if(b < a) parent[a] = b;
+}
+
+static int
+stl_is_linked(const stl_file *stl, stl_index neighbor) {
+  return neighbor >= 0 && neighbor < stl->stats.number_of_facets;
+}
+
+static void
+stl_label_join_chunk(void *arg, int chunk) {
+  stl_label_job *job = (stl_label_job*)arg;
+  stl_index     start = stl_chunk_start(job, chunk);
+  stl_index     end = stl_chunk_start(job, chunk + 1);
+  stl_index     neighbor;
+  stl_index     i;
+  int           j;
+
+  for(i = start; i < end; i++) job->parent[i] = i;
+  for(i = start; i < end; i++) {
+    for(j = 0; j < 3; j++) {
+      neighbor = job->stl->neighbors_start[i].neighbor[j];
+      if(stl_is_linked(job->stl, neighbor) && neighbor >= start
+          && neighbor < end) {
+        stl_join_parts(job->parent, i, neighbor);
       }
-      temp = head->next;	/* Delete this facet from the list. */
-      head->next = head->next->next;
-      free(temp);
-    } else { /* if we ran out of facets to fix: */
-      /* All of the facets in this part have been fixed. */
-      stl->stats.number_of_parts += 1;
-      if(checked >= stl->stats.number_of_facets) {
-        /* All of the facets have been checked.  Bail out. */
-        break;
-      } else {
-        /* There is another part here.  Find it and continue. */
-        for(i = 0; i < stl->stats.number_of_facets; i++) {
-          if(norm_sw[i] == 0) {
-            /* This is the first facet of the next part. */
-            facet_num = i;
-            if(stl_check_normal_vector(stl, i, 0) == 2) {
-              stl_reverse_facet(stl, i);
-            }
-
-            norm_sw[facet_num] = 1;
-            checked++;
-            break;
+    }
+  }
+}
+
+static void
+stl_label_find_chunk(void *arg, int chunk) {
+  stl_label_job *job = (stl_label_job*)arg;
+  stl_index     end = stl_chunk_start(job, chunk + 1);
+  stl_index     roots = 0;
+  stl_index     facet;
+  stl_index     i;
+
+  /* Other chunks read the parents too, so the paths are not shortened */
+  for(i = stl_chunk_start(job, chunk); i < end; i++) {
+    for(facet = i; job->parent[facet] != facet; facet = job->parent[facet]);
+    job->part_ids[i] = facet;
+    if(facet == i) roots++;
+  }
+  job->roots[chunk] = roots;
+}
+
+/* The parents of the roots are not needed anymore, they take the numbers */
+static void
+stl_label_number_chunk(void *arg, int chunk) {
+  stl_label_job *job = (stl_label_job*)arg;
+  stl_index     end = stl_chunk_start(job, chunk + 1);
+  stl_index     part = job->roots[chunk];
+  stl_index     i;
+
+  for(i = stl_chunk_start(job, chunk); i < end; i++) {
+    if(job->part_ids[i] == i) job->parent[i] = part++;
+  }
+}
+
+static void
+stl_label_copy_chunk(void *arg, int chunk) {
+  stl_label_job *job = (stl_label_job*)arg;
+  stl_index     end = stl_chunk_start(job, chunk + 1);
+  stl_index     i;
+
+  for(i = stl_chunk_start(job, chunk); i < end; i++) {
+    job->part_ids[i] = job->parent[job->part_ids[i]];
+  }
+}
+
+/* Sets part_ids[facet] to the number of the part the facet belongs to and
+   returns the number of parts.  Facets are in the same part if they are
+   connected through the neighbors, in either direction.  Parts are
+   numbered from 0 in the order of their lowest facet. */
+stl_index
+stl_label_parts(stl_file *stl, stl_index *part_ids) {
+  stl_label_job job;
+  stl_index     neighbor;
+  int           chunk;
+  stl_index     parts = 0;
+  stl_index     start;
+  stl_index     end;
+  stl_index     roots;
+  stl_index     i;
+  int           j;
+
+  if (stl->error) return 0;
+
+  job.stl = stl;
+  job.part_ids = part_ids;
+  job.num_chunks = (int)STL_MAX(1, STL_MIN(stl_thread_count(),
+                                           stl->stats.number_of_facets));
+  job.parent = (stl_index*)malloc((stl->stats.number_of_facets + 1)
+                                  * sizeof(stl_index));
+  job.roots = (stl_index*)malloc(job.num_chunks * sizeof(stl_index));
+  if(job.parent == NULL || job.roots == NULL) {
+    perror("stl_label_parts");
+    stl->error = 1;
+  } else {
+    stl_parallel_for(job.num_chunks, stl_label_join_chunk, &job);
+
+    for(chunk = 0; chunk < job.num_chunks; chunk++) {
+      start = stl_chunk_start(&job, chunk);
+      end = stl_chunk_start(&job, chunk + 1);
+      for(i = start; i < end; i++) {
+        for(j = 0; j < 3; j++) {
+          neighbor = stl->neighbors_start[i].neighbor[j];
+          if(stl_is_linked(stl, neighbor) && (neighbor < start
+                                              || neighbor >= end)) {
+            stl_join_parts(job.parent, i, neighbor);
           }
         }
       }
     }
+
+    stl_parallel_for(job.num_chunks, stl_label_find_chunk, &job);
+    for(chunk = 0; chunk < job.num_chunks; chunk++) {
+      roots = job.roots[chunk];
+      job.roots[chunk] = parts;
+      parts += roots;
+    }
+    stl_parallel_for(job.num_chunks, stl_label_number_chunk, &job);
+    stl_parallel_for(job.num_chunks, stl_label_copy_chunk, &job);
+  }
+
+  free(job.parent);
+  free(job.roots);
+  return parts;
+}
+
+/* The parallel fix hands out whole parts, every task takes every
+   num_tasks-th part with a stack of its own */
+typedef struct {
+  stl_file *stl;
+  char     *norm_sw;
+  stl_index *part_facets;     /* grouped by part, in order within a part */
+  stl_index *part_start;      /* [part] */
+  stl_index num_parts;
+  int      num_tasks;
+  stl_index *reversed;        /* [task] -1 if it ran out of memory */
+  stl_index *fills;           /* [task] */
+} stl_directions_job;
+
+static void
+stl_fix_directions_task(void *arg, int task) {
+  stl_directions_job *job = (stl_directions_job*)arg;
+  stl_facet_stack    stack;
+  stl_index          reversed;
+  stl_index          part;
+  stl_index          i;
+
+  job->reversed[task] = 0;
+  job->fills[task] = 0;
+  stack.size = 1024;
+  stack.top = 0;
+  stack.facets = (stl_index*)malloc(stack.size * sizeof(stl_index));
+  if(stack.facets == NULL) {
+    job->reversed[task] = -1;
+    return;
+  }
+  for(part = task; part < job->num_parts; part += job->num_tasks) {
+    for(i = job->part_start[part]; i < job->part_start[part + 1]; i++) {
+      if(job->norm_sw[job->part_facets[i]]) continue;
+      reversed = stl_fix_part_directions(job->stl, job->part_facets[i],
+                                         job->norm_sw, &stack);
+      if(reversed < 0) {
+        job->reversed[task] = -1;
+        free(stack.facets);
+        return;
+      }
+      job->reversed[task] += reversed;
+      job->fills[task]++;
+    }
+  }
+  free(stack.facets);
+}
+
+/* Labels the parts and fixes them at the same time.  Within a part the
+   facets are fixed in the same order as on one thread, so the result is
+   the same. */
+static void
+stl_fix_normal_directions_parts(stl_file *stl, char *norm_sw) {
+  stl_directions_job job;
+  stl_index          *part_ids;
+  stl_index          part;
+  stl_index          i;
+
+  job.stl = stl;
+  job.norm_sw = norm_sw;
+  job.num_tasks = stl_thread_count();
+  part_ids = (stl_index*)malloc(stl->stats.number_of_facets
+                                * sizeof(stl_index));
+  job.part_facets = (stl_index*)malloc(stl->stats.number_of_facets
+                                       * sizeof(stl_index));
+  job.reversed = (stl_index*)malloc(2 * job.num_tasks * sizeof(stl_index));
+  job.fills = job.reversed + job.num_tasks;
+  job.part_start = NULL;
+  if(part_ids == NULL || job.part_facets == NULL || job.reversed == NULL) {
+    perror("stl_fix_normal_directions");
+    stl->error = 1;
+  } else {
+    job.num_parts = stl_label_parts(stl, part_ids);
+    if(!stl->error) {
+      job.part_start = (stl_index*)calloc(job.num_parts + 2,
+                                          sizeof(stl_index));
+    }
+    if(!stl->error && job.part_start == NULL) {
+      perror("stl_fix_normal_directions");
+      stl->error = 1;
+    }
+  }
+  if(!stl->error) {
+    /* Counting sort of the facets by part */
+    for(i = 0; i < stl->stats.number_of_facets; i++) {
+      job.part_start[part_ids[i] + 2]++;
+    }
+    for(part = 2; part < job.num_parts + 2; part++) {
+      job.part_start[part] += job.part_start[part - 1];
+    }
+    for(i = 0; i < stl->stats.number_of_facets; i++) {
+      job.part_facets[job.part_start[part_ids[i] + 1]++] = i;
+    }
+
+    stl_parallel_for(job.num_tasks, stl_fix_directions_task, &job);
+
+    for(i = 0; i < job.num_tasks; i++) {
+      if(job.reversed[i] < 0) {
+        perror("stl_fix_normal_directions");
+        stl->error = 1;
+        break;
+      }
+      stl->stats.facets_reversed += job.reversed[i];
+      stl->stats.number_of_parts += job.fills[i];
+    }
   }
-  free(head);
-  free(tail);
+
+  free(part_ids);
+  free(job.part_facets);
+  free(job.part_start);
+  free(job.reversed);
+}
+
+void
+stl_fix_normal_directions(stl_file *stl) {
+  char *norm_sw;
+  stl_facet_stack stack;
+  stl_index reversed;
+  stl_index i;
+
+  if (stl->error) return;
+  stl_invalidate_soa(stl);
+
+  /* Initialize list that keeps track of already fixed facets. */
+  norm_sw = (char*)calloc(stl->stats.number_of_facets + 1, sizeof(char));
+  if(norm_sw == NULL) {
+    perror("stl_fix_normal_directions");
+    stl->error = 1;
+    return;
+  }
+
+  if(stl_thread_count() > 1 &&
+      stl->stats.number_of_facets >= stl_parallel_min_facets()) {
+    stl_fix_normal_directions_parts(stl, norm_sw);
+    free(norm_sw);
+    return;
+  }
+
+  stack.size = stl->stats.number_of_facets + 1;
+  stack.top = 0;
+  stack.facets = (stl_index*)malloc(stack.size * sizeof(stl_index));
+  if(stack.facets == NULL) {
+    perror("stl_fix_normal_directions");
+    stl->error = 1;
+    free(norm_sw);
+    return;
+  }
+
+  /* Every facet that is not fixed yet by the time we get to it starts a
+     new part */
+  for(i = 0; i < stl->stats.number_of_facets; i++) {
+    if(norm_sw[i]) continue;
+    reversed = stl_fix_part_directions(stl, i, norm_sw, &stack);
+    if(reversed < 0) {
+      perror("stl_fix_normal_directions");
+      stl->error = 1;
+      break;
+    }
+    stl->stats.facets_reversed += reversed;
+    stl->stats.number_of_parts += 1;
+  }
+
+  free(stack.facets);
   free(norm_sw);
 }
 
 int
-stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag) {
+stl_check_normal_vector(stl_file *stl, stl_index facet_num,
+                        int normal_fix_flag) {
+  int status;
+
+  status = stl_check_facet_normal(&stl->facet_start[facet_num],
+                                  normal_fix_flag);
+  if(normal_fix_flag && status != 0) {
+    stl->stats.normals_fixed += 1;
+  }
+  return status;
+}
+
+/* stl_check_normal_vector without the count of fixed normals, so that
+   several threads can check facets at once */
+static int
+stl_check_facet_normal(stl_facet *facet, int normal_fix_flag) {
   /* Returns 0 if the normal is within tolerance */
   /* Returns 1 if the normal is not within tolerance, but direction is OK */
   /* Returns 2 if the normal is not within tolerance and backwards */
@@ -203,9 +511,6 @@ stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag) {
 
   float normal[3];
   float test_norm[3];
-  stl_facet *facet;
-
-  facet = &stl->facet_start[facet_num];
 
   stl_calculate_normal(normal, facet);
   stl_normalize_vector(normal);
@@ -233,7 +538,6 @@ stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag) {
       facet->normal.x = normal[0];
       facet->normal.y = normal[1];
       facet->normal.z = normal[2];
-      stl->stats.normals_fixed += 1;
     }
     return 1;
   }
@@ -247,7 +551,6 @@ stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag) {
       facet->normal.x = normal[0];
       facet->normal.y = normal[1];
       facet->normal.z = normal[2];
-      stl->stats.normals_fixed += 1;
     }
     return 2;
   }
@@ -255,7 +558,6 @@ stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag) {
     facet->normal.x = normal[0];
     facet->normal.y = normal[1];
     facet->normal.z = normal[2];
-    stl->stats.normals_fixed += 1;
   }
   return 4;
 }
@@ -304,26 +606,62 @@ void stl_normalize_vector(float v[]) {
   v[2] *= factor;
 }
 
+/* Fixing the normal values splits the facets into one chunk per thread,
+   every chunk counting the normals it fixed */
+typedef struct {
+  stl_file *stl;
+  int      num_chunks;
+  stl_index fixed[STL_MAX_THREADS];
+} stl_values_job;
+
+static void
+stl_fix_values_chunk(void *arg, int chunk) {
+  stl_values_job *job = (stl_values_job*)arg;
+  stl_index      n = job->stl->stats.number_of_facets;
+  stl_index      end = (stl_index)((long long)n * (chunk + 1)
+                                   / job->num_chunks);
+  stl_index      i;
+
+  job->fixed[chunk] = 0;
+  for(i = (stl_index)((long long)n * chunk / job->num_chunks); i < end;
+      i++) {
+    if(stl_check_facet_normal(&job->stl->facet_start[i], 1) != 0) {
+      job->fixed[chunk] += 1;
+    }
+  }
+}
+
 void
 stl_fix_normal_values(stl_file *stl) {
-  int i;
+  stl_values_job job;
+  int            chunk;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    stl_check_normal_vector(stl, i, 1);
+  job.stl = stl;
+  job.num_chunks = 1;
+  if(stl_thread_count() > 1 &&
+      stl->stats.number_of_facets >= stl_parallel_min_facets()) {
+    job.num_chunks = stl_thread_count();
+  }
+  stl_parallel_for(job.num_chunks, stl_fix_values_chunk, &job);
+  for(chunk = 0; chunk < job.num_chunks; chunk++) {
+    stl->stats.normals_fixed += job.fixed[chunk];
   }
 }
 
 void
 stl_reverse_all_facets(stl_file *stl) {
-  int i;
+  stl_index i;
   float normal[3];
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   for(i = 0; i < stl->stats.number_of_facets; i++) {
     stl_reverse_facet(stl, i);
+    stl->stats.facets_reversed += 1;
     stl_calculate_normal(normal, &stl->facet_start[i]);
     stl_normalize_vector(normal);
     stl->facet_start[i].normal.x = normal[0];
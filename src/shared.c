@@ -20,10 +20,15 @@
  *           https://github.com/admesh/admesh/issues
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
+#include "format.h"
+#include "hash.h"
 #include "stl.h"
+#include "threads.h"
 
 void
 stl_invalidate_shared_vertices(stl_file *stl) {
@@ -39,32 +44,64 @@ stl_invalidate_shared_vertices(stl_file *stl) {
   }
 }
 
+/* Makes room for one more shared vertex.  v_shared grows geometrically, so
+   big meshes are not copied over and over. */
+static void
+stl_reserve_shared_vertex(stl_file *stl) {
+  stl_vertex *v_shared;
+  stl_index   malloced;
+
+  if(stl->stats.shared_vertices < stl->stats.shared_malloced) return;
+
+  malloced = stl->stats.shared_malloced * 2;
+  if(malloced < 1024) malloced = 1024;
+  v_shared = (stl_vertex*)realloc(stl->v_shared,
+                                  malloced * sizeof(stl_vertex));
+  if(v_shared == NULL) {
+    perror("stl_generate_shared_vertices");
+    stl->error = 1;
+    return;
+  }
+  stl->v_shared = v_shared;
+  stl->stats.shared_malloced = malloced;
+}
+
+/* Allocates v_indices and an initial v_shared for the generators below */
+static void
+stl_allocate_shared_vertices(stl_file *stl) {
+  /* make sure the generators are idempotent and do not leak memory */
+  stl_invalidate_shared_vertices(stl);
+
+  stl->v_indices = (v_indices_struct*)
+                   calloc(stl->stats.number_of_facets, sizeof(v_indices_struct));
+  stl->v_shared = (stl_vertex*)
+                  calloc((stl->stats.number_of_facets / 2), sizeof(stl_vertex));
+  if(stl->v_indices == NULL || stl->v_shared == NULL) {
+    perror("stl_generate_shared_vertices");
+    stl->error = 1;
+    return;
+  }
+  stl->stats.shared_malloced = stl->stats.number_of_facets / 2;
+  stl->stats.shared_vertices = 0;
+}
+
 void
 stl_generate_shared_vertices(stl_file *stl) {
-  int i;
+  stl_index i;
   int j;
-  int first_facet;
+  stl_index first_facet;
   int direction;
-  int facet_num;
+  stl_index facet_num;
   int vnot;
   int next_edge;
   int pivot_vertex;
-  int next_facet;
+  stl_index next_facet;
   int reversed;
 
   if (stl->error) return;
 
-  /* make sure this function is idempotent and does not leak memory */
-  stl_invalidate_shared_vertices(stl);
-
-  stl->v_indices = (v_indices_struct*)
-                   calloc(stl->stats.number_of_facets, sizeof(v_indices_struct));
-  if(stl->v_indices == NULL) perror("stl_generate_shared_vertices");
-  stl->v_shared = (stl_vertex*)
-                  calloc((stl->stats.number_of_facets / 2), sizeof(stl_vertex));
-  if(stl->v_shared == NULL) perror("stl_generate_shared_vertices");
-  stl->stats.shared_malloced = stl->stats.number_of_facets / 2;
-  stl->stats.shared_vertices = 0;
+  stl_allocate_shared_vertices(stl);
+  if (stl->error) return;
 
   for(i = 0; i < stl->stats.number_of_facets; i++) {
     stl->v_indices[i].vertex[0] = -1;
@@ -79,12 +116,8 @@ stl_generate_shared_vertices(stl_file *stl) {
       if(stl->v_indices[i].vertex[j] != -1) {
         continue;
       }
-      if(stl->stats.shared_vertices == stl->stats.shared_malloced) {
-        stl->stats.shared_malloced += 1024;
-        stl->v_shared = (stl_vertex*)realloc(stl->v_shared,
-                                             stl->stats.shared_malloced * sizeof(stl_vertex));
-        if(stl->v_shared == NULL) perror("stl_generate_shared_vertices");
-      }
+      stl_reserve_shared_vertex(stl);
+      if (stl->error) return;
 
       stl->v_shared[stl->stats.shared_vertices] =
         stl->facet_start[i].vertex[j];
@@ -140,11 +173,432 @@ stl_generate_shared_vertices(stl_file *stl) {
   }
 }
 
+static uint64_t
+stl_shared_vertex_hash(const stl_vertex *vertex) {
+  unsigned words[3];
+
+  memcpy(words, vertex, sizeof(words));
+  return stl_hash_words(words, 3);
+}
+
+/* The table size is a power of two, mask one less.  A table of more than
+   2^32 slots, which takes STL_INDEX_64, needs the whole hash. */
+static stl_index
+stl_shared_vertex_slot(const stl_vertex *vertex, stl_index mask) {
+#ifdef STL_INDEX_64
+  uint64_t hash = stl_shared_vertex_hash(vertex);
+
+  return (stl_index)((hash >> 32 | hash << 32) & (uint64_t)mask);
+#else
+  return (stl_index)((unsigned)(stl_shared_vertex_hash(vertex) >> 32)
+                     & (unsigned)mask);
+#endif
+}
+
+/* Doubles the vertex table and puts the shared vertices back in */
+static stl_index *
+stl_grow_shared_vertex_table(stl_file *stl, stl_index *slots,
+                             stl_index *size) {
+  stl_index i;
+  stl_index slot;
+  stl_index mask;
+
+  free(slots);
+  *size *= 2;
+  mask = *size - 1;
+  slots = (stl_index*)malloc(*size * sizeof(stl_index));
+  if(slots == NULL) {
+    perror("stl_generate_shared_vertices_hash");
+    stl->error = 1;
+    return NULL;
+  }
+  memset(slots, 0xff, *size * sizeof(stl_index));
+  for(i = 0; i < stl->stats.shared_vertices; i++) {
+    slot = stl_shared_vertex_slot(&stl->v_shared[i], mask);
+    while(slots[slot] != -1) slot = (slot + 1) & mask;
+    slots[slot] = i;
+  }
+  return slots;
+}
+
+/* The parallel hash generator splits the corners of the facets (corner c is
+   vertex c % 3 of facet c / 3) into buckets by the top bits of their hash,
+   like the bucketed exact check does with the edges.  Equal vertices land in
+   the same bucket in corner order, so every bucket finds the first corner of
+   each of its vertices on its own.  The first corners are then numbered in
+   corner order, which gives the same shared vertices in the same order as
+   the serial generator whatever the number of threads.
+
+   While this runs v_indices holds -1 for a first corner and -2 - first for
+   the other corners, until the first corners get their numbers and the
+   others copy them. */
+#define STL_SHARED_BUCKET_BITS 11
+#define STL_SHARED_BUCKETS     (1 << STL_SHARED_BUCKET_BITS)
+
+/* A corner with a copy of its vertex, so a bucket only reads its own
+   memory */
+typedef struct {
+  stl_vertex vertex;
+  stl_index  corner;
+} stl_corner_ref;
+
+typedef struct {
+  stl_file       *stl;
+  stl_corner_ref *corners;    /* grouped by bucket */
+  stl_index      *slots;      /* two per corner, tables of the buckets */
+  stl_index *offsets;         /* [part][bucket] where a part's corners go */
+  stl_index bucket_start[STL_SHARED_BUCKETS + 1];
+  stl_index *firsts;          /* [part] first corners, then the number of
+                                 the part's first vertex */
+  int      num_parts;
+} stl_shared_job;
+
+static stl_vertex *
+stl_corner_vertex(const stl_file *stl, stl_index corner) {
+  return &stl->facet_start[corner / 3].vertex[corner % 3];
+}
+
+static stl_index *
+stl_corner_index(const stl_file *stl, stl_index corner) {
+  return &stl->v_indices[corner / 3].vertex[corner % 3];
+}
+
+static unsigned
+stl_shared_bucket(const stl_vertex *vertex) {
+  return (unsigned)(stl_shared_vertex_hash(vertex)
+                    >> (64 - STL_SHARED_BUCKET_BITS));
+}
+
+static stl_index
+stl_corner_range(const stl_shared_job *job, int part) {
+  return 3 * (stl_index)((long long)job->stl->stats.number_of_facets * part
+                         / job->num_parts);
+}
+
+static void
+stl_shared_count_part(void *arg, int part) {
+  stl_shared_job *job = (stl_shared_job*)arg;
+  stl_index      *count = job->offsets + (size_t)part * STL_SHARED_BUCKETS;
+  stl_index      end = stl_corner_range(job, part + 1);
+  stl_index      c;
+
+  memset(count, 0, STL_SHARED_BUCKETS * sizeof(stl_index));
+  for(c = stl_corner_range(job, part); c < end; c++) {
+    count[stl_shared_bucket(stl_corner_vertex(job->stl, c))]++;
+  }
+}
+
+static void
+stl_shared_scatter_part(void *arg, int part) {
+  stl_shared_job *job = (stl_shared_job*)arg;
+  stl_index      *offset = job->offsets + (size_t)part * STL_SHARED_BUCKETS;
+  stl_corner_ref *ref;
+  stl_index      end = stl_corner_range(job, part + 1);
+  stl_index      c;
+
+  for(c = stl_corner_range(job, part); c < end; c++) {
+    ref = &job->corners[offset[stl_shared_bucket(
+                                 stl_corner_vertex(job->stl, c))]++];
+    ref->vertex = *stl_corner_vertex(job->stl, c);
+    ref->corner = c;
+  }
+}
+
+/* Open addressing over the bucket's own share of the slots, at most half
+   full.  The low bits of the hash pick the slot, the top ones the bucket. */
+static void
+stl_shared_match_bucket(void *arg, int bucket) {
+  stl_shared_job *job = (stl_shared_job*)arg;
+  stl_index      start = job->bucket_start[bucket];
+  stl_index      n = job->bucket_start[bucket + 1] - start;
+  stl_corner_ref *corners = job->corners + start;
+  stl_index      *slots = job->slots + 2 * (size_t)start;
+  uint64_t       hash;
+  stl_index      slot;
+  stl_index      first;
+  stl_index      k;
+
+  if(n == 0) return;
+  memset(slots, 0xff, 2 * (size_t)n * sizeof(stl_index));
+  for(k = 0; k < n; k++) {
+    hash = stl_shared_vertex_hash(&corners[k].vertex);
+    slot = STL_HASH_SLOT(hash << 32, 2 * n);
+    while((first = slots[slot]) != -1 &&
+          memcmp(&corners[first].vertex, &corners[k].vertex,
+                 sizeof(stl_vertex))) {
+      if(++slot == 2 * n) slot = 0;
+    }
+    if(first == -1) {
+      slots[slot] = k;
+      *stl_corner_index(job->stl, corners[k].corner) = -1;
+    } else {
+      *stl_corner_index(job->stl, corners[k].corner) =
+        -2 - corners[first].corner;
+    }
+  }
+}
+
+static void
+stl_shared_count_firsts(void *arg, int part) {
+  stl_shared_job *job = (stl_shared_job*)arg;
+  stl_index      end = stl_corner_range(job, part + 1);
+  stl_index      firsts = 0;
+  stl_index      c;
+
+  for(c = stl_corner_range(job, part); c < end; c++) {
+    if(*stl_corner_index(job->stl, c) == -1) firsts++;
+  }
+  job->firsts[part] = firsts;
+}
+
+static void
+stl_shared_number_firsts(void *arg, int part) {
+  stl_shared_job *job = (stl_shared_job*)arg;
+  stl_index      end = stl_corner_range(job, part + 1);
+  stl_index      index = job->firsts[part];
+  stl_index      c;
+
+  for(c = stl_corner_range(job, part); c < end; c++) {
+    if(*stl_corner_index(job->stl, c) == -1) {
+      *stl_corner_index(job->stl, c) = index;
+      job->stl->v_shared[index++] = *stl_corner_vertex(job->stl, c);
+    }
+  }
+}
+
+static void
+stl_shared_copy_numbers(void *arg, int part) {
+  stl_shared_job *job = (stl_shared_job*)arg;
+  stl_index      end = stl_corner_range(job, part + 1);
+  stl_index      *index;
+  stl_index      c;
+
+  for(c = stl_corner_range(job, part); c < end; c++) {
+    index = stl_corner_index(job->stl, c);
+    if(*index < -1) *index = *stl_corner_index(job->stl, -2 - *index);
+  }
+}
+
+static void
+stl_generate_shared_vertices_buckets(stl_file *stl) {
+  stl_shared_job job;
+  stl_vertex     *v_shared;
+  stl_index      num_corners;
+  int            part;
+  stl_index      i;
+  stl_index      sum;
+  stl_index      c;
+
+  job.stl = stl;
+  job.num_parts = (int)STL_MAX(1, STL_MIN(stl_thread_count(),
+                                          stl->stats.number_of_facets));
+  num_corners = 3 * stl->stats.number_of_facets;
+  job.corners = (stl_corner_ref*)malloc((num_corners + 1)
+                                        * sizeof(stl_corner_ref));
+  job.slots = (stl_index*)malloc((2 * (size_t)num_corners + 1)
+                                 * sizeof(stl_index));
+  job.offsets = (stl_index*)malloc((size_t)job.num_parts * STL_SHARED_BUCKETS
+                                   * sizeof(stl_index));
+  job.firsts = (stl_index*)malloc(job.num_parts * sizeof(stl_index));
+  if(job.corners == NULL || job.slots == NULL || job.offsets == NULL
+      || job.firsts == NULL) {
+    perror("stl_generate_shared_vertices_hash");
+    stl->error = 1;
+  } else {
+    stl_parallel_for(job.num_parts, stl_shared_count_part, &job);
+
+    /* Buckets in order, and within a bucket the parts in order */
+    for(i = 0, sum = 0; i < STL_SHARED_BUCKETS; i++) {
+      job.bucket_start[i] = sum;
+      for(part = 0; part < job.num_parts; part++) {
+        c = job.offsets[(size_t)part * STL_SHARED_BUCKETS + i];
+        job.offsets[(size_t)part * STL_SHARED_BUCKETS + i] = sum;
+        sum += c;
+      }
+    }
+    job.bucket_start[STL_SHARED_BUCKETS] = sum;
+
+    stl_parallel_for(job.num_parts, stl_shared_scatter_part, &job);
+    stl_parallel_for(STL_SHARED_BUCKETS, stl_shared_match_bucket, &job);
+    stl_parallel_for(job.num_parts, stl_shared_count_firsts, &job);
+
+    for(part = 0, i = 0; part < job.num_parts; part++) {
+      c = job.firsts[part];
+      job.firsts[part] = i;
+      i += c;
+    }
+    if(i > stl->stats.shared_malloced) {
+      v_shared = (stl_vertex*)realloc(stl->v_shared, i * sizeof(stl_vertex));
+      if(v_shared == NULL) {
+        perror("stl_generate_shared_vertices_hash");
+        stl->error = 1;
+      } else {
+        stl->v_shared = v_shared;
+        stl->stats.shared_malloced = i;
+      }
+    }
+    if(!stl->error) {
+      stl->stats.shared_vertices = i;
+      stl_parallel_for(job.num_parts, stl_shared_number_firsts, &job);
+      stl_parallel_for(job.num_parts, stl_shared_copy_numbers, &job);
+    }
+  }
+
+  free(job.corners);
+  free(job.slots);
+  free(job.offsets);
+  free(job.firsts);
+}
+
+/* Merges vertices with bit for bit identical coordinates through an open
+   addressing table, numbering them in order of first occurrence.  Unlike
+   stl_generate_shared_vertices() this does not need the neighbors, so it
+   works right after loading.  It also merges vertices that only touch,
+   where the fan walk would give every fan its own copy.  Big meshes are
+   done on several threads, with the same result. */
+void
+stl_generate_shared_vertices_hash(stl_file *stl) {
+  stl_index  *slots;
+  stl_index   size;
+  stl_index   mask;
+  stl_index   slot;
+  stl_index   index;
+  stl_index   i;
+  int         j;
+  stl_vertex *vertex;
+
+  if (stl->error) return;
+
+  stl_allocate_shared_vertices(stl);
+  if (stl->error) return;
+
+  if(stl_thread_count() > 1 &&
+      stl->stats.number_of_facets >= stl_parallel_min_facets()) {
+    stl_generate_shared_vertices_buckets(stl);
+    return;
+  }
+
+  /* a closed mesh has about half as many vertices as facets, keep the
+     table at most half full */
+  size = 1024;
+  while(size < stl->stats.number_of_facets) size *= 2;
+  slots = (stl_index*)malloc(size * sizeof(stl_index));
+  if(slots == NULL) {
+    perror("stl_generate_shared_vertices_hash");
+    stl->error = 1;
+    return;
+  }
+  memset(slots, 0xff, size * sizeof(stl_index));
+  mask = size - 1;
+
+  for(i = 0; i < stl->stats.number_of_facets; i++) {
+    for(j = 0; j < 3; j++) {
+      vertex = &stl->facet_start[i].vertex[j];
+      slot = stl_shared_vertex_slot(vertex, mask);
+      while((index = slots[slot]) != -1 &&
+            memcmp(&stl->v_shared[index], vertex, sizeof(stl_vertex)))
+        slot = (slot + 1) & mask;
+
+      if(index == -1) {
+        stl_reserve_shared_vertex(stl);
+        if (stl->error) break;
+        index = stl->stats.shared_vertices++;
+        stl->v_shared[index] = *vertex;
+        slots[slot] = index;
+        if(stl->stats.shared_vertices * 2 > size) {
+          slots = stl_grow_shared_vertex_table(stl, slots, &size);
+          if (stl->error) break;
+          mask = size - 1;
+        }
+      }
+      stl->v_indices[i].vertex[j] = index;
+    }
+    if (stl->error) break;
+  }
+
+  free(slots);
+}
+
+/* Formats "%f %f %f" */
+static char *
+stl_format_shared_vertex(char *out, const stl_vertex *vertex) {
+  out = stl_format_fixed(out, vertex->x, 6);
+  *out++ = ' ';
+  out = stl_format_fixed(out, vertex->y, 6);
+  *out++ = ' ';
+  return stl_format_fixed(out, vertex->z, 6);
+}
+
+/* Formats "%d<separator>%d<separator>%d" with the vertex indices of a facet
+   plus offset */
+static char *
+stl_format_shared_facet(char *out, const v_indices_struct *facet, int offset,
+                        const char *separator) {
+  out = stl_format_index(out, facet->vertex[0] + offset);
+  out = stl_format_str(out, separator);
+  out = stl_format_index(out, facet->vertex[1] + offset);
+  out = stl_format_str(out, separator);
+  return stl_format_index(out, facet->vertex[2] + offset);
+}
+
+static char *
+stl_format_off_vertex(char *out, const void *arg, stl_index i) {
+  *out++ = '\t';
+  out = stl_format_shared_vertex(out, (const stl_vertex*)arg + i);
+  *out++ = '\n';
+  return out;
+}
+
+static char *
+stl_format_off_facet(char *out, const void *arg, stl_index i) {
+  out = stl_format_str(out, "\t3 ");
+  out = stl_format_shared_facet(out, (const v_indices_struct*)arg + i, 0, " ");
+  *out++ = '\n';
+  return out;
+}
+
+/* The last vertex and facet of a VRML file close their list */
+static char *
+stl_format_vrml_vertex(char *out, const void *arg, stl_index i) {
+  const stl_file *stl = (const stl_file*)arg;
+
+  out = stl_format_str(out, "\t\t\t\t");
+  out = stl_format_shared_vertex(out, &stl->v_shared[i]);
+  return stl_format_str(out, i < stl->stats.shared_vertices - 1 ? ",\n"
+                        : "]\n");
+}
+
+static char *
+stl_format_vrml_facet(char *out, const void *arg, stl_index i) {
+  const stl_file *stl = (const stl_file*)arg;
+
+  out = stl_format_str(out, "\t\t\t\t");
+  out = stl_format_shared_facet(out, &stl->v_indices[i], 0, ", ");
+  return stl_format_str(out, i < stl->stats.number_of_facets - 1 ? ", -1,\n"
+                        : ", -1]\n");
+}
+
+static char *
+stl_format_obj_vertex(char *out, const void *arg, stl_index i) {
+  out = stl_format_str(out, "v ");
+  out = stl_format_shared_vertex(out, (const stl_vertex*)arg + i);
+  *out++ = '\n';
+  return out;
+}
+
+static char *
+stl_format_obj_facet(char *out, const void *arg, stl_index i) {
+  out = stl_format_str(out, "f ");
+  out = stl_format_shared_facet(out, (const v_indices_struct*)arg + i, 1, " ");
+  *out++ = '\n';
+  return out;
+}
+
 void
 stl_write_off(stl_file *stl, const char *file) {
-  int i;
   FILE      *fp;
   char      *error_msg;
+  stl_text_writer out;
 
   if (stl->error) return;
 
@@ -162,25 +616,26 @@ stl_write_off(stl_file *stl, const char *file) {
   }
 
   fprintf(fp, "OFF\n");
-  fprintf(fp, "%d %d 0\n",
+  fprintf(fp, "%" STL_INDEX_FORMAT " %" STL_INDEX_FORMAT " 0\n",
           stl->stats.shared_vertices, stl->stats.number_of_facets);
 
-  for(i = 0; i < stl->stats.shared_vertices; i++) {
-    fprintf(fp, "\t%f %f %f\n",
-            stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
-  }
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    fprintf(fp, "\t3 %d %d %d\n", stl->v_indices[i].vertex[0],
-            stl->v_indices[i].vertex[1], stl->v_indices[i].vertex[2]);
+  stl_text_begin(&out, fp);
+  stl_text_items(&out, stl->stats.shared_vertices, stl_format_off_vertex,
+                 stl->v_shared);
+  stl_text_items(&out, stl->stats.number_of_facets, stl_format_off_facet,
+                 stl->v_indices);
+  if(stl_text_end(&out)) {
+    perror("stl_write_off");
+    stl->error = 1;
   }
   fclose(fp);
 }
 
 void
 stl_write_vrml(stl_file *stl, const char *file) {
-  int i;
   FILE      *fp;
   char      *error_msg;
+  stl_text_writer out;
 
   if (stl->error) return;
 
@@ -212,31 +667,28 @@ stl_write_vrml(stl_file *stl, const char *file) {
   fprintf(fp, "\t\tDEF STLVertices Coordinate3 {\n");
   fprintf(fp, "\t\t\tpoint [\n");
 
-  for(i = 0; i < (stl->stats.shared_vertices - 1); i++) {
-    fprintf(fp, "\t\t\t\t%f %f %f,\n",
-            stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
-  }
-  fprintf(fp, "\t\t\t\t%f %f %f]\n",
-          stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
-  fprintf(fp, "\t\t}\n");
-  fprintf(fp, "\t\tDEF STLTriangles IndexedFaceSet {\n");
-  fprintf(fp, "\t\t\tcoordIndex [\n");
-
-  for(i = 0; i < (stl->stats.number_of_facets - 1); i++) {
-    fprintf(fp, "\t\t\t\t%d, %d, %d, -1,\n", stl->v_indices[i].vertex[0],
-            stl->v_indices[i].vertex[1], stl->v_indices[i].vertex[2]);
+  stl_text_begin(&out, fp);
+  stl_text_items(&out, stl->stats.shared_vertices, stl_format_vrml_vertex,
+                 stl);
+  stl_text_str(&out, "\t\t}\n");
+  stl_text_str(&out, "\t\tDEF STLTriangles IndexedFaceSet {\n");
+  stl_text_str(&out, "\t\t\tcoordIndex [\n");
+
+  stl_text_items(&out, stl->stats.number_of_facets, stl_format_vrml_facet,
+                 stl);
+  stl_text_str(&out, "\t\t}\n");
+  stl_text_str(&out, "\t}\n");
+  stl_text_str(&out, "}\n");
+  if(stl_text_end(&out)) {
+    perror("stl_write_vrml");
+    stl->error = 1;
   }
-  fprintf(fp, "\t\t\t\t%d, %d, %d, -1]\n", stl->v_indices[i].vertex[0],
-          stl->v_indices[i].vertex[1], stl->v_indices[i].vertex[2]);
-  fprintf(fp, "\t\t}\n");
-  fprintf(fp, "\t}\n");
-  fprintf(fp, "}\n");
   fclose(fp);
 }
 
 void stl_write_obj (stl_file *stl, const char *file) {
-  int i;
   FILE* fp;
+  stl_text_writer out;
 
   if (stl->error) return;
 
@@ -251,11 +703,14 @@ void stl_write_obj (stl_file *stl, const char *file) {
     return;
   }
 
-  for (i = 0; i < stl->stats.shared_vertices; i++) {
-    fprintf(fp, "v %f %f %f\n", stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
-  }
-  for (i = 0; i < stl->stats.number_of_facets; i++) {
-    fprintf(fp, "f %d %d %d\n", stl->v_indices[i].vertex[0]+1, stl->v_indices[i].vertex[1]+1, stl->v_indices[i].vertex[2]+1);
+  stl_text_begin(&out, fp);
+  stl_text_items(&out, stl->stats.shared_vertices, stl_format_obj_vertex,
+                 stl->v_shared);
+  stl_text_items(&out, stl->stats.number_of_facets, stl_format_obj_facet,
+                 stl->v_indices);
+  if (stl_text_end(&out)) {
+    perror("stl_write_obj");
+    stl->error = 1;
   }
 
   fclose(fp);
@@ -0,0 +1,231 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/admesh/admesh/issues
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bounds.h"
+#include "stl.h"
+#include "threads.h"
+
+#if defined(__SSE__)
+#define STL_BOUNDS_SSE
+#include <xmmintrin.h>
+#endif
+
+/* Floats in an array of n rounded up, so that the next one stays aligned */
+#define STL_SOA_ROUND(n) \
+  (((size_t)(n) + STL_SOA_ALIGN / sizeof(float) - 1) \
+   & ~(STL_SOA_ALIGN / sizeof(float) - 1))
+
+typedef struct {
+  stl_file *stl;
+  int      num_ranges;
+} stl_soa_job;
+
+void
+stl_invalidate_soa(stl_file *stl) {
+  if (stl->error) return;
+
+  free(stl->soa.block);
+  memset(&stl->soa, 0, sizeof(stl->soa));
+}
+
+static void
+stl_soa_copy_range(void *arg, int range) {
+  stl_soa_job     *job = (stl_soa_job*)arg;
+  stl_soa         *soa = &job->stl->soa;
+  const stl_facet *facet;
+  stl_index       n = job->stl->stats.number_of_facets;
+  stl_index       end = (stl_index)((long long)n * (range + 1)
+                                    / job->num_ranges);
+  stl_index       i;
+  int             j;
+
+  for(i = (stl_index)((long long)n * range / job->num_ranges); i < end;
+      i++) {
+    facet = &job->stl->facet_start[i];
+    for(j = 0; j < 3; j++) {
+      soa->x[j][i] = facet->vertex[j].x;
+      soa->y[j][i] = facet->vertex[j].y;
+      soa->z[j][i] = facet->vertex[j].z;
+    }
+    soa->normal_x[i] = facet->normal.x;
+    soa->normal_y[i] = facet->normal.y;
+    soa->normal_z[i] = facet->normal.z;
+  }
+}
+
+/* Copies the facets into stl->soa.  The copy is dropped again by anything
+   that changes the facets, so generate it after the repairs and the
+   transformations, right before the kernels that can use it:
+   stl_get_size and stl_calculate_mass_properties. */
+void
+stl_generate_soa(stl_file *stl) {
+  stl_soa_job job;
+  size_t      floats;
+  float       *base;
+  int         j;
+
+  if (stl->error) return;
+
+  stl_invalidate_soa(stl);
+  if(stl->stats.number_of_facets == 0) return;
+
+  /* Nine coordinate arrays and three for the normal */
+  floats = STL_SOA_ROUND(stl->stats.number_of_facets);
+  stl->soa.block = malloc(12 * floats * sizeof(float) + STL_SOA_ALIGN);
+  if(stl->soa.block == NULL) {
+    perror("stl_generate_soa");
+    stl->error = 1;
+    return;
+  }
+  base = (float*)(((uintptr_t)stl->soa.block + STL_SOA_ALIGN - 1)
+                  & ~(uintptr_t)(STL_SOA_ALIGN - 1));
+  for(j = 0; j < 3; j++) {
+    stl->soa.x[j] = base + (0 + j) * floats;
+    stl->soa.y[j] = base + (3 + j) * floats;
+    stl->soa.z[j] = base + (6 + j) * floats;
+  }
+  stl->soa.normal_x = base + 9 * floats;
+  stl->soa.normal_y = base + 10 * floats;
+  stl->soa.normal_z = base + 11 * floats;
+  stl->soa.number_of_facets = stl->stats.number_of_facets;
+
+  job.stl = stl;
+  job.num_ranges = 1;
+  if(stl_thread_count() > 1 &&
+      stl->stats.number_of_facets >= stl_parallel_min_facets()) {
+    job.num_ranges = stl_thread_count();
+  }
+  stl_parallel_for(job.num_ranges, stl_soa_copy_range, &job);
+}
+
+#ifdef STL_BOUNDS_SSE
+/* stl_axis_bounds four facets at a time.  As in stl_facets_bounds the
+   order only shows in a NaN, then 0 is returned for the caller to take the
+   vertices in turn, or in the sign of a zero bound, which is that of the
+   last zero met in turn, or of the seed if there is none. */
+static int
+stl_axis_bounds_sse(float * const v[3], stl_index start, stl_index end,
+                    float *min, float *max) {
+  float  out_lo[4];
+  float  out_hi[4];
+  float  lo;
+  float  hi;
+  __m128 lo0, lo1, lo2;
+  __m128 hi0, hi1, hi2;
+  __m128 v0, v1, v2;
+  __m128 nan;
+  stl_index i;
+  int    j;
+  int    k;
+
+  lo0 = lo1 = lo2 = _mm_set1_ps(*min);
+  hi0 = hi1 = hi2 = _mm_set1_ps(*max);
+  nan = _mm_cmpunord_ps(lo0, hi0);
+  for(i = start; i + 4 <= end; i += 4) {
+    v0 = _mm_loadu_ps(v[0] + i);
+    v1 = _mm_loadu_ps(v[1] + i);
+    v2 = _mm_loadu_ps(v[2] + i);
+    lo0 = _mm_min_ps(lo0, v0);
+    hi0 = _mm_max_ps(hi0, v0);
+    lo1 = _mm_min_ps(lo1, v1);
+    hi1 = _mm_max_ps(hi1, v1);
+    lo2 = _mm_min_ps(lo2, v2);
+    hi2 = _mm_max_ps(hi2, v2);
+    nan = _mm_or_ps(nan, _mm_or_ps(_mm_cmpunord_ps(v0, v1),
+                                   _mm_cmpunord_ps(v2, v2)));
+  }
+  if(_mm_movemask_ps(nan)) return 0;
+
+  _mm_storeu_ps(out_lo, _mm_min_ps(_mm_min_ps(lo0, lo1), lo2));
+  _mm_storeu_ps(out_hi, _mm_max_ps(_mm_max_ps(hi0, hi1), hi2));
+  lo = *min;
+  hi = *max;
+  for(k = 0; k < 4; k++) {
+    lo = STL_MIN(lo, out_lo[k]);
+    hi = STL_MAX(hi, out_hi[k]);
+  }
+  for(; i < end; i++) {
+    for(j = 0; j < 3; j++) {
+      if(v[j][i] != v[j][i]) return 0;
+      lo = STL_MIN(lo, v[j][i]);
+      hi = STL_MAX(hi, v[j][i]);
+    }
+  }
+
+  if(lo == 0 || hi == 0) {
+    for(i = end - 1; i >= start; i--) {
+      for(j = 2; j >= 0 && v[j][i] != 0; j--);
+      if(j >= 0) break;
+    }
+    if(i >= start) {
+      if(lo == 0) lo = v[j][i];
+      if(hi == 0) hi = v[j][i];
+    } else {
+      if(lo == 0) lo = *min;
+      if(hi == 0) hi = *max;
+    }
+  }
+  *min = lo;
+  *max = hi;
+  return 1;
+}
+#endif
+
+/* Widens min and max to take in one coordinate, v[j][i] for vertex j of
+   facets start to end, exactly as STL_MIN and STL_MAX taking them in turn
+   would */
+static void
+stl_axis_bounds(float * const v[3], stl_index start, stl_index end,
+                float *min, float *max) {
+  float lo;
+  float hi;
+  stl_index i;
+  int   j;
+
+#ifdef STL_BOUNDS_SSE
+  if(stl_axis_bounds_sse(v, start, end, min, max)) return;
+#endif
+
+  lo = *min;
+  hi = *max;
+  for(i = start; i < end; i++) {
+    for(j = 0; j < 3; j++) {
+      lo = STL_MIN(lo, v[j][i]);
+      hi = STL_MAX(hi, v[j][i]);
+    }
+  }
+  *min = lo;
+  *max = hi;
+}
+
+void
+stl_soa_bounds(const stl_soa *soa, stl_index start, stl_index end,
+               stl_vertex *min, stl_vertex *max) {
+  stl_axis_bounds(soa->x, start, end, &min->x, &max->x);
+  stl_axis_bounds(soa->y, start, end, &min->y, &max->y);
+  stl_axis_bounds(soa->z, start, end, &min->z, &max->z);
+}
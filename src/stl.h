@@ -23,6 +23,7 @@
 #ifndef __admesh_stl__
 #define __admesh_stl__
 
+#include <limits.h>
 #include <stdio.h>
 
 #ifdef __cplusplus
@@ -40,6 +41,25 @@ extern "C" {
 #define ASCII_LINES_PER_FACET  7
 #define SIZEOF_EDGE_SORT       24
 
+/* Facets, their vertices and edges are numbered and counted with
+   stl_index.  It is an int, unless the library and everything using it is
+   built with STL_INDEX_64 for meshes of more than STL_MAX_FACETS facets,
+   at the cost of wider neighbor and vertex index tables.  STL_INDEX_FORMAT
+   goes after the % to print one. */
+#ifdef STL_INDEX_64
+typedef long long stl_index;
+#define STL_INDEX_MAX          LLONG_MAX
+#define STL_INDEX_FORMAT       "lld"
+#else
+typedef int stl_index;
+#define STL_INDEX_MAX          INT_MAX
+#define STL_INDEX_FORMAT       "d"
+#endif
+
+/* The most facets a mesh can have.  Edges and corners are numbered three
+   per facet, so they have to fit too. */
+#define STL_MAX_FACETS         (STL_INDEX_MAX / 3)
+
 typedef struct {
   float x;
   float y;
@@ -63,32 +83,53 @@ typedef struct {
 
 typedef enum {binary, ascii, inmemory} stl_type;
 
+/* How stl_check_facets_exact finds matching edges */
+typedef enum {edges_hash, edges_sort} stl_edge_engine;
+
 typedef struct {
   stl_vertex p1;
   stl_vertex p2;
-  int        facet_number;
+  stl_index  facet_number;
 } stl_edge;
 
 typedef struct stl_hash_edge {
   unsigned       key[6];
-  int            facet_number;
+  stl_index      facet_number;
   int            which_edge;
-  struct stl_hash_edge  *next;
 } stl_hash_edge;
 
+/* The edges a nearby check left unconnected, for the next one to go
+   through.  Start with edges == NULL, which means all of them. */
 typedef struct {
-  int   neighbor[3];
+  stl_index *edges;           /* 3 * facet number + edge, in facet order */
+  stl_index count;
+} stl_edge_worklist;
+
+typedef struct {
+  stl_index neighbor[3];
   char  which_vertex_not[3];
 } stl_neighbors;
 
 typedef struct {
-  int   vertex[3];
+  stl_index vertex[3];
 } v_indices_struct;
 
+#define STL_PROBE_HISTOGRAM    8
+
+/* How the edge table fared in the last pass, for debugging the hash */
+typedef struct {
+  stl_index     lookups;      /* edges looked up */
+  stl_index     histogram[STL_PROBE_HISTOGRAM]; /* lookups by slots probed
+                                   past, the last entry counts the rest */
+  stl_index     max_probe;    /* longest probe */
+  stl_index     slots;        /* table size at the end of the pass */
+  float         max_load;     /* highest fraction of the slots in use */
+} stl_probe_stats;
+
 typedef struct {
   char          header[81];
   stl_type      type;
-  int           number_of_facets;
+  stl_index     number_of_facets;
   stl_vertex    max;
   stl_vertex    min;
   stl_vertex    size;
@@ -97,48 +138,88 @@ typedef struct {
   float         volume;
   float         surface_area;
   unsigned      number_of_blocks;
-  int           connected_edges;
-  int           connected_facets_1_edge;
-  int           connected_facets_2_edge;
-  int           connected_facets_3_edge;
-  int           facets_w_1_bad_edge;
-  int           facets_w_2_bad_edge;
-  int           facets_w_3_bad_edge;
-  int           original_num_facets;
-  int           edges_fixed;
-  int           degenerate_facets;
-  int           facets_removed;
-  int           facets_added;
-  int           facets_reversed;
-  int           backwards_edges;
-  int           normals_fixed;
-  int           number_of_parts;
-  int           malloced;
-  int           freed;
-  int           facets_malloced;
-  int           collisions;
-  int           shared_vertices;
-  int           shared_malloced;
+  stl_index     connected_edges;
+  stl_index     connected_facets_1_edge;
+  stl_index     connected_facets_2_edge;
+  stl_index     connected_facets_3_edge;
+  stl_index     facets_w_1_bad_edge;
+  stl_index     facets_w_2_bad_edge;
+  stl_index     facets_w_3_bad_edge;
+  stl_index     original_num_facets;
+  stl_index     edges_fixed;
+  stl_index     degenerate_facets;
+  stl_index     facets_removed;
+  stl_index     facets_added;
+  stl_index     facets_reversed;
+  stl_index     backwards_edges;
+  stl_index     normals_fixed;
+  stl_index     number_of_parts;
+  stl_index     malloced;     /* edges put into the edge table by the last pass */
+  stl_index     freed;        /* edges that left it, matched or released */
+  stl_index     facets_malloced;
+  stl_index     collisions;   /* occupied slots probed past in the edge table */
+  stl_index     shared_vertices;
+  stl_index     shared_malloced;
+  stl_probe_stats probes;
 } stl_stats;
 
+/* Of the solid the facets enclose, by stl_calculate_mass_properties.  The
+   inertia tensor is about the centroid and for a density of one. */
+typedef struct {
+  double        volume;
+  double        surface_area;
+  double        centroid[3];
+  double        inertia[3][3];
+} stl_mass_properties;
+
+/* The facets again as separate arrays, for kernels that only need some of
+   their fields; see stl_generate_soa.  x[j][i], y[j][i] and z[j][i] are the
+   coordinates of vertex j of facet i, normal_x[i] and so on its normal, so
+   that neighboring facets sit side by side.  Every array starts on an
+   STL_SOA_ALIGN byte boundary.  facet_start stays the mesh itself, this is
+   a copy that is dropped as soon as the facets change. */
+#define STL_SOA_ALIGN 32
+
+typedef struct {
+  float         *x[3];
+  float         *y[3];
+  float         *z[3];
+  float         *normal_x;
+  float         *normal_y;
+  float         *normal_z;
+  stl_index     number_of_facets;
+  void          *block;       /* the one allocation behind the arrays, NULL
+                                 when there is no copy */
+} stl_soa;
+
+/* How the edge checks are set up and the state they keep between calls,
+   internal to the library.  NULL until one of the stl_set_ functions
+   below changes a default. */
+struct stl_check_state;
+
+/* New members go at the end, so that the ones before keep their offsets */
 typedef struct {
   FILE          *fp;
   stl_facet     *facet_start;
   stl_edge      *edge_start;
-  stl_hash_edge **heads;
-  stl_hash_edge *tail;
-  int           M;
+  stl_hash_edge *edge_table;
+  stl_index     M;
   stl_neighbors *neighbors_start;
   v_indices_struct *v_indices;
   stl_vertex    *v_shared;
   stl_stats     stats;
   char          error;
+  stl_soa       soa;
+  struct stl_check_state *check;
 } stl_file;
 
 
 extern void stl_open(stl_file *stl, const char *file);
+extern void stl_open_mmap(stl_file *stl, const char *file);
 extern void stl_close(stl_file *stl);
 extern void stl_stats_out(stl_file *stl, FILE *file, const char *input_file);
+extern void stl_mass_properties_out(const stl_mass_properties *properties,
+                                    FILE *file);
 extern void stl_print_edges(stl_file *stl, FILE *file);
 extern void stl_print_neighbors(stl_file *stl, const char *file);
 extern void stl_put_little_int(FILE *fp, int value_in);
@@ -148,15 +229,28 @@ extern void stl_write_binary(stl_file *stl, const char *file, const char *label)
 extern void stl_write_binary_block(stl_file *stl, FILE *fp);
 extern void stl_check_facets_exact(stl_file *stl);
 extern void stl_check_facets_nearby(stl_file *stl, float tolerance);
+extern void stl_check_facets_nearby_worklist(stl_file *stl, float tolerance,
+    stl_edge_worklist *worklist);
+extern void stl_free_edge_worklist(stl_edge_worklist *worklist);
+/* stl_check_facets_exact uses edges_hash unless told otherwise */
+extern void stl_set_edge_engine(stl_file *stl, stl_edge_engine engine);
+/* If log is not NULL, each edge table pass reports on it there */
+extern void stl_set_probe_log(stl_file *stl, FILE *log);
+/* Nearby checks match edges in neighboring grid cells too */
+extern void stl_set_nearby_grid(stl_file *stl, int grid);
+/* Nearby checks merge the vertices at the end instead of as they go */
+extern void stl_set_nearby_weld(stl_file *stl, int weld);
 extern void stl_remove_unconnected_facets(stl_file *stl);
-extern void stl_write_vertex(stl_file *stl, int facet, int vertex);
-extern void stl_write_facet(stl_file *stl, const char *label, int facet);
+extern void stl_write_vertex(stl_file *stl, stl_index facet, int vertex);
+extern void stl_write_facet(stl_file *stl, const char *label,
+                            stl_index facet);
 extern void stl_write_edge(stl_file *stl, const char *label, stl_hash_edge edge);
-extern void stl_write_neighbor(stl_file *stl, int facet);
+extern void stl_write_neighbor(stl_file *stl, stl_index facet);
 extern void stl_write_quad_object(stl_file *stl, const char *file);
 extern void stl_verify_neighbors(stl_file *stl);
 extern void stl_fill_holes(stl_file *stl);
 extern void stl_fix_normal_directions(stl_file *stl);
+extern stl_index stl_label_parts(stl_file *stl, stl_index *part_ids);
 extern void stl_fix_normal_values(stl_file *stl);
 extern void stl_reverse_all_facets(stl_file *stl);
 extern void stl_translate(stl_file *stl, float x, float y, float z);
@@ -167,12 +261,17 @@ extern void stl_scale(stl_file *stl, float factor);
 extern void stl_rotate_x(stl_file *stl, float angle);
 extern void stl_rotate_y(stl_file *stl, float angle);
 extern void stl_rotate_z(stl_file *stl, float angle);
+extern void stl_rotate_axis(stl_file *stl, float axis[3], float angle);
+extern void stl_transform(stl_file *stl, const double m[12]);
 extern void stl_mirror_xy(stl_file *stl);
 extern void stl_mirror_yz(stl_file *stl);
 extern void stl_mirror_xz(stl_file *stl);
 extern void stl_open_merge(stl_file *stl, const char *file);
 extern void stl_invalidate_shared_vertices(stl_file *stl);
 extern void stl_generate_shared_vertices(stl_file *stl);
+extern void stl_generate_shared_vertices_hash(stl_file *stl);
+extern void stl_generate_soa(stl_file *stl);
+extern void stl_invalidate_soa(stl_file *stl);
 extern void stl_write_obj(stl_file *stl, const char *file);
 extern void stl_write_off(stl_file *stl, const char *file);
 extern void stl_write_dxf(stl_file *stl, const char *file, const char *label);
@@ -181,18 +280,28 @@ extern void stl_calculate_normal(float normal[], stl_facet *facet);
 extern void stl_normalize_vector(float v[]);
 extern void stl_calculate_volume(stl_file *stl);
 extern void stl_calculate_surface_area(stl_file *stl);
+extern void stl_calculate_mass_properties(stl_file *stl,
+    stl_mass_properties *properties);
 
 extern void stl_repair(stl_file *stl, int fixall_flag, int exact_flag, int tolerance_flag, float tolerance, int increment_flag, float increment, int nearby_flag, int iterations, int remove_unconnected_flag, int fill_holes_flag, int normal_directions_flag, int normal_values_flag, int reverse_all_flag, int verbose_flag);
 
 extern void stl_initialize(stl_file *stl);
 extern void stl_count_facets(stl_file *stl, const char *file);
 extern void stl_allocate(stl_file *stl);
-extern void stl_read(stl_file *stl, int first_facet, int first);
+extern void stl_read(stl_file *stl, stl_index first_facet, int first);
 extern void stl_facet_stats(stl_file *stl, stl_facet facet, int first);
 extern void stl_reallocate(stl_file *stl);
 extern void stl_add_facet(stl_file *stl, stl_facet *new_facet);
 extern void stl_get_size(stl_file *stl);
 
+/* The number of threads big meshes are split across, at least 1.  Setting
+   it to 0 goes back to the default: the ADMESH_THREADS environment
+   variable if it is set, one thread per processor otherwise.  Both may be
+   called from any thread at any time; a call already running keeps the
+   count it started with. */
+extern int stl_thread_count(void);
+extern void stl_set_thread_count(int threads);
+
 extern void stl_clear_error(stl_file *stl);
 extern int stl_get_error(stl_file *stl);
 extern void stl_exit_on_error(stl_file *stl);
@@ -20,8 +20,12 @@
  *           https://github.com/admesh/admesh/issues
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include "format.h"
+#include "portable_endian.h"
 #include "stl.h"
 
 #if !defined(SEEK_SET)
@@ -32,14 +36,14 @@
 
 void
 stl_print_edges(stl_file *stl, FILE *file) {
-  int i;
-  int edges_allocated;
+  stl_index i;
+  stl_index edges_allocated;
 
   if (stl->error) return;
 
   edges_allocated = stl->stats.number_of_facets * 3;
   for(i = 0; i < edges_allocated; i++) {
-    fprintf(file, "%d, %f, %f, %f, %f, %f, %f\n",
+    fprintf(file, "%" STL_INDEX_FORMAT ", %f, %f, %f, %f, %f, %f\n",
             stl->edge_start[i].facet_number,
             stl->edge_start[i].p1.x, stl->edge_start[i].p1.y,
             stl->edge_start[i].p1.z, stl->edge_start[i].p2.x,
@@ -81,22 +85,27 @@ Header             : %s\n", stl->stats.header);
   fprintf(file, "\
 ========= Facet Status ========== Original ============ Final ====\n");
   fprintf(file, "\
-Number of facets                 : %5d               %5d\n",
+Number of facets                 : %5" STL_INDEX_FORMAT "               %5"
+          STL_INDEX_FORMAT "\n",
           stl->stats.original_num_facets, stl->stats.number_of_facets);
   fprintf(file, "\
-Facets with 1 disconnected edge  : %5d               %5d\n",
+Facets with 1 disconnected edge  : %5" STL_INDEX_FORMAT "               %5"
+          STL_INDEX_FORMAT "\n",
           stl->stats.facets_w_1_bad_edge, stl->stats.connected_facets_2_edge -
           stl->stats.connected_facets_3_edge);
   fprintf(file, "\
-Facets with 2 disconnected edges : %5d               %5d\n",
+Facets with 2 disconnected edges : %5" STL_INDEX_FORMAT "               %5"
+          STL_INDEX_FORMAT "\n",
           stl->stats.facets_w_2_bad_edge, stl->stats.connected_facets_1_edge -
           stl->stats.connected_facets_2_edge);
   fprintf(file, "\
-Facets with 3 disconnected edges : %5d               %5d\n",
+Facets with 3 disconnected edges : %5" STL_INDEX_FORMAT "               %5"
+          STL_INDEX_FORMAT "\n",
           stl->stats.facets_w_3_bad_edge, stl->stats.number_of_facets -
           stl->stats.connected_facets_1_edge);
   fprintf(file, "\
-Total disconnected facets        : %5d               %5d\n",
+Total disconnected facets        : %5" STL_INDEX_FORMAT "               %5"
+          STL_INDEX_FORMAT "\n",
           stl->stats.facets_w_1_bad_edge + stl->stats.facets_w_2_bad_edge +
           stl->stats.facets_w_3_bad_edge, stl->stats.number_of_facets -
           stl->stats.connected_facets_3_edge);
@@ -104,29 +113,74 @@ Total disconnected facets        : %5d               %5d\n",
   fprintf(file,
           "=== Processing Statistics ===       ====== Other Statistics ======\n");
   fprintf(file, "\
-Number of parts       : %5d       Volume          :   % f\n",
+Number of parts       : %5" STL_INDEX_FORMAT "       Volume          :   % f\n",
           stl->stats.number_of_parts, stl->stats.volume);
   fprintf(file, "\
-Degenerate facets     : %5d       Surface area    :   % f\n", stl->stats.degenerate_facets, stl->stats.surface_area);
+Degenerate facets     : %5" STL_INDEX_FORMAT "       Surface area    :   % f\n", stl->stats.degenerate_facets, stl->stats.surface_area);
   fprintf(file, "\
-Edges fixed           : %5d\n", stl->stats.edges_fixed);
+Edges fixed           : %5" STL_INDEX_FORMAT "\n", stl->stats.edges_fixed);
   fprintf(file, "\
-Facets removed        : %5d\n", stl->stats.facets_removed);
+Facets removed        : %5" STL_INDEX_FORMAT "\n", stl->stats.facets_removed);
   fprintf(file, "\
-Facets added          : %5d\n", stl->stats.facets_added);
+Facets added          : %5" STL_INDEX_FORMAT "\n", stl->stats.facets_added);
   fprintf(file, "\
-Facets reversed       : %5d\n", stl->stats.facets_reversed);
+Facets reversed       : %5" STL_INDEX_FORMAT "\n", stl->stats.facets_reversed);
   fprintf(file, "\
-Backwards edges       : %5d\n", stl->stats.backwards_edges);
+Backwards edges       : %5" STL_INDEX_FORMAT "\n", stl->stats.backwards_edges);
   fprintf(file, "\
-Normals fixed         : %5d\n", stl->stats.normals_fixed);
+Normals fixed         : %5" STL_INDEX_FORMAT "\n", stl->stats.normals_fixed);
+}
+
+void
+stl_mass_properties_out(const stl_mass_properties *properties, FILE *file) {
+  int i;
+
+  fprintf(file, "========= Mass Properties =========\n");
+  fprintf(file, "Centroid           : % e % e % e\n",
+          properties->centroid[0], properties->centroid[1],
+          properties->centroid[2]);
+  for(i = 0; i < 3; i++) {
+    fprintf(file, "%s : % e % e % e\n",
+            i == 0 ? "Inertia tensor    " : "                  ",
+            properties->inertia[i][0], properties->inertia[i][1],
+            properties->inertia[i][2]);
+  }
+}
+
+/* Formats "% .8E % .8E % .8E\n" */
+static char *
+stl_format_ascii_vector(char *out, float x, float y, float z) {
+  out = stl_format_exp(out, x);
+  *out++ = ' ';
+  out = stl_format_exp(out, y);
+  *out++ = ' ';
+  out = stl_format_exp(out, z);
+  *out++ = '\n';
+  return out;
+}
+
+static char *
+stl_format_ascii_facet(char *out, const void *arg, stl_index i) {
+  const stl_facet *facet = (const stl_facet*)arg + i;
+  int             j;
+
+  out = stl_format_str(out, "  facet normal ");
+  out = stl_format_ascii_vector(out, facet->normal.x, facet->normal.y,
+                                facet->normal.z);
+  out = stl_format_str(out, "    outer loop\n");
+  for(j = 0; j < 3; j++) {
+    out = stl_format_str(out, "      vertex ");
+    out = stl_format_ascii_vector(out, facet->vertex[j].x, facet->vertex[j].y,
+                                  facet->vertex[j].z);
+  }
+  return stl_format_str(out, "    endloop\n  endfacet\n");
 }
 
 void
 stl_write_ascii(stl_file *stl, const char *file, const char *label) {
-  int       i;
   FILE      *fp;
   char      *error_msg;
+  stl_text_writer out;
 
   if (stl->error) return;
 
@@ -143,34 +197,28 @@ stl_write_ascii(stl_file *stl, const char *file, const char *label) {
     return;
   }
 
-  fprintf(fp, "solid  %s\n", label);
+  stl_text_begin(&out, fp);
+  stl_text_str(&out, "solid  ");
+  stl_text_str(&out, label);
+  stl_text_str(&out, "\n");
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    fprintf(fp, "  facet normal % .8E % .8E % .8E\n",
-            stl->facet_start[i].normal.x, stl->facet_start[i].normal.y,
-            stl->facet_start[i].normal.z);
-    fprintf(fp, "    outer loop\n");
-    fprintf(fp, "      vertex % .8E % .8E % .8E\n",
-            stl->facet_start[i].vertex[0].x, stl->facet_start[i].vertex[0].y,
-            stl->facet_start[i].vertex[0].z);
-    fprintf(fp, "      vertex % .8E % .8E % .8E\n",
-            stl->facet_start[i].vertex[1].x, stl->facet_start[i].vertex[1].y,
-            stl->facet_start[i].vertex[1].z);
-    fprintf(fp, "      vertex % .8E % .8E % .8E\n",
-            stl->facet_start[i].vertex[2].x, stl->facet_start[i].vertex[2].y,
-            stl->facet_start[i].vertex[2].z);
-    fprintf(fp, "    endloop\n");
-    fprintf(fp, "  endfacet\n");
-  }
+  stl_text_items(&out, stl->stats.number_of_facets, stl_format_ascii_facet,
+                 stl->facet_start);
 
-  fprintf(fp, "endsolid  %s\n", label);
+  stl_text_str(&out, "endsolid  ");
+  stl_text_str(&out, label);
+  stl_text_str(&out, "\n");
 
+  if(stl_text_end(&out)) {
+    perror("stl_write_ascii");
+    stl->error = 1;
+  }
   fclose(fp);
 }
 
 void
 stl_print_neighbors(stl_file *stl, const char *file) {
-  int i;
+  stl_index i;
   FILE *fp;
   char *error_msg;
 
@@ -190,7 +238,8 @@ stl_print_neighbors(stl_file *stl, const char *file) {
   }
 
   for(i = 0; i < stl->stats.number_of_facets; i++) {
-    fprintf(fp, "%d, %d,%d, %d,%d, %d,%d\n",
+    fprintf(fp, "%" STL_INDEX_FORMAT ", %" STL_INDEX_FORMAT ",%d, %"
+            STL_INDEX_FORMAT ",%d, %" STL_INDEX_FORMAT ",%d\n",
             i,
             stl->neighbors_start[i].neighbor[0],
             (int)stl->neighbors_start[i].which_vertex_not[0],
@@ -236,27 +285,61 @@ stl_put_little_float(FILE *fp, float value_in) {
   fwrite(&new_value, sizeof(int), 1, fp);
 }
 
+/* Number of records encoded in memory before each fwrite */
+#define STL_WRITE_BLOCK_FACETS 4096
+
 void
-stl_write_binary_block(stl_file *stl, FILE *fp)
-{
-  int i;
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    {
-      stl_put_little_float(fp, stl->facet_start[i].normal.x);
-      stl_put_little_float(fp, stl->facet_start[i].normal.y);
-      stl_put_little_float(fp, stl->facet_start[i].normal.z);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[0].x);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[0].y);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[0].z);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[1].x);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[1].y);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[1].z);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[2].x);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[2].y);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[2].z);
-      fputc(stl->facet_start[i].extra[0], fp);
-      fputc(stl->facet_start[i].extra[1], fp);
+stl_write_binary_block(stl_file *stl, FILE *fp) {
+  unsigned char   *buffer;
+  unsigned char   *record;
+  const stl_facet *facet;
+  stl_index       i;
+  int             j;
+  int             count;
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+  int             k;
+  uint32_t        endianswap_buffer;  /* for byteswapping operations */
+  const float     *facet_floats;
+#endif
+
+  if (stl->error) return;
+
+  buffer = (unsigned char*)malloc(STL_WRITE_BLOCK_FACETS * SIZEOF_STL_FACET);
+  if(buffer == NULL) {
+    perror("stl_write_binary_block");
+    stl->error = 1;
+    return;
+  }
+
+  for(i = 0; i < stl->stats.number_of_facets; i += count) {
+    count = (int)STL_MIN(stl->stats.number_of_facets - i,
+                         STL_WRITE_BLOCK_FACETS);
+
+    /* The leading 50 bytes of stl_facet are laid out like a record */
+    for(j = 0; j < count; j++) {
+      facet = &stl->facet_start[i + j];
+      record = buffer + j * SIZEOF_STL_FACET;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+      memcpy(record, facet, SIZEOF_STL_FACET);
+#else
+      facet_floats = &facet->normal.x;
+      for(k = 0; k < 12; k++) {
+        /* convert host float to LE byte order */
+        memcpy(&endianswap_buffer, &facet_floats[k], 4);
+        endianswap_buffer = htole32(endianswap_buffer);
+        memcpy(record + k * sizeof(float), &endianswap_buffer, 4);
+      }
+      memcpy(record + 12 * sizeof(float), facet->extra, 2);
+#endif
     }
+
+    if(fwrite(buffer, SIZEOF_STL_FACET, count, fp) != (size_t)count) {
+      perror("stl_write_binary_block");
+      stl->error = 1;
+      break;
+    }
+  }
+  free(buffer);
 }
 
 void
@@ -267,6 +350,17 @@ stl_write_binary(stl_file *stl, const char *file, const char *label) {
 
   if (stl->error) return;
 
+#ifdef STL_INDEX_64
+  /* The count in the header is 32 bits */
+  if(stl->stats.number_of_facets > 0xffffffffLL) {
+    fprintf(stderr, "stl_write_binary: %" STL_INDEX_FORMAT
+            " facets do not fit in a binary STL file\n",
+            stl->stats.number_of_facets);
+    stl->error = 1;
+    return;
+  }
+#endif
+
   /* Open the file */
   fp = fopen(file, "wb");
   if(fp == NULL) {
@@ -285,7 +379,7 @@ stl_write_binary(stl_file *stl, const char *file, const char *label) {
 
   fseek(fp, LABEL_SIZE, SEEK_SET);
 
-  stl_put_little_int(fp, stl->stats.number_of_facets);
+  stl_put_little_int(fp, (int)(unsigned)stl->stats.number_of_facets);
 
   stl_write_binary_block(stl, fp);
 
@@ -293,18 +387,19 @@ stl_write_binary(stl_file *stl, const char *file, const char *label) {
 }
 
 void
-stl_write_vertex(stl_file *stl, int facet, int vertex) {
+stl_write_vertex(stl_file *stl, stl_index facet, int vertex) {
   if (stl->error) return;
-  printf("  vertex %d/%d % .8E % .8E % .8E\n", vertex, facet,
+  printf("  vertex %d/%" STL_INDEX_FORMAT " % .8E % .8E % .8E\n", vertex,
+         facet,
          stl->facet_start[facet].vertex[vertex].x,
          stl->facet_start[facet].vertex[vertex].y,
          stl->facet_start[facet].vertex[vertex].z);
 }
 
 void
-stl_write_facet(stl_file *stl, const char *label, int facet) {
+stl_write_facet(stl_file *stl, const char *label, stl_index facet) {
   if (stl->error) return;
-  printf("facet (%d)/ %s\n", facet, label);
+  printf("facet (%" STL_INDEX_FORMAT ")/ %s\n", facet, label);
   stl_write_vertex(stl, facet, 0);
   stl_write_vertex(stl, facet, 1);
   stl_write_vertex(stl, facet, 2);
@@ -313,7 +408,8 @@ stl_write_facet(stl_file *stl, const char *label, int facet) {
 void
 stl_write_edge(stl_file *stl, const char *label, stl_hash_edge edge) {
   if (stl->error) return;
-  printf("edge (%d)/(%d) %s\n", edge.facet_number, edge.which_edge, label);
+  printf("edge (%" STL_INDEX_FORMAT ")/(%d) %s\n", edge.facet_number,
+         edge.which_edge, label);
   if(edge.which_edge < 3) {
     stl_write_vertex(stl, edge.facet_number, edge.which_edge % 3);
     stl_write_vertex(stl, edge.facet_number, (edge.which_edge + 1) % 3);
@@ -324,9 +420,10 @@ stl_write_edge(stl_file *stl, const char *label, stl_hash_edge edge) {
 }
 
 void
-stl_write_neighbor(stl_file *stl, int facet) {
+stl_write_neighbor(stl_file *stl, stl_index facet) {
   if (stl->error) return;
-  printf("Neighbors %d: %d, %d, %d ;  %d, %d, %d\n", facet,
+  printf("Neighbors %" STL_INDEX_FORMAT ": %" STL_INDEX_FORMAT ", %"
+         STL_INDEX_FORMAT ", %" STL_INDEX_FORMAT " ;  %d, %d, %d\n", facet,
          stl->neighbors_start[facet].neighbor[0],
          stl->neighbors_start[facet].neighbor[1],
          stl->neighbors_start[facet].neighbor[2],
@@ -335,17 +432,48 @@ stl_write_neighbor(stl_file *stl, int facet) {
          stl->neighbors_start[facet].which_vertex_not[2]);
 }
 
+/* Formats "%f %f %f    %1.1f %1.1f %1.1f 1\n" */
+static char *
+stl_format_quad_vertex(char *out, const stl_vertex *vertex,
+                       const stl_vertex *color) {
+  out = stl_format_fixed(out, vertex->x, 6);
+  *out++ = ' ';
+  out = stl_format_fixed(out, vertex->y, 6);
+  *out++ = ' ';
+  out = stl_format_fixed(out, vertex->z, 6);
+  out = stl_format_str(out, "    ");
+  out = stl_format_fixed(out, color->x, 1);
+  *out++ = ' ';
+  out = stl_format_fixed(out, color->y, 1);
+  *out++ = ' ';
+  out = stl_format_fixed(out, color->z, 1);
+  return stl_format_str(out, " 1\n");
+}
+
+/* Facets are colored by how many of their edges are unconnected */
+static char *
+stl_format_quad_facet(char *out, const void *arg, stl_index i) {
+  static const stl_vertex colors[4] = {
+    {0.0, 0.0, 1.0}, {0.0, 1.0, 0.0}, {1.0, 1.0, 1.0}, {1.0, 0.0, 0.0}
+  };
+  const stl_file   *stl = (const stl_file*)arg;
+  const stl_facet  *facet = &stl->facet_start[i];
+  const stl_vertex *color;
+
+  color = &colors[(stl->neighbors_start[i].neighbor[0] == -1) +
+                  (stl->neighbors_start[i].neighbor[1] == -1) +
+                  (stl->neighbors_start[i].neighbor[2] == -1)];
+  out = stl_format_quad_vertex(out, &facet->vertex[0], color);
+  out = stl_format_quad_vertex(out, &facet->vertex[1], color);
+  out = stl_format_quad_vertex(out, &facet->vertex[2], color);
+  return stl_format_quad_vertex(out, &facet->vertex[2], color);
+}
+
 void
 stl_write_quad_object(stl_file *stl, const char *file) {
   FILE      *fp;
-  int       i;
-  int       j;
   char      *error_msg;
-  stl_vertex connect_color;
-  stl_vertex uncon_1_color;
-  stl_vertex uncon_2_color;
-  stl_vertex uncon_3_color;
-  stl_vertex color;
+  stl_text_writer out;
 
   if (stl->error) return;
 
@@ -362,58 +490,51 @@ stl_write_quad_object(stl_file *stl, const char *file) {
     return;
   }
 
-  connect_color.x = 0.0;
-  connect_color.y = 0.0;
-  connect_color.z = 1.0;
-  uncon_1_color.x = 0.0;
-  uncon_1_color.y = 1.0;
-  uncon_1_color.z = 0.0;
-  uncon_2_color.x = 1.0;
-  uncon_2_color.y = 1.0;
-  uncon_2_color.z = 1.0;
-  uncon_3_color.x = 1.0;
-  uncon_3_color.y = 0.0;
-  uncon_3_color.z = 0.0;
-
-  fprintf(fp, "CQUAD\n");
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    j = ((stl->neighbors_start[i].neighbor[0] == -1) +
-         (stl->neighbors_start[i].neighbor[1] == -1) +
-         (stl->neighbors_start[i].neighbor[2] == -1));
-    if(j == 0) {
-      color = connect_color;
-    } else if(j == 1) {
-      color = uncon_1_color;
-    } else if(j == 2) {
-      color = uncon_2_color;
-    } else {
-      color = uncon_3_color;
-    }
-    fprintf(fp, "%f %f %f    %1.1f %1.1f %1.1f 1\n",
-            stl->facet_start[i].vertex[0].x,
-            stl->facet_start[i].vertex[0].y,
-            stl->facet_start[i].vertex[0].z, color.x, color.y, color.z);
-    fprintf(fp, "%f %f %f    %1.1f %1.1f %1.1f 1\n",
-            stl->facet_start[i].vertex[1].x,
-            stl->facet_start[i].vertex[1].y,
-            stl->facet_start[i].vertex[1].z, color.x, color.y, color.z);
-    fprintf(fp, "%f %f %f    %1.1f %1.1f %1.1f 1\n",
-            stl->facet_start[i].vertex[2].x,
-            stl->facet_start[i].vertex[2].y,
-            stl->facet_start[i].vertex[2].z, color.x, color.y, color.z);
-    fprintf(fp, "%f %f %f    %1.1f %1.1f %1.1f 1\n",
-            stl->facet_start[i].vertex[2].x,
-            stl->facet_start[i].vertex[2].y,
-            stl->facet_start[i].vertex[2].z, color.x, color.y, color.z);
+  stl_text_begin(&out, fp);
+  stl_text_str(&out, "CQUAD\n");
+  stl_text_items(&out, stl->stats.number_of_facets, stl_format_quad_facet,
+                 stl);
+  if(stl_text_end(&out)) {
+    perror("stl_write_quad_object");
+    stl->error = 1;
   }
   fclose(fp);
 }
 
+/* Formats "<code>\n%f\n<code + 10>\n%f\n<code + 20>\n%f\n" */
+static char *
+stl_format_dxf_vertex(char *out, int code, const stl_vertex *vertex) {
+  out = stl_format_int(out, code);
+  *out++ = '\n';
+  out = stl_format_fixed(out, vertex->x, 6);
+  *out++ = '\n';
+  out = stl_format_int(out, code + 10);
+  *out++ = '\n';
+  out = stl_format_fixed(out, vertex->y, 6);
+  *out++ = '\n';
+  out = stl_format_int(out, code + 20);
+  *out++ = '\n';
+  out = stl_format_fixed(out, vertex->z, 6);
+  *out++ = '\n';
+  return out;
+}
+
+static char *
+stl_format_dxf_facet(char *out, const void *arg, stl_index i) {
+  const stl_facet *facet = (const stl_facet*)arg + i;
+
+  out = stl_format_str(out, "0\n3DFACE\n8\n0\n");
+  out = stl_format_dxf_vertex(out, 10, &facet->vertex[0]);
+  out = stl_format_dxf_vertex(out, 11, &facet->vertex[1]);
+  out = stl_format_dxf_vertex(out, 12, &facet->vertex[2]);
+  return stl_format_dxf_vertex(out, 13, &facet->vertex[2]);
+}
+
 void
 stl_write_dxf(stl_file *stl, const char *file, const char *label) {
-  int       i;
   FILE      *fp;
   char      *error_msg;
+  stl_text_writer out;
 
   if (stl->error) return;
 
@@ -438,20 +559,12 @@ stl_write_dxf(stl_file *stl, const char *file, const char *label) {
 
   fprintf(fp, "0\nSECTION\n2\nENTITIES\n");
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    fprintf(fp, "0\n3DFACE\n8\n0\n");
-    fprintf(fp, "10\n%f\n20\n%f\n30\n%f\n",
-            stl->facet_start[i].vertex[0].x, stl->facet_start[i].vertex[0].y,
-            stl->facet_start[i].vertex[0].z);
-    fprintf(fp, "11\n%f\n21\n%f\n31\n%f\n",
-            stl->facet_start[i].vertex[1].x, stl->facet_start[i].vertex[1].y,
-            stl->facet_start[i].vertex[1].z);
-    fprintf(fp, "12\n%f\n22\n%f\n32\n%f\n",
-            stl->facet_start[i].vertex[2].x, stl->facet_start[i].vertex[2].y,
-            stl->facet_start[i].vertex[2].z);
-    fprintf(fp, "13\n%f\n23\n%f\n33\n%f\n",
-            stl->facet_start[i].vertex[2].x, stl->facet_start[i].vertex[2].y,
-            stl->facet_start[i].vertex[2].z);
+  stl_text_begin(&out, fp);
+  stl_text_items(&out, stl->stats.number_of_facets, stl_format_dxf_facet,
+                 stl->facet_start);
+  if(stl_text_end(&out)) {
+    perror("stl_write_dxf");
+    stl->error = 1;
   }
 
   fprintf(fp, "0\nENDSEC\n0\nEOF\n");
@@ -25,9 +25,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bounds.h"
 #include "portable_endian.h"
 #include "stl.h"
+#include "threads.h"
+
+#if defined(__SSE__)
+#define STL_BOUNDS_SSE
+#include <xmmintrin.h>
+#endif
 
 #if !defined(SEEK_SET)
 #define SEEK_SET 0
@@ -35,15 +53,819 @@
 #define SEEK_END 2
 #endif
 
+/* A read-only view of a whole input file */
+typedef struct {
+  const unsigned char *data;
+  size_t              size;
+#if defined(_WIN32)
+  HANDLE              file;
+  HANDLE              mapping;
+#endif
+} stl_mapped_file;
+
+/* A cursor over ASCII STL text.  Unless at_eof is set the text continues
+   past end, and a token that runs into end sets need_more instead of being
+   taken as complete.  If stop is set, reading ends at the first facet that
+   starts at or after it.  ended is set when an endsolid finishes the file. */
+typedef struct {
+  const char *p;
+  const char *end;
+  const char *stop;
+  int         at_eof;
+  int         need_more;
+  int         ended;
+} stl_ascii_reader;
+
+/* One slice of a mapped ASCII file, parsed into facets of its own */
+typedef struct {
+  const char *begin;
+  const char *stop;
+  const char *end;
+  stl_file    part;
+  stl_index   num_facets;
+  int         status;
+  int         ended;
+} stl_ascii_chunk;
+
+/* Rough size of an ASCII facet, only used for the initial allocation */
+#define ASCII_BYTES_PER_FACET  200
+/* Smallest slice of ASCII text worth a thread of its own */
+#define ASCII_CHUNK_SIZE       (1 << 20)
+#define STL_IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+/* Binary facets are decoded this many at a time, and their bounds taken
+   while they are still in the cache */
+#define STL_DECODE_BLOCK_FACETS 1024
+
+static int stl_map_file(const char *file, stl_mapped_file *map);
+static void stl_unmap_file(stl_mapped_file *map);
+static void stl_load_mapped(stl_file *stl, const stl_mapped_file *map,
+                            const char *file);
+static void stl_count_facets_mapped(stl_file *stl, const stl_mapped_file *map,
+                                    const char *file);
+static void stl_read_mapped(stl_file *stl, const stl_mapped_file *map,
+                            stl_index first_facet, int first);
+static void stl_read_ascii_stdio(stl_file *stl, stl_index first_facet,
+                                 int first);
+static int stl_read_ascii_parallel(stl_file *stl, const char *begin,
+                                   const char *end, stl_index *facet_num,
+                                   int *first);
+static int stl_read_ascii_facets(stl_file *stl, stl_ascii_reader *r,
+                                 stl_index *facet_num, int *first);
+static void stl_finish_ascii(stl_file *stl, int status, stl_index num_facets,
+                             int set_original);
+static int stl_parse_float(const char *p, const char *end,
+                           const char **next, float *value);
+static void stl_compute_size(stl_file *stl);
+static void stl_block_stats(stl_file *stl, stl_index start, stl_index end,
+                            int *first);
+static int stl_facets_fit(stl_file *stl, stl_index have,
+                          unsigned long long more);
+
 void
 stl_open(stl_file *stl, const char *file) {
+  stl_mapped_file map;
+
   stl_initialize(stl);
+
+  /* Prefer the memory mapped reader, stdio is the fallback for files that
+     cannot be mapped (pipes, empty files) */
+  if(stl_map_file(file, &map)) {
+    stl_load_mapped(stl, &map, file);
+    stl_unmap_file(&map);
+    return;
+  }
+
   stl_count_facets(stl, file);
   stl_allocate(stl);
   stl_read(stl, 0, 1);
   if (!stl->error) fclose(stl->fp);
 }
 
+void
+stl_open_mmap(stl_file *stl, const char *file) {
+  stl_mapped_file map;
+  char *error_msg;
+
+  stl_initialize(stl);
+
+  if(!stl_map_file(file, &map)) {
+    error_msg = (char*)
+                malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
+    sprintf(error_msg, "stl_open_mmap: Couldn't map %s for reading",
+            file);
+    perror(error_msg);
+    free(error_msg);
+    stl->error = 1;
+    return;
+  }
+  stl_load_mapped(stl, &map, file);
+  stl_unmap_file(&map);
+}
+
+static void
+stl_load_mapped(stl_file *stl, const stl_mapped_file *map, const char *file) {
+  stl_count_facets_mapped(stl, map, file);
+  stl_allocate(stl);
+  stl_read_mapped(stl, map, 0, 1);
+}
+
+static int
+stl_map_file(const char *file, stl_mapped_file *map) {
+#if defined(_WIN32)
+  LARGE_INTEGER size;
+
+  map->data = NULL;
+  map->size = 0;
+  map->mapping = NULL;
+  map->file = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL,
+                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if(map->file == INVALID_HANDLE_VALUE) return 0;
+
+  if(!GetFileSizeEx(map->file, &size) || size.QuadPart <= 0 ||
+     (unsigned long long)size.QuadPart > (size_t)-1) {
+    CloseHandle(map->file);
+    return 0;
+  }
+  map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(map->mapping == NULL) {
+    CloseHandle(map->file);
+    return 0;
+  }
+  map->data = (const unsigned char*)MapViewOfFile(map->mapping, FILE_MAP_READ,
+                                                  0, 0, 0);
+  if(map->data == NULL) {
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+    return 0;
+  }
+  map->size = (size_t)size.QuadPart;
+  return 1;
+#else
+  struct stat st;
+  void *data;
+  int fd;
+
+  map->data = NULL;
+  map->size = 0;
+
+  fd = open(file, O_RDONLY);
+  if(fd < 0) return 0;
+
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+     (unsigned long long)st.st_size > (size_t)-1) {
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return 0;
+
+#if defined(MADV_SEQUENTIAL)
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+  map->data = (const unsigned char*)data;
+  map->size = (size_t)st.st_size;
+  return 1;
+#endif
+}
+
+static void
+stl_unmap_file(stl_mapped_file *map) {
+  if(map->data == NULL) return;
+#if defined(_WIN32)
+  UnmapViewOfFile(map->data);
+  CloseHandle(map->mapping);
+  CloseHandle(map->file);
+#else
+  munmap((void*)map->data, map->size);
+#endif
+  map->data = NULL;
+  map->size = 0;
+}
+
+/* Does what stl_count_facets does, but on a mapped file.  The number of
+   facets of an ASCII file is only an estimate, the reader grows facet_start
+   as needed. */
+static void
+stl_count_facets_mapped(stl_file *stl, const stl_mapped_file *map,
+                        const char *file) {
+  uint32_t header_num_facets;
+  size_t   num_facets;
+  size_t   s;
+
+  if (stl->error) return;
+
+  if(map->size < HEADER_SIZE + 128) {
+    fprintf(stderr, "The input is an empty file\n");
+    stl->error = 1;
+    return;
+  }
+
+  /* Check for binary or ASCII file */
+  stl->stats.type = ascii;
+  for(s = HEADER_SIZE; s < HEADER_SIZE + 128; s++) {
+    if(map->data[s] > 127) {
+      stl->stats.type = binary;
+      break;
+    }
+  }
+
+  if(stl->stats.type == binary) {
+    /* Test if the STL file has the right size  */
+    if(((map->size - HEADER_SIZE) % SIZEOF_STL_FACET != 0)
+        || (map->size < STL_MIN_FILE_SIZE)) {
+      fprintf(stderr, "The file %s has the wrong size.\n", file);
+      stl->error = 1;
+      return;
+    }
+    num_facets = (map->size - HEADER_SIZE) / SIZEOF_STL_FACET;
+
+    memcpy(stl->stats.header, map->data, LABEL_SIZE);
+    stl->stats.header[LABEL_SIZE] = '\0';
+
+    /* The int following the header should contain # of facets */
+    memcpy(&header_num_facets, map->data + LABEL_SIZE, sizeof(uint32_t));
+    if((uint32_t)num_facets != le32toh(header_num_facets)) {
+      fprintf(stderr,
+              "Warning: File size doesn't match number of facets in the header\n");
+    }
+  } else {
+    /* The header is the first line */
+    for(s = 0; s < LABEL_SIZE && map->data[s] != '\n'; s++) {
+      stl->stats.header[s] = map->data[s];
+    }
+    if(s > 0 && stl->stats.header[s - 1] == '\r') s--;
+    stl->stats.header[s] = '\0';
+
+    /* Only an estimate, so it need not fit */
+    num_facets = STL_MIN(map->size / ASCII_BYTES_PER_FACET + 1,
+                         (size_t)(STL_MAX_FACETS
+                                  - stl->stats.number_of_facets));
+  }
+
+  if(!stl_facets_fit(stl, stl->stats.number_of_facets, num_facets)) return;
+  stl->stats.number_of_facets += (stl_index)num_facets;
+  stl->stats.original_num_facets = stl->stats.number_of_facets;
+}
+
+/* Reads a mapped file into stl, starting at facet first_facet.  Binary
+   records are 50 bytes long and so are the leading bytes of stl_facet, so on
+   little endian hosts every record is a single copy out of the page cache. */
+static void
+stl_read_mapped(stl_file *stl, const stl_mapped_file *map,
+                stl_index first_facet, int first) {
+  const unsigned char *record;
+  stl_ascii_reader r;
+  stl_index i;
+  stl_index block;
+  stl_index block_end;
+  int status;
+  int set_original = first;
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+  int j;
+  uint32_t endianswap_buffer;  /* for byteswapping operations */
+  float *facet_floats;
+#endif
+
+  if (stl->error) return;
+
+  if(stl->stats.type != binary) {
+    /* Skip the first line of the file */
+    r.p = (const char*)map->data;
+    r.end = r.p + map->size;
+    r.stop = NULL;
+    r.at_eof = 1;
+    r.need_more = 0;
+    r.ended = 0;
+    while(r.p < r.end && *r.p++ != '\n');
+
+    i = first_facet;
+    if(stl_read_ascii_parallel(stl, r.p, r.end, &i, &first)) {
+      status = 1;
+    } else {
+      status = stl_read_ascii_facets(stl, &r, &i, &first);
+    }
+    stl_finish_ascii(stl, status, i, set_original);
+    return;
+  }
+
+  record = map->data + HEADER_SIZE;
+  for(block = first_facet; block < stl->stats.number_of_facets;
+      block = block_end) {
+    block_end = STL_MIN(stl->stats.number_of_facets,
+                        block + STL_DECODE_BLOCK_FACETS);
+    for(i = block; i < block_end; i++, record += SIZEOF_STL_FACET) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+      memcpy(&stl->facet_start[i], record, SIZEOF_STL_FACET);
+#else
+      facet_floats = &stl->facet_start[i].normal.x;
+      for(j = 0; j < 12; j++) {
+        /* convert LE float to host byte order */
+        memcpy(&endianswap_buffer, record + j * sizeof(float), 4);
+        endianswap_buffer = le32toh(endianswap_buffer);
+        memcpy(&facet_floats[j], &endianswap_buffer, 4);
+      }
+      memcpy(stl->facet_start[i].extra, record + 12 * sizeof(float), 2);
+#endif
+    }
+    stl_block_stats(stl, block, block_end, &first);
+  }
+  stl_compute_size(stl);
+}
+
+/* Reads the ASCII facets of stl->fp in large blocks.  A facet cut by the end
+   of a block is parsed again once the next block is read. */
+static void
+stl_read_ascii_stdio(stl_file *stl, stl_index first_facet, int first) {
+  stl_ascii_reader r;
+  char   *buffer;
+  char   *new_buffer;
+  size_t capacity = 1 << 20;
+  size_t size = 0;
+  size_t n;
+  stl_index facet_num = first_facet;
+  int    set_original = first;
+  int    status;
+
+  buffer = (char*)malloc(capacity);
+  if(buffer == NULL) {
+    perror("stl_read");
+    stl->error = 1;
+    return;
+  }
+
+  for(;;) {
+    n = fread(buffer + size, 1, capacity - size, stl->fp);
+    r.at_eof = (n < capacity - size);
+    size += n;
+    r.p = buffer;
+    r.end = buffer + size;
+    r.stop = NULL;
+    r.need_more = 0;
+    r.ended = 0;
+
+    status = stl_read_ascii_facets(stl, &r, &facet_num, &first);
+    if(status != 0) break;
+
+    /* Keep the unfinished facet and read the next block after it */
+    size = r.end - r.p;
+    memmove(buffer, r.p, size);
+    if(size == capacity) {
+      capacity *= 2;
+      new_buffer = (char*)realloc(buffer, capacity);
+      if(new_buffer == NULL) {
+        perror("stl_read");
+        status = -1;
+        break;
+      }
+      buffer = new_buffer;
+    }
+  }
+  free(buffer);
+  stl_finish_ascii(stl, status, facet_num, set_original);
+}
+
+static void
+stl_finish_ascii(stl_file *stl, int status, stl_index num_facets,
+                 int set_original) {
+  if(status < 0) {
+    if(!stl->error)
+      fprintf(stderr,
+              "Something is syntactically very wrong with this ASCII STL!\n");
+    stl->error = 1;
+    return;
+  }
+
+  stl->stats.number_of_facets = num_facets;
+  if(set_original) {
+    stl->stats.original_num_facets = num_facets;
+  }
+  /* Give back what the estimate allocated in excess */
+  if(num_facets > 0 && stl->stats.facets_malloced > num_facets) {
+    stl_reallocate(stl);
+  }
+  stl_compute_size(stl);
+}
+
+/* Case insensitive match of a word against a lowercase keyword */
+static int
+stl_ascii_keyword(const char *word, size_t len, const char *keyword) {
+  size_t i;
+
+  for(i = 0; i < len; i++) {
+    if(keyword[i] == '\0' || (word[i] | 0x20) != keyword[i]) return 0;
+  }
+  return keyword[len] == '\0';
+}
+
+static int
+stl_ascii_skip_space(stl_ascii_reader *r) {
+  while(r->p < r->end && STL_IS_SPACE(*r->p)) r->p++;
+  if(r->p < r->end) return 1;
+  if(!r->at_eof) r->need_more = 1;
+  return 0;
+}
+
+/* Skips a whitespace delimited word, like "%*s" does */
+static int
+stl_ascii_word(stl_ascii_reader *r, const char **word, size_t *len) {
+  const char *start;
+
+  if(!stl_ascii_skip_space(r)) return 0;
+  start = r->p;
+  while(r->p < r->end && !STL_IS_SPACE(*r->p)) r->p++;
+  if(r->p == r->end && !r->at_eof) {
+    r->need_more = 1;
+    return 0;
+  }
+  *word = start;
+  *len = r->p - start;
+  return 1;
+}
+
+static int
+stl_ascii_skip_word(stl_ascii_reader *r) {
+  const char *word;
+  size_t len;
+
+  return stl_ascii_word(r, &word, &len);
+}
+
+static int
+stl_ascii_skip_line(stl_ascii_reader *r) {
+  const char *newline;
+
+  newline = (const char*)memchr(r->p, '\n', r->end - r->p);
+  if(newline == NULL) {
+    if(!r->at_eof) {
+      r->need_more = 1;
+      return 0;
+    }
+    r->p = r->end;
+    return 1;
+  }
+  r->p = newline + 1;
+  return 1;
+}
+
+static int
+stl_ascii_float(stl_ascii_reader *r, float *value) {
+  const char *next;
+
+  if(!stl_ascii_skip_space(r)) return 0;
+  if(!r->at_eof && r->end - r->p < 64) {
+    /* The number may continue in text that has not been read yet */
+    for(next = r->p; next < r->end && !STL_IS_SPACE(*next); next++);
+    if(next == r->end) {
+      r->need_more = 1;
+      return 0;
+    }
+  }
+  if(!stl_parse_float(r->p, r->end, &next, value)) return 0;
+  r->p = next;
+  return 1;
+}
+
+static int
+stl_ascii_floats(stl_ascii_reader *r, float *x, float *y, float *z) {
+  return stl_ascii_float(r, x) && stl_ascii_float(r, y)
+         && stl_ascii_float(r, z);
+}
+
+/* Makes room for facet number facet_num, growing the arrays geometrically */
+static int
+stl_reserve_facet(stl_file *stl, stl_index facet_num) {
+  stl_facet     *facets;
+  stl_neighbors *neighbors;
+  stl_index     size;
+
+  if(facet_num < stl->stats.facets_malloced) return 1;
+  if(!stl_facets_fit(stl, facet_num, 1)) return 0;
+
+  size = stl->stats.facets_malloced
+         + STL_MIN(stl->stats.facets_malloced / 2 + 256,
+                   STL_MAX_FACETS - stl->stats.facets_malloced);
+  facets = (stl_facet*)realloc(stl->facet_start, size * sizeof(stl_facet));
+  if(facets == NULL) {
+    perror("stl_read");
+    stl->error = 1;
+    return 0;
+  }
+  stl->facet_start = facets;
+  stl->stats.facets_malloced = size;
+  /* The slices of a parallel read only hold facets */
+  if(stl->neighbors_start == NULL) return 1;
+  neighbors = (stl_neighbors*)realloc(stl->neighbors_start,
+                                      size * sizeof(stl_neighbors));
+  if(neighbors == NULL) {
+    perror("stl_read");
+    stl->error = 1;
+    return 0;
+  }
+  stl->neighbors_start = neighbors;
+  return 1;
+}
+
+/* Reads ASCII facets into stl at facet *facet_num and onwards, with the same
+   layout the old fscanf reader expected.  Returns 1 at the end of the solid,
+   0 if the reader ran out of text in the middle of a facet (it is then left
+   at the start of that facet) and -1 on a syntax error. */
+static int
+stl_read_ascii_facets(stl_file *stl, stl_ascii_reader *r,
+                      stl_index *facet_num, int *first) {
+  stl_facet   facet;
+  const char  *facet_begin;
+  const char  *word;
+  size_t      len;
+
+  facet.extra[0] = 0;
+  facet.extra[1] = 0;
+
+  for(;;) {
+    facet_begin = r->p;
+    if(!stl_ascii_word(r, &word, &len)) break;
+    if(r->stop != NULL && word >= r->stop) {
+      r->p = word;
+      return 1;
+    }
+
+    if(stl_ascii_keyword(word, len, "endsolid")) {
+      /* Carry on only if another solid follows */
+      if(!stl_ascii_skip_line(r) || !stl_ascii_word(r, &word, &len)) break;
+      if(!stl_ascii_keyword(word, len, "solid")) {
+        r->ended = 1;
+        return 1;
+      }
+      if(!stl_ascii_skip_line(r)) break;
+      continue;
+    }
+
+    /* facet normal x y z / outer loop / 3 x vertex x y z / endloop / endfacet */
+    if(!stl_ascii_skip_word(r)
+       || !stl_ascii_floats(r, &facet.normal.x, &facet.normal.y, &facet.normal.z)
+       || !stl_ascii_skip_word(r) || !stl_ascii_skip_word(r)
+       || !stl_ascii_skip_word(r) || !stl_ascii_floats(r, &facet.vertex[0].x,
+           &facet.vertex[0].y, &facet.vertex[0].z)
+       || !stl_ascii_skip_word(r) || !stl_ascii_floats(r, &facet.vertex[1].x,
+           &facet.vertex[1].y, &facet.vertex[1].z)
+       || !stl_ascii_skip_word(r) || !stl_ascii_floats(r, &facet.vertex[2].x,
+           &facet.vertex[2].y, &facet.vertex[2].z)
+       || !stl_ascii_skip_word(r) || !stl_ascii_skip_word(r)) {
+      if(!r->need_more) return -1;
+      break;
+    }
+
+    if(!stl_reserve_facet(stl, *facet_num)) return -1;
+    stl->facet_start[*facet_num] = facet;
+    stl_block_stats(stl, *facet_num, *facet_num + 1, first);
+    (*facet_num)++;
+  }
+
+  if(r->need_more) {
+    r->p = facet_begin;
+    return 0;
+  }
+  return 1;
+}
+
+/* Returns the first word at or after p that starts a line and reads
+   "facet", or end if there is none */
+static const char *
+stl_ascii_next_facet(const char *p, const char *end) {
+  while(p < end) {
+    p = (const char*)memchr(p, '\n', end - p);
+    if(p == NULL) return end;
+    while(p < end && STL_IS_SPACE(*p)) p++;
+    if(end - p > 5 && stl_ascii_keyword(p, 5, "facet") && STL_IS_SPACE(p[5]))
+      return p;
+  }
+  return end;
+}
+
+static void
+stl_read_ascii_chunk(void *arg, int task) {
+  stl_ascii_chunk *chunk = (stl_ascii_chunk*)arg + task;
+  stl_ascii_reader r;
+  int first = 1;
+
+  stl_initialize(&chunk->part);
+  chunk->part.stats.facets_malloced =
+    (chunk->stop - chunk->begin) / ASCII_BYTES_PER_FACET + 1;
+  chunk->part.facet_start = (stl_facet*)
+    malloc(chunk->part.stats.facets_malloced * sizeof(stl_facet));
+  if(chunk->part.facet_start == NULL) {
+    chunk->part.stats.facets_malloced = 0;
+  }
+
+  /* Read on past stop, a facet that starts before it is finished as the
+     serial reader would */
+  r.p = chunk->begin;
+  r.end = chunk->end;
+  r.stop = chunk->stop < chunk->end ? chunk->stop : NULL;
+  r.at_eof = 1;
+  r.need_more = 0;
+  r.ended = 0;
+  chunk->num_facets = 0;
+  chunk->status = stl_read_ascii_facets(&chunk->part, &r,
+                                        &chunk->num_facets, &first);
+  chunk->ended = r.ended;
+  /* A slice has to end right where the next one starts, otherwise the
+     split did not fall between two facets */
+  if(chunk->status == 1 && !r.ended && r.stop != NULL && r.p != r.stop) {
+    chunk->status = -1;
+  }
+}
+
+/* Splits the text between begin and end at facet boundaries and parses the
+   slices on several threads.  The facets are then copied into stl in file
+   order and the per slice bounds are merged, so the result is the same as
+   that of stl_read_ascii_facets.  Returns 0 if the text was not parsed, for
+   instance because it is small, and the serial reader has to be used. */
+static int
+stl_read_ascii_parallel(stl_file *stl, const char *begin, const char *end,
+                        stl_index *facet_num, int *first) {
+  stl_ascii_chunk *chunks;
+  stl_stats       *part;
+  int             num_chunks;
+  int             used;
+  stl_index       total;
+  int             i;
+  int             ok = 1;
+
+  num_chunks = stl_thread_count();
+  if((end - begin) / ASCII_CHUNK_SIZE < num_chunks) {
+    num_chunks = (end - begin) / ASCII_CHUNK_SIZE;
+  }
+  if(num_chunks < 2) return 0;
+
+  chunks = (stl_ascii_chunk*)malloc(num_chunks * sizeof(stl_ascii_chunk));
+  if(chunks == NULL) return 0;
+
+  chunks[0].begin = begin;
+  for(i = 1; i < num_chunks; i++) {
+    chunks[i].begin = stl_ascii_next_facet(begin + (end - begin) / num_chunks * i,
+                                           end);
+    if(chunks[i].begin < chunks[i - 1].begin) {
+      chunks[i].begin = chunks[i - 1].begin;
+    }
+    chunks[i - 1].stop = chunks[i].begin;
+  }
+  chunks[num_chunks - 1].stop = end;
+  for(i = 0; i < num_chunks; i++) {
+    chunks[i].end = end;
+  }
+
+  stl_parallel_for(num_chunks, stl_read_ascii_chunk, chunks);
+
+  /* Everything after an endsolid that closes the file is ignored */
+  total = 0;
+  for(used = 0; used < num_chunks; used++) {
+    if(chunks[used].status != 1 || chunks[used].part.error) ok = 0;
+    total += chunks[used].num_facets;
+    if(chunks[used].ended) {
+      used++;
+      break;
+    }
+  }
+
+  if(ok && !stl_facets_fit(stl, *facet_num, total)) ok = 0;
+  if(ok) {
+    stl->stats.number_of_facets = *facet_num + total;
+    stl_reallocate(stl);
+    if(stl->facet_start == NULL || stl->neighbors_start == NULL) {
+      stl->error = 1;
+      ok = 0;
+    }
+  }
+
+  for(i = 0; i < num_chunks; i++) {
+    part = &chunks[i].part.stats;
+    if(ok && i < used && chunks[i].num_facets > 0) {
+      memcpy(stl->facet_start + *facet_num, chunks[i].part.facet_start,
+             chunks[i].num_facets * sizeof(stl_facet));
+      *facet_num += chunks[i].num_facets;
+      if(*first) {
+        stl->stats.min = part->min;
+        stl->stats.max = part->max;
+        stl->stats.shortest_edge = part->shortest_edge;
+        *first = 0;
+      } else {
+        stl->stats.max.x = STL_MAX(stl->stats.max.x, part->max.x);
+        stl->stats.min.x = STL_MIN(stl->stats.min.x, part->min.x);
+        stl->stats.max.y = STL_MAX(stl->stats.max.y, part->max.y);
+        stl->stats.min.y = STL_MIN(stl->stats.min.y, part->min.y);
+        stl->stats.max.z = STL_MAX(stl->stats.max.z, part->max.z);
+        stl->stats.min.z = STL_MIN(stl->stats.min.z, part->min.z);
+      }
+    }
+    free(chunks[i].part.facet_start);
+  }
+  free(chunks);
+  /* Errors are reported by the serial reader, which gets the text next */
+  return ok || stl->error;
+}
+
+static const double stl_powers_of_ten[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Parses a decimal float at p like strtof does.  Numbers with at most 15
+   significant digits and a small exponent are converted with one exact
+   double operation; the result is then rounded to float, which is correct
+   unless the double landed exactly on a halfway point between two floats.
+   Everything else goes through strtof. */
+static int
+stl_parse_float(const char *p, const char *end,
+                const char **next, float *value) {
+  const char *start = p;
+  const char *exp_start;
+  char       buffer[64];
+  char       *buffer_end;
+  uint64_t   mantissa = 0;
+  uint64_t   bits;
+  int        digits = 0;
+  int        exponent = 0;
+  int        exp_value = 0;
+  int        exp_negative = 0;
+  int        negative = 0;
+  int        any_digits = 0;
+  size_t     len;
+  double     d;
+
+  if(p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+  for(; p < end && (unsigned)(*p - '0') < 10; p++) {
+    any_digits = 1;
+    if(mantissa == 0 && *p == '0') continue;
+    if(digits++ < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+    } else {
+      exponent++;
+    }
+  }
+  if(p < end && *p == '.') {
+    for(p++; p < end && (unsigned)(*p - '0') < 10; p++) {
+      any_digits = 1;
+      if(mantissa == 0 && *p == '0') {
+        exponent--;
+        continue;
+      }
+      if(digits++ < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+  if(any_digits && p < end && (*p == 'e' || *p == 'E')) {
+    exp_start = p++;
+    if(p < end && (*p == '-' || *p == '+')) {
+      exp_negative = (*p == '-');
+      p++;
+    }
+    if(p < end && (unsigned)(*p - '0') < 10) {
+      for(; p < end && (unsigned)(*p - '0') < 10; p++) {
+        if(exp_value < 10000) exp_value = exp_value * 10 + (*p - '0');
+      }
+      exponent += exp_negative ? -exp_value : exp_value;
+    } else {
+      p = exp_start;  /* not an exponent after all */
+    }
+  }
+
+  if(any_digits && digits <= 15 && exponent >= -22 && exponent <= 22) {
+    if(mantissa == 0) {
+      *value = negative ? -0.0f : 0.0f;
+      *next = p;
+      return 1;
+    }
+    d = (double)mantissa;
+    if(exponent < 0) {
+      d /= stl_powers_of_ten[-exponent];
+    } else {
+      d *= stl_powers_of_ten[exponent];
+    }
+    memcpy(&bits, &d, sizeof(bits));
+    if(d >= FLT_MIN && d <= FLT_MAX && (bits & 0x1fffffff) != 0x10000000) {
+      *value = (float)(negative ? -d : d);
+      *next = p;
+      return 1;
+    }
+  }
+
+  /* Slow path: let strtof have a NUL terminated copy of the token */
+  for(len = 0; start + len < end && len < sizeof(buffer) - 1
+      && !STL_IS_SPACE(start[len]); len++) {
+    buffer[len] = start[len];
+  }
+  buffer[len] = '\0';
+  *value = strtof(buffer, &buffer_end);
+  if(buffer_end == buffer) return 0;
+  *next = start + (buffer_end - buffer);
+  return 1;
+}
 
 void
 stl_initialize(stl_file *stl) {
@@ -64,19 +886,22 @@ stl_initialize(stl_file *stl) {
 
   stl->neighbors_start = NULL;
   stl->facet_start = NULL;
+  stl->edge_table = NULL;
+  stl->check = NULL;
   stl->v_indices = NULL;
   stl->v_shared = NULL;
+  memset(&stl->soa, 0, sizeof(stl->soa));
 }
 
 void
 stl_count_facets(stl_file *stl, const char *file) {
   long           file_size;
   uint32_t       header_num_facets;
-  int            num_facets;
-  int            i, j;
+  unsigned long  num_facets;
+  int            i;
+  int            c;
   size_t         s;
   unsigned char  chtest[128];
-  int            num_lines = 1;
   char           *error_msg;
 
   if (stl->error) return;
@@ -123,7 +948,7 @@ stl_count_facets(stl_file *stl, const char *file) {
       stl->error = 1;
       return;
     }
-    num_facets = (file_size - HEADER_SIZE) / SIZEOF_STL_FACET;
+    num_facets = (unsigned long)(file_size - HEADER_SIZE) / SIZEOF_STL_FACET;
 
     /* Read the header */
     if (fread(stl->stats.header, LABEL_SIZE, 1, stl->fp) > 79) {
@@ -145,31 +970,35 @@ stl_count_facets(stl_file *stl, const char *file) {
       return;
     }
 
-    /* Find the number of facets */
-    j = 0;
-    for(i = 0; i < file_size ; i++) {
-      j++;
-      if(getc(stl->fp) == '\n') {
-        if(j > 4) { /* don't count short lines */
-          num_lines++;
-        }
-        j = 0;
-      }
-    }
-    rewind(stl->fp);
-
     /* Get the header */
     for(i = 0;
-        (i < 80) && (stl->stats.header[i] = getc(stl->fp)) != '\n'; i++);
+        (i < 80) && (c = getc(stl->fp)) != '\n' && c != EOF; i++) {
+      stl->stats.header[i] = c;
+    }
     stl->stats.header[i] = '\0'; /* Lose the '\n' */
     stl->stats.header[80] = '\0';
 
-    num_facets = num_lines / ASCII_LINES_PER_FACET;
+    /* Only an estimate, stl_read grows facet_start as needed */
+    num_facets = STL_MIN((unsigned long)file_size / ASCII_BYTES_PER_FACET + 1,
+                         (unsigned long)(STL_MAX_FACETS
+                                         - stl->stats.number_of_facets));
   }
-  stl->stats.number_of_facets += num_facets;
+  if(!stl_facets_fit(stl, stl->stats.number_of_facets, num_facets)) return;
+  stl->stats.number_of_facets += (stl_index)num_facets;
   stl->stats.original_num_facets = stl->stats.number_of_facets;
 }
 
+/* Checks that a mesh of have facets can take more of them, and sets the
+   error if it would need more than stl_index can number */
+static int
+stl_facets_fit(stl_file *stl, stl_index have, unsigned long long more) {
+  if(more <= (unsigned long long)(STL_MAX_FACETS - have)) return 1;
+  fprintf(stderr, "The mesh would have more than %" STL_INDEX_FORMAT
+          " facets\n", (stl_index)STL_MAX_FACETS);
+  stl->error = 1;
+  return 0;
+}
+
 void
 stl_allocate(stl_file *stl) {
   if (stl->error) return;
@@ -188,12 +1017,15 @@ stl_allocate(stl_file *stl) {
 
 void
 stl_open_merge(stl_file *stl, const char *file_to_merge) {
-  int num_facets_so_far;
+  stl_index num_facets_so_far;
   stl_type origStlType;
   FILE *origFp;
   stl_file stl_to_merge;
+  stl_mapped_file map;
+  int mapped;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   /* Record how many facets we have so far from the first file.  We will start putting
      facets in the next position.  Since we're 0-indexed, it'l be the same position. */
@@ -206,7 +1038,17 @@ stl_open_merge(stl_file *stl, const char *file_to_merge) {
 
   /* Initialize the sturucture with zero stats, header info and sizes: */
   stl_initialize(&stl_to_merge);
-  stl_count_facets(&stl_to_merge, file_to_merge);
+  mapped = stl_map_file(file_to_merge, &map);
+  if(mapped) {
+    stl_count_facets_mapped(&stl_to_merge, &map, file_to_merge);
+  } else {
+    stl_count_facets(&stl_to_merge, file_to_merge);
+  }
+  if(stl_to_merge.error) {
+    if(mapped) stl_unmap_file(&map);
+    stl->error = 1;
+    return;
+  }
 
   /* Copy what we need to into stl so that we can read the file_to_merge directly into it
      using stl_read:  Save the rest of the valuable info: */
@@ -215,6 +1057,14 @@ stl_open_merge(stl_file *stl, const char *file_to_merge) {
 
   /* Add the number of facets we already have in stl with what we we found in stl_to_merge but
      haven't read yet. */
+  if(!stl_facets_fit(stl, num_facets_so_far,
+                     stl_to_merge.stats.number_of_facets)) {
+    if(mapped) stl_unmap_file(&map);
+    else fclose(stl_to_merge.fp);
+    stl->stats.type = origStlType;
+    stl->fp = origFp;
+    return;
+  }
   stl->stats.number_of_facets=num_facets_so_far+stl_to_merge.stats.number_of_facets;
 
   /* Allocate enough room for stl->stats.number_of_facets facets and neighbors: */
@@ -224,7 +1074,13 @@ stl_open_merge(stl_file *stl, const char *file_to_merge) {
      Start at num_facets_so_far, the index to the first unused facet.  Also say
      that this isn't our first time so we should augment stats like min and max
      instead of erasing them. */
-  stl_read(stl, num_facets_so_far, 0);
+  if(mapped) {
+    stl_read_mapped(stl, &map, num_facets_so_far, 0);
+    stl_unmap_file(&map);
+  } else {
+    stl_read(stl, num_facets_so_far, 0);
+    if (!stl->error) fclose(stl->fp);
+  }
 
   /* Restore the stl information we overwrote (for stl_read) so that it still accurately
      reflects the subject part: */
@@ -253,9 +1109,11 @@ stl_reallocate(stl_file *stl) {
    starting at facet first_facet.  The second argument says if it's our first
    time running this for the stl and therefore we should reset our max and min stats. */
 void
-stl_read(stl_file *stl, int first_facet, int first) {
+stl_read(stl_file *stl, stl_index first_facet, int first) {
   stl_facet facet;
-  int   i, j;
+  stl_index i;
+  int   j;
+  stl_index block;
   const int facet_float_length = 12;
   float *facet_floats[12];
   char facet_buffer[12 * sizeof(float)];
@@ -279,52 +1137,45 @@ stl_read(stl_file *stl, int first_facet, int first) {
 
   if (stl->error) return;
 
-  if(stl->stats.type == binary) {
-    fseek(stl->fp, HEADER_SIZE, SEEK_SET);
-  } else {
+  if(stl->stats.type != binary) {
     rewind(stl->fp);
     /* Skip the first line of the file */
-    while(getc(stl->fp) != '\n');
+    while((j = getc(stl->fp)) != '\n' && j != EOF);
+    stl_read_ascii_stdio(stl, first_facet, first);
+    return;
   }
 
+  fseek(stl->fp, HEADER_SIZE, SEEK_SET);
+  block = first_facet;
   for(i = first_facet; i < stl->stats.number_of_facets; i++) {
-    if(stl->stats.type == binary)
-      /* Read a single facet from a binary .STL file */
-    {
-      if(fread(facet_buffer, sizeof(facet_buffer), 1, stl->fp)
-         + fread(&facet.extra, sizeof(char), 2, stl->fp) != 3) {
-        perror("Cannot read facet");
-        stl->error = 1;
-        return;
-      }
+    /* Read a single facet from a binary .STL file */
+    if(fread(facet_buffer, sizeof(facet_buffer), 1, stl->fp)
+       + fread(&facet.extra, sizeof(char), 2, stl->fp) != 3) {
+      perror("Cannot read facet");
+      stl->error = 1;
+      return;
+    }
 
-      for(j = 0; j < facet_float_length; j++) {
-        /* convert LE float to host byte order */
-        memcpy(&endianswap_buffer, facet_buffer + j * sizeof(float), 4);
-        endianswap_buffer = le32toh(endianswap_buffer);
-        memcpy(facet_floats[j], &endianswap_buffer, 4);
-      }
-    } else
-      /* Read a single facet from an ASCII .STL file */
-    {
-      if((fscanf(stl->fp, "%*s %*s %f %f %f\n", &facet.normal.x, &facet.normal.y, &facet.normal.z) + \
-          fscanf(stl->fp, "%*s %*s") + \
-          fscanf(stl->fp, "%*s %f %f %f\n", &facet.vertex[0].x, &facet.vertex[0].y,  &facet.vertex[0].z) + \
-          fscanf(stl->fp, "%*s %f %f %f\n", &facet.vertex[1].x, &facet.vertex[1].y,  &facet.vertex[1].z) + \
-          fscanf(stl->fp, "%*s %f %f %f\n", &facet.vertex[2].x, &facet.vertex[2].y,  &facet.vertex[2].z) + \
-          fscanf(stl->fp, "%*s") + \
-          fscanf(stl->fp, "%*s")) != 12) {
-        perror("Something is syntactically very wrong with this ASCII STL!");
-        stl->error = 1;
-        return;
-      }
+    for(j = 0; j < facet_float_length; j++) {
+      /* convert LE float to host byte order */
+      memcpy(&endianswap_buffer, facet_buffer + j * sizeof(float), 4);
+      endianswap_buffer = le32toh(endianswap_buffer);
+      memcpy(facet_floats[j], &endianswap_buffer, 4);
     }
     /* Write the facet into memory. */
     stl->facet_start[i] = facet;
 
-    stl_facet_stats(stl, facet, first);
-    first = 0;
+    if(i + 1 - block == STL_DECODE_BLOCK_FACETS) {
+      stl_block_stats(stl, block, i + 1, &first);
+      block = i + 1;
+    }
   }
+  stl_block_stats(stl, block, stl->stats.number_of_facets, &first);
+  stl_compute_size(stl);
+}
+
+static void
+stl_compute_size(stl_file *stl) {
   stl->stats.size.x = stl->stats.max.x - stl->stats.min.x;
   stl->stats.size.y = stl->stats.max.y - stl->stats.min.y;
   stl->stats.size.z = stl->stats.max.z - stl->stats.min.z;
@@ -335,6 +1186,127 @@ stl_read(stl_file *stl, int first_facet, int first) {
                                  );
 }
 
+#ifdef STL_BOUNDS_SSE
+/* The last of the vertices to have coordinate axis at zero, which is where
+   STL_MIN or STL_MAX leaves a bound of zero, or seed if there is none */
+static float
+stl_last_zero(const stl_facet *facets, stl_index count, int axis,
+              float seed) {
+  const float *v;
+  stl_index   i;
+  int         j;
+
+  for(i = count - 1; i >= 0; i--) {
+    for(j = 2; j >= 0; j--) {
+      v = &facets[i].vertex[j].x;
+      if(v[axis] == 0) return v[axis];
+    }
+  }
+  return seed;
+}
+
+/* stl_facets_bounds with one minimum and maximum per vertex of the facet,
+   so that the comparisons do not wait on each other.  The order does not
+   change a bound unless a NaN comes up, the caller then has to take the
+   vertices in turn and 0 is returned, or the bound is zero, which the
+   serial loop would have given the sign of the last zero it met. */
+static int
+stl_facets_bounds_sse(const stl_facet *facets, stl_index count,
+                      stl_vertex *min, stl_vertex *max) {
+  /* x, y and z in the first three lanes, the fourth reads whatever
+     follows the vertex in the facet and is thrown away */
+  float  seed_lo[3] = {min->x, min->y, min->z};
+  float  seed_hi[3] = {max->x, max->y, max->z};
+  float  out_lo[4];
+  float  out_hi[4];
+  __m128 lo0, lo1, lo2;
+  __m128 hi0, hi1, hi2;
+  __m128 v0, v1, v2;
+  __m128 nan;
+  stl_index i;
+  int    k;
+
+  lo0 = _mm_setr_ps(min->x, min->y, min->z, 0);
+  hi0 = _mm_setr_ps(max->x, max->y, max->z, 0);
+  nan = _mm_cmpunord_ps(lo0, hi0);
+  lo1 = lo2 = lo0;
+  hi1 = hi2 = hi0;
+  for(i = 0; i < count; i++) {
+    v0 = _mm_loadu_ps(&facets[i].vertex[0].x);
+    v1 = _mm_loadu_ps(&facets[i].vertex[1].x);
+    v2 = _mm_loadu_ps(&facets[i].vertex[2].x);
+    lo0 = _mm_min_ps(lo0, v0);
+    hi0 = _mm_max_ps(hi0, v0);
+    lo1 = _mm_min_ps(lo1, v1);
+    hi1 = _mm_max_ps(hi1, v1);
+    lo2 = _mm_min_ps(lo2, v2);
+    hi2 = _mm_max_ps(hi2, v2);
+    nan = _mm_or_ps(nan, _mm_or_ps(_mm_cmpunord_ps(v0, v1),
+                                   _mm_cmpunord_ps(v2, v2)));
+  }
+  if(_mm_movemask_ps(nan) & 7) return 0;
+
+  _mm_storeu_ps(out_lo, _mm_min_ps(_mm_min_ps(lo0, lo1), lo2));
+  _mm_storeu_ps(out_hi, _mm_max_ps(_mm_max_ps(hi0, hi1), hi2));
+  for(k = 0; k < 3; k++) {
+    if(out_lo[k] == 0)
+      out_lo[k] = stl_last_zero(facets, count, k, seed_lo[k]);
+    if(out_hi[k] == 0)
+      out_hi[k] = stl_last_zero(facets, count, k, seed_hi[k]);
+  }
+  min->x = out_lo[0];
+  min->y = out_lo[1];
+  min->z = out_lo[2];
+  max->x = out_hi[0];
+  max->y = out_hi[1];
+  max->z = out_hi[2];
+  return 1;
+}
+#endif
+
+void
+stl_facets_bounds(const stl_facet *facets, stl_index count,
+                  stl_vertex *min, stl_vertex *max) {
+  stl_vertex lo;
+  stl_vertex hi;
+  stl_index  i;
+  int        j;
+
+#ifdef STL_BOUNDS_SSE
+  if(count > 1 && stl_facets_bounds_sse(facets, count, min, max)) return;
+#endif
+
+  lo = *min;
+  hi = *max;
+  for(i = 0; i < count; i++) {
+    for(j = 0; j < 3; j++) {
+      lo.x = STL_MIN(lo.x, facets[i].vertex[j].x);
+      lo.y = STL_MIN(lo.y, facets[i].vertex[j].y);
+      lo.z = STL_MIN(lo.z, facets[i].vertex[j].z);
+      hi.x = STL_MAX(hi.x, facets[i].vertex[j].x);
+      hi.y = STL_MAX(hi.y, facets[i].vertex[j].y);
+      hi.z = STL_MAX(hi.z, facets[i].vertex[j].z);
+    }
+  }
+  *min = lo;
+  *max = hi;
+}
+
+/* stl_facet_stats for the facets from start to end, which are already in
+   stl->facet_start */
+static void
+stl_block_stats(stl_file *stl, stl_index start, stl_index end, int *first) {
+  if (stl->error || start >= end) return;
+
+  if (*first) {
+    stl_facet_stats(stl, stl->facet_start[start], 1);
+    start++;
+    *first = 0;
+  }
+  stl_facets_bounds(stl->facet_start + start, end - start,
+                    &stl->stats.min, &stl->stats.max);
+}
+
 void
 stl_facet_stats(stl_file *stl, stl_facet facet, int first) {
   float diff_x;
@@ -349,44 +1321,21 @@ stl_facet_stats(stl_file *stl, stl_facet facet, int first) {
 
   /* Initialize the max and min values the first time through*/
   if (first) {
-    stl->stats.max.x = facet.vertex[0].x;
-    stl->stats.min.x = facet.vertex[0].x;
-    stl->stats.max.y = facet.vertex[0].y;
-    stl->stats.min.y = facet.vertex[0].y;
-    stl->stats.max.z = facet.vertex[0].z;
-    stl->stats.min.z = facet.vertex[0].z;
+    stl->stats.max = facet.vertex[0];
+    stl->stats.min = facet.vertex[0];
 
+    /* The shortest edge is only a first guess here, the exact check
+       brings it down */
     diff_x = ABS(facet.vertex[0].x - facet.vertex[1].x);
     diff_y = ABS(facet.vertex[0].y - facet.vertex[1].y);
     diff_z = ABS(facet.vertex[0].z - facet.vertex[1].z);
     max_diff = STL_MAX(diff_x, diff_y);
     max_diff = STL_MAX(diff_z, max_diff);
     stl->stats.shortest_edge = max_diff;
-
-    first = 0;
   }
 
   /* now find the max and min values */
-  stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[0].x);
-  stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[0].x);
-  stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[0].y);
-  stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[0].y);
-  stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[0].z);
-  stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[0].z);
-
-  stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[1].x);
-  stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[1].x);
-  stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[1].y);
-  stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[1].y);
-  stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[1].z);
-  stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[1].z);
-
-  stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[2].x);
-  stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[2].x);
-  stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[2].y);
-  stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[2].y);
-  stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[2].z);
-  stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[2].z);
+  stl_facets_bounds(&facet, 1, &stl->stats.min, &stl->stats.max);
 }
 
 void
@@ -401,5 +1350,7 @@ stl_close(stl_file *stl) {
     free(stl->v_indices);
   if(stl->v_shared != NULL)
     free(stl->v_shared);
+  free(stl->soa.block);
+  free(stl->check);
 }
 
@@ -0,0 +1,325 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/admesh/admesh/issues
+ */
+
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600   /* SRW locks and condition variables */
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#endif
+
+#include "stl.h"
+#include "threads.h"
+
+#if defined(_WIN32)
+typedef HANDLE             stl_thread;
+typedef SRWLOCK            stl_mutex;
+typedef CONDITION_VARIABLE stl_cond;
+#define STL_MUTEX_INIT     SRWLOCK_INIT
+#define STL_COND_INIT      CONDITION_VARIABLE_INIT
+#define stl_lock(m)        AcquireSRWLockExclusive(m)
+#define stl_unlock(m)      ReleaseSRWLockExclusive(m)
+#define stl_wait(c, m)     SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define stl_wake_all(c)    WakeAllConditionVariable(c)
+#else
+typedef pthread_t          stl_thread;
+typedef pthread_mutex_t    stl_mutex;
+typedef pthread_cond_t     stl_cond;
+#define STL_MUTEX_INIT     PTHREAD_MUTEX_INITIALIZER
+#define STL_COND_INIT      PTHREAD_COND_INITIALIZER
+#define stl_lock(m)        pthread_mutex_lock(m)
+#define stl_unlock(m)      pthread_mutex_unlock(m)
+#define stl_wait(c, m)     pthread_cond_wait(c, m)
+#define stl_wake_all(c)    pthread_cond_broadcast(c)
+#endif
+
+/* The worker threads and the call they are working on.  Worker i, the
+   calling thread being worker 0, takes every stride-th task starting at
+   task i; workers from stride on sit the call out.  Everything but the
+   tasks themselves is under lock, and so is the thread count. */
+typedef struct {
+  stl_mutex     lock;
+  stl_cond      start;        /* a new call is up, or quit is set */
+  stl_cond      done;         /* the last worker finished its share */
+  stl_thread    workers[STL_MAX_THREADS]; /* from 1 */
+  int           num_workers;  /* threads started, numbered from 1 */
+  int           busy;         /* a call is running */
+  int           quit;         /* the workers are stopping or gone */
+  int           threads;      /* stl_set_thread_count, 0 for the default */
+  unsigned      generation;   /* counts the calls */
+  stl_task_func func;
+  void          *arg;
+  int           tasks;
+  int           stride;
+  int           pending;      /* workers still on the call */
+} stl_pool;
+
+static stl_pool stl_the_pool = {
+  STL_MUTEX_INIT, STL_COND_INIT, STL_COND_INIT, {0}, 0, 0, 0, 0, 0, NULL, NULL,
+  0, 0, 0
+};
+
+/* ADMESH_THREADS, or one thread per online processor */
+static int stl_default_threads = 1;
+
+/* ADMESH_PARALLEL_MIN_FACETS, or STL_PARALLEL_MIN_FACETS */
+static int stl_min_facets = STL_PARALLEL_MIN_FACETS;
+
+/* Sets the two above from the environment, once */
+static void
+stl_read_environment(void) {
+  const char *env;
+  int        count = 0;
+
+  if((env = getenv("ADMESH_THREADS")) != NULL) count = atoi(env);
+  if(count <= 0) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    count = (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  stl_default_threads = count;
+
+  if((env = getenv("ADMESH_PARALLEL_MIN_FACETS")) != NULL && atoi(env) > 0) {
+    stl_min_facets = atoi(env);
+  }
+}
+
+#if defined(_WIN32)
+static INIT_ONCE stl_environment_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK
+stl_read_environment_win32(PINIT_ONCE once, PVOID param, PVOID *context) {
+  (void)once;
+  (void)param;
+  (void)context;
+  stl_read_environment();
+  return TRUE;
+}
+#else
+static pthread_once_t stl_environment_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void
+stl_read_environment_once(void) {
+#if defined(_WIN32)
+  InitOnceExecuteOnce(&stl_environment_once, stl_read_environment_win32,
+                      NULL, NULL);
+#else
+  pthread_once(&stl_environment_once, stl_read_environment);
+#endif
+}
+
+int
+stl_thread_count(void) {
+  stl_pool *pool = &stl_the_pool;
+  int      count;
+
+  stl_lock(&pool->lock);
+  count = pool->threads;
+  stl_unlock(&pool->lock);
+  if(count <= 0) {
+    stl_read_environment_once();
+    count = stl_default_threads;
+  }
+  if(count < 1) count = 1;
+  if(count > STL_MAX_THREADS) count = STL_MAX_THREADS;
+  return count;
+}
+
+int
+stl_parallel_min_facets(void) {
+  stl_read_environment_once();
+  return stl_min_facets;
+}
+
+void
+stl_set_thread_count(int threads) {
+  stl_pool *pool = &stl_the_pool;
+
+  stl_lock(&pool->lock);
+  pool->threads = threads > 0 ? threads : 0;
+  stl_unlock(&pool->lock);
+}
+
+static void
+stl_run_share(stl_task_func func, void *arg, int tasks, int stride,
+              int first) {
+  int task;
+
+  for(task = first; task < tasks; task += stride) {
+    func(arg, task);
+  }
+}
+
+/* Waits for calls and does its share of each, until quit is set */
+static void
+stl_worker_main(int index) {
+  stl_pool      *pool = &stl_the_pool;
+  unsigned      seen;
+  stl_task_func func;
+  void          *arg;
+  int           tasks;
+  int           stride;
+
+  /* Workers are only started by a call, which posts itself before this
+     thread can take the lock, so that call is the first one to work on */
+  stl_lock(&pool->lock);
+  seen = pool->generation - 1;
+  for(;;) {
+    /* A call that is up still gets done, its caller is waiting for it */
+    while(pool->generation == seen && !pool->quit) {
+      stl_wait(&pool->start, &pool->lock);
+    }
+    if(pool->generation == seen) break;
+    seen = pool->generation;
+    if(index >= pool->stride) continue;
+    func = pool->func;
+    arg = pool->arg;
+    tasks = pool->tasks;
+    stride = pool->stride;
+    stl_unlock(&pool->lock);
+
+    stl_run_share(func, arg, tasks, stride, index);
+
+    stl_lock(&pool->lock);
+    if(--pool->pending == 0) stl_wake_all(&pool->done);
+  }
+  stl_unlock(&pool->lock);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI
+stl_thread_main(LPVOID arg) {
+  stl_worker_main((int)(INT_PTR)arg);
+  return 0;
+}
+#else
+static void *
+stl_thread_main(void *arg) {
+  stl_worker_main((int)(intptr_t)arg);
+  return NULL;
+}
+#endif
+
+/* Starts worker number index, with the lock held */
+static int
+stl_start_worker(int index) {
+  stl_thread *handle = &stl_the_pool.workers[index];
+
+#if defined(_WIN32)
+  *handle = CreateThread(NULL, 0, stl_thread_main, (LPVOID)(INT_PTR)index, 0,
+                         NULL);
+  return *handle != NULL;
+#else
+  return pthread_create(handle, NULL, stl_thread_main,
+                        (void*)(intptr_t)index) == 0;
+#endif
+}
+
+#if defined(__GNUC__)
+/* Stops the workers and waits for them when the process exits or the
+   library is unloaded, so that none is left waiting in code that goes
+   away.  Calls made after this run on the calling thread.  Other
+   compilers leave the workers to the end of the process. */
+__attribute__((destructor)) static void
+stl_stop_workers(void) {
+  stl_pool *pool = &stl_the_pool;
+  int      num_workers;
+  int      i;
+
+  stl_lock(&pool->lock);
+  pool->quit = 1;
+  num_workers = pool->num_workers;
+  pool->num_workers = 0;
+  stl_wake_all(&pool->start);
+  stl_unlock(&pool->lock);
+
+  for(i = 1; i <= num_workers; i++) {
+#if defined(_WIN32)
+    if(GetThreadId(pool->workers[i]) != GetCurrentThreadId()) {
+      WaitForSingleObject(pool->workers[i], INFINITE);
+    }
+    CloseHandle(pool->workers[i]);
+#else
+    /* exit() called from a task runs this on a worker */
+    if(!pthread_equal(pool->workers[i], pthread_self())) {
+      pthread_join(pool->workers[i], NULL);
+    }
+#endif
+  }
+}
+#endif
+
+void
+stl_parallel_for(int tasks, stl_task_func func, void *arg) {
+  stl_pool *pool = &stl_the_pool;
+  int      count;
+
+  if(tasks <= 0) return;
+  count = stl_thread_count();
+  if(count > tasks) count = tasks;
+  if(count <= 1) {
+    stl_run_share(func, arg, tasks, 1, 0);
+    return;
+  }
+
+  stl_lock(&pool->lock);
+  if(pool->busy || pool->quit) {
+    /* Called from a task, from another thread while a call runs, or after
+       the workers have been stopped */
+    stl_unlock(&pool->lock);
+    stl_run_share(func, arg, tasks, 1, 0);
+    return;
+  }
+  pool->busy = 1;
+  while(pool->num_workers < count - 1
+        && stl_start_worker(pool->num_workers + 1)) {
+    pool->num_workers++;
+  }
+  if(count > pool->num_workers + 1) count = pool->num_workers + 1;
+  pool->func = func;
+  pool->arg = arg;
+  pool->tasks = tasks;
+  pool->stride = count;
+  pool->pending = count - 1;
+  pool->generation++;
+  stl_wake_all(&pool->start);
+  stl_unlock(&pool->lock);
+
+  stl_run_share(func, arg, tasks, count, 0);
+
+  stl_lock(&pool->lock);
+  while(pool->pending > 0) stl_wait(&pool->done, &pool->lock);
+  pool->busy = 0;
+  stl_unlock(&pool->lock);
+}
@@ -0,0 +1,51 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/admesh/admesh/issues
+ */
+
+#ifndef __admesh_threads__
+#define __admesh_threads__
+
+/* Internal fork-join helpers, not part of the installed API.  The number
+   of threads is set through stl_set_thread_count in stl.h. */
+
+/* Hard limit on the number of threads a single call uses */
+#define STL_MAX_THREADS 256
+
+/* Whole-mesh passes over fewer facets than this stay on the calling
+   thread, handing them out would cost more than it saves */
+#define STL_PARALLEL_MIN_FACETS 65536
+
+/* STL_PARALLEL_MIN_FACETS, unless the ADMESH_PARALLEL_MIN_FACETS
+   environment variable sets another cut-off.  The tests lower it to run
+   the threaded passes on the small example meshes. */
+extern int stl_parallel_min_facets(void);
+
+typedef void (*stl_task_func)(void *arg, int task);
+
+/* Runs func(arg, task) for every task in [0, tasks) and returns when all of
+   them are done.  The calling thread takes part, the others come from a
+   pool that is started on first use and stopped when the process exits or
+   the library is unloaded.  If threads cannot be started, or the pool is
+   busy with another call, the remaining tasks run on the calling thread
+   instead. */
+extern void stl_parallel_for(int tasks, stl_task_func func, void *arg);
+
+#endif
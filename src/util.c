@@ -20,25 +20,109 @@
  *           https://github.com/admesh/admesh/issues
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
+#include "bounds.h"
 #include "stl.h"
+#include "threads.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STL_UTIL_AVX2
+#include <immintrin.h>
+#endif
+
+/* Mass properties are summed over blocks of this many facets.  The blocks
+   do not depend on the number of threads and their sums are added up in
+   order, so neither do the results. */
+#define STL_MASS_BLOCK_FACETS 4096
+
+/* The sums over a block, relative to a reference point: six times the
+   volume, twice the area, 24 times the first moments of volume and 120
+   times the second ones, xx, yy, zz, xy, yz and zx, and six times the
+   volume with every tetrahedron counted as positive */
+#define STL_MASS_SUMS 12
+
+/* fixall only turns a mesh inside out when its volume is negative by more
+   than this fraction of the unsigned one.  Below that the sign is down to
+   rounding, as it is for the nearly flat solids that merging two copies of
+   a mesh leaves. */
+#define STL_VOLUME_SIGN_RATIO 1e-6
+
+/* Within a block facet i goes to sum number i % STL_MASS_LANES, so that
+   the sums come out the same four facets to a vector as one at a time,
+   bar the sign of NaNs */
+#define STL_MASS_LANES 4
+
+/* Coordinate k of vertex j of facet i is at coord[k][j][i * stride], which
+   fits both facet_start and its copy in stl->soa */
+typedef struct {
+  stl_file    *stl;
+  const float *coord[3][3];
+  int         stride;
+  double      origin[3];
+  double      *sums;          /* [block][STL_MASS_SUMS] */
+} stl_mass_job;
+
+/* A whole-mesh loop split into ranges of facets.  Ranges that work out
+   bounds leave them in min[range] and max[range]; they are put together
+   in the order of the ranges, so that the result does not depend on the
+   split.  Only the bounds of meshes with NaN coordinates can, since a NaN
+   resets STL_MIN and STL_MAX. */
+typedef struct {
+  stl_file     *stl;
+  int          num_ranges;
+  float        offset[3];     /* stl_translate, stl_translate_relative,
+                                 stl_stretch */
+  float        factor[3];     /* stl_scale_versor */
+  float        box_min[3];    /* stl_stretch */
+  float        box_max[3];
+  const double *m;            /* stl_transform */
+  int          reverse;
+  int          axis[2];       /* stl_rotate */
+  double       radian_angle;
+  stl_vertex   min[STL_MAX_THREADS];
+  stl_vertex   max[STL_MAX_THREADS];
+} stl_range_job;
+
+static void stl_rotate(stl_file *stl, int a, int b, float angle);
+
+/* Whether stl->soa is there and still matches the facet count.  Otherwise
+   the bounds and mass properties read facet_start. */
+static int
+stl_soa_current(const stl_file *stl) {
+  return stl->soa.block != NULL
+         && stl->soa.number_of_facets == stl->stats.number_of_facets;
+}
 
-static void stl_rotate(float *x, float *y, float angle);
-static float get_area(stl_facet *facet);
-static float get_volume(stl_file *stl);
+static void
+stl_init_range_job(stl_range_job *job, stl_file *stl) {
+  job->stl = stl;
+  job->num_ranges = 1;
+  if(stl_thread_count() > 1 &&
+      stl->stats.number_of_facets >= stl_parallel_min_facets()) {
+    /* No empty ranges, their bounds would come from a facet of the next */
+    job->num_ranges = (int)STL_MIN(stl_thread_count(),
+                                   stl->stats.number_of_facets);
+  }
+}
 
+static stl_index
+stl_range_start(const stl_range_job *job, int range) {
+  return (stl_index)((long long)job->stl->stats.number_of_facets * range
+               / job->num_ranges);
+}
 
 void
 stl_verify_neighbors(stl_file *stl) {
-  int i;
+  stl_index i;
   int j;
   stl_edge edge_a;
   stl_edge edge_b;
-  int neighbor;
+  stl_index neighbor;
   int vnot;
 
   if (stl->error) return;
@@ -64,7 +148,8 @@ stl_verify_neighbors(stl_file *stl) {
       }
       if(memcmp(&edge_a, &edge_b, SIZEOF_EDGE_SORT) != 0) {
         /* These edges should match but they don't.  Print results. */
-        printf("edge %d of facet %d doesn't match edge %d of facet %d\n",
+        printf("edge %d of facet %" STL_INDEX_FORMAT " doesn't match edge %d"
+               " of facet %" STL_INDEX_FORMAT "\n",
                j, i, vnot + 1, neighbor);
         stl_write_facet(stl, (char*)"first facet", i);
         stl_write_facet(stl, (char*)"second facet", neighbor);
@@ -73,20 +158,35 @@ stl_verify_neighbors(stl_file *stl) {
   }
 }
 
+static void
+stl_translate_range(void *arg, int range) {
+  stl_range_job *job = (stl_range_job*)arg;
+  stl_facet     *facet = job->stl->facet_start;
+  stl_index     end = stl_range_start(job, range + 1);
+  stl_index     i;
+  int           j;
+
+  for(i = stl_range_start(job, range); i < end; i++) {
+    for(j = 0; j < 3; j++) {
+      facet[i].vertex[j].x -= job->offset[0];
+      facet[i].vertex[j].y -= job->offset[1];
+      facet[i].vertex[j].z -= job->offset[2];
+    }
+  }
+}
+
 void
 stl_translate(stl_file *stl, float x, float y, float z) {
-  int i;
-  int j;
+  stl_range_job job;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    for(j = 0; j < 3; j++) {
-      stl->facet_start[i].vertex[j].x -= (stl->stats.min.x - x);
-      stl->facet_start[i].vertex[j].y -= (stl->stats.min.y - y);
-      stl->facet_start[i].vertex[j].z -= (stl->stats.min.z - z);
-    }
-  }
+  stl_init_range_job(&job, stl);
+  job.offset[0] = stl->stats.min.x - x;
+  job.offset[1] = stl->stats.min.y - y;
+  job.offset[2] = stl->stats.min.z - z;
+  stl_parallel_for(job.num_ranges, stl_translate_range, &job);
   stl->stats.max.x -= (stl->stats.min.x - x);
   stl->stats.max.y -= (stl->stats.min.y - y);
   stl->stats.max.z -= (stl->stats.min.z - z);
@@ -98,20 +198,35 @@ stl_translate(stl_file *stl, float x, float y, float z) {
 }
 
 /* Translates the stl by x,y,z, relatively from wherever it is currently */
+static void
+stl_translate_relative_range(void *arg, int range) {
+  stl_range_job *job = (stl_range_job*)arg;
+  stl_facet     *facet = job->stl->facet_start;
+  stl_index     end = stl_range_start(job, range + 1);
+  stl_index     i;
+  int           j;
+
+  for(i = stl_range_start(job, range); i < end; i++) {
+    for(j = 0; j < 3; j++) {
+      facet[i].vertex[j].x += job->offset[0];
+      facet[i].vertex[j].y += job->offset[1];
+      facet[i].vertex[j].z += job->offset[2];
+    }
+  }
+}
+
 void
 stl_translate_relative(stl_file *stl, float x, float y, float z) {
-  int i;
-  int j;
+  stl_range_job job;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    for(j = 0; j < 3; j++) {
-      stl->facet_start[i].vertex[j].x += x;
-      stl->facet_start[i].vertex[j].y += y;
-      stl->facet_start[i].vertex[j].z += z;
-    }
-  }
+  stl_init_range_job(&job, stl);
+  job.offset[0] = x;
+  job.offset[1] = y;
+  job.offset[2] = z;
+  stl_parallel_for(job.num_ranges, stl_translate_relative_range, &job);
   stl->stats.min.x += x;
   stl->stats.min.y += y;
   stl->stats.min.z += z;
@@ -122,63 +237,102 @@ stl_translate_relative(stl_file *stl, float x, float y, float z) {
   stl_invalidate_shared_vertices(stl);
 }
 
+/* Every range starts from the bounds of the whole mesh and, as the
+   single loop did, only moves them for a vertex strictly beyond */
+static void
+stl_stretch_range(void *arg, int range) {
+  stl_range_job *job = (stl_range_job*)arg;
+  stl_vertex    *vertex;
+  stl_vertex    min = job->stl->stats.min;
+  stl_vertex    max = job->stl->stats.max;
+  stl_index     end = stl_range_start(job, range + 1);
+  stl_index     i;
+  int           j;
+
+  for(i = stl_range_start(job, range); i < end; i++) {
+    for(j = 0; j < 3; j++) {
+      vertex = &job->stl->facet_start[i].vertex[j];
+      if (job->box_min[0] < vertex->x && job->box_max[0] > vertex->x &&
+          job->box_min[1] < vertex->y && job->box_max[1] > vertex->y &&
+          job->box_min[2] < vertex->z && job->box_max[2] > vertex->z) {
+        vertex->x += job->offset[0];
+        vertex->y += job->offset[1];
+        vertex->z += job->offset[2];
+        if (vertex->x < min.x) min.x = vertex->x;
+        if (vertex->x > max.x) max.x = vertex->x;
+        if (vertex->y < min.y) min.y = vertex->y;
+        if (vertex->y > max.y) max.y = vertex->y;
+        if (vertex->z < min.z) min.z = vertex->z;
+        if (vertex->z > max.z) max.z = vertex->z;
+      }
+    }
+  }
+  job->min[range] = min;
+  job->max[range] = max;
+}
+
 /* stretch the STL, i.e. move a point by a relative XYZ offset if it fits within a given bounding box */
 void
 stl_stretch(stl_file *stl, float x_min, float x_max, float x_off, float y_min, float y_max, float y_off, float z_min, float z_max, float z_off) {
-  int i;
-  int j;
+  stl_range_job job;
+  stl_vertex    min;
+  stl_vertex    max;
+  int           range;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
+
+  stl_init_range_job(&job, stl);
+  job.box_min[0] = x_min;
+  job.box_max[0] = x_max;
+  job.offset[0] = x_off;
+  job.box_min[1] = y_min;
+  job.box_max[1] = y_max;
+  job.offset[1] = y_off;
+  job.box_min[2] = z_min;
+  job.box_max[2] = z_max;
+  job.offset[2] = z_off;
+  stl_parallel_for(job.num_ranges, stl_stretch_range, &job);
+
+  min = stl->stats.min;
+  max = stl->stats.max;
+  for(range = 0; range < job.num_ranges; range++) {
+    if (job.min[range].x < min.x) min.x = job.min[range].x;
+    if (job.max[range].x > max.x) max.x = job.max[range].x;
+    if (job.min[range].y < min.y) min.y = job.min[range].y;
+    if (job.max[range].y > max.y) max.y = job.max[range].y;
+    if (job.min[range].z < min.z) min.z = job.min[range].z;
+    if (job.max[range].z > max.z) max.z = job.max[range].z;
+  }
+  stl->stats.min = min;
+  stl->stats.max = max;
 
-  float min_x = stl->stats.min.x;
-  float min_y = stl->stats.min.y;
-  float min_z = stl->stats.min.z;
-  float max_x = stl->stats.max.x;
-  float max_y = stl->stats.max.y;
-  float max_z = stl->stats.max.z;
+  stl_invalidate_shared_vertices(stl);
+}
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
+static void
+stl_scale_range(void *arg, int range) {
+  stl_range_job *job = (stl_range_job*)arg;
+  stl_facet     *facet = job->stl->facet_start;
+  stl_index     end = stl_range_start(job, range + 1);
+  stl_index     i;
+  int           j;
+
+  for(i = stl_range_start(job, range); i < end; i++) {
     for(j = 0; j < 3; j++) {
-      if (x_min < stl->facet_start[i].vertex[j].x &&
-          x_max > stl->facet_start[i].vertex[j].x &&
-          y_min < stl->facet_start[i].vertex[j].y &&
-          y_max > stl->facet_start[i].vertex[j].y &&
-          z_min < stl->facet_start[i].vertex[j].z &&
-          z_max > stl->facet_start[i].vertex[j].z) {
-        stl->facet_start[i].vertex[j].x += x_off;
-        stl->facet_start[i].vertex[j].y += y_off;
-        stl->facet_start[i].vertex[j].z += z_off;
-        if (stl->facet_start[i].vertex[j].x < min_x)
-          min_x = stl->facet_start[i].vertex[j].x;
-        if (stl->facet_start[i].vertex[j].x > max_x)
-          max_x = stl->facet_start[i].vertex[j].x;
-        if (stl->facet_start[i].vertex[j].y < min_y)
-          min_y = stl->facet_start[i].vertex[j].y;
-        if (stl->facet_start[i].vertex[j].y > max_y)
-          max_y = stl->facet_start[i].vertex[j].y;
-        if (stl->facet_start[i].vertex[j].z < min_z)
-          min_z = stl->facet_start[i].vertex[j].z;
-        if (stl->facet_start[i].vertex[j].z > max_z)
-          max_z = stl->facet_start[i].vertex[j].z;
-      }
+      facet[i].vertex[j].x *= job->factor[0];
+      facet[i].vertex[j].y *= job->factor[1];
+      facet[i].vertex[j].z *= job->factor[2];
     }
   }
-  stl->stats.min.x = min_x;
-  stl->stats.min.y = min_y;
-  stl->stats.min.z = min_z;
-  stl->stats.max.x = max_x;
-  stl->stats.max.y = max_y;
-  stl->stats.max.z = max_z;
-
-  stl_invalidate_shared_vertices(stl);
 }
 
 void
 stl_scale_versor(stl_file *stl, float versor[3]) {
-  int i;
-  int j;
+  stl_range_job job;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   /* scale extents */
   stl->stats.min.x *= versor[0];
@@ -198,13 +352,11 @@ stl_scale_versor(stl_file *stl, float versor[3]) {
     stl->stats.volume *= (versor[0] * versor[1] * versor[2]);
   }
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    for(j = 0; j < 3; j++) {
-      stl->facet_start[i].vertex[j].x *= versor[0];
-      stl->facet_start[i].vertex[j].y *= versor[1];
-      stl->facet_start[i].vertex[j].z *= versor[2];
-    }
-  }
+  stl_init_range_job(&job, stl);
+  job.factor[0] = versor[0];
+  job.factor[1] = versor[1];
+  job.factor[2] = versor[2];
+  stl_parallel_for(job.num_ranges, stl_scale_range, &job);
 
   stl_invalidate_shared_vertices(stl);
 
@@ -227,136 +379,515 @@ stl_scale(stl_file *stl, float factor) {
   stl_scale_versor(stl, versor);
 }
 
-static void calculate_normals(stl_file *stl) {
-  long i;
-  float normal[3];
+/* Turns the point (x, y) about the origin through polar coordinates, as
+   admesh always has, so that stl_rotate_x, stl_rotate_y and stl_rotate_z
+   give the same vertices they used to.  This is on purpose the slow way:
+   stl_transform, with its AVX2 kernel, is what rotations composed with
+   other transformations and stl_rotate_axis go through, and it does not
+   round to the same floats. */
+static void
+stl_rotate_point(float *x, float *y, double radian_angle) {
+  double r;
+  double theta;
 
-  if (stl->error) return;
+  r = sqrt((*x **x) + (*y **y));
+  theta = atan2(*y, *x);
+  *x = r * cos(theta + radian_angle);
+  *y = r * sin(theta + radian_angle);
+}
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    stl_calculate_normal(normal, &stl->facet_start[i]);
+static float *
+stl_vertex_axis(stl_vertex *vertex, int axis) {
+  return axis == 0 ? &vertex->x : axis == 1 ? &vertex->y : &vertex->z;
+}
+
+static void
+stl_rotate_range(void *arg, int range) {
+  stl_range_job *job = (stl_range_job*)arg;
+  stl_facet     *facet = job->stl->facet_start;
+  stl_vertex    *vertex;
+  float         normal[3];
+  stl_index     end = stl_range_start(job, range + 1);
+  stl_index     i;
+  int           j;
+
+  for(i = stl_range_start(job, range); i < end; i++) {
+    for(j = 0; j < 3; j++) {
+      vertex = &facet[i].vertex[j];
+      stl_rotate_point(stl_vertex_axis(vertex, job->axis[0]),
+                       stl_vertex_axis(vertex, job->axis[1]),
+                       job->radian_angle);
+    }
+    stl_calculate_normal(normal, &facet[i]);
     stl_normalize_vector(normal);
-    stl->facet_start[i].normal.x = normal[0];
-    stl->facet_start[i].normal.y = normal[1];
-    stl->facet_start[i].normal.z = normal[2];
+    facet[i].normal.x = normal[0];
+    facet[i].normal.y = normal[1];
+    facet[i].normal.z = normal[2];
   }
 }
 
-void
-stl_rotate_x(stl_file *stl, float angle) {
-  int i;
-  int j;
+/* Rotates by angle degrees in the plane of axes a and b, turning a
+   towards b */
+static void
+stl_rotate(stl_file *stl, int a, int b, float angle) {
+  stl_range_job job;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    for(j = 0; j < 3; j++) {
-      stl_rotate(&stl->facet_start[i].vertex[j].y,
-                 &stl->facet_start[i].vertex[j].z, angle);
-    }
-  }
+  stl_init_range_job(&job, stl);
+  job.axis[0] = a;
+  job.axis[1] = b;
+  job.radian_angle = (angle / 180.0) * M_PI;
+  stl_parallel_for(job.num_ranges, stl_rotate_range, &job);
   stl_get_size(stl);
-  calculate_normals(stl);
+  stl_invalidate_shared_vertices(stl);
+}
+
+void
+stl_rotate_x(stl_file *stl, float angle) {
+  stl_rotate(stl, 1, 2, angle);
 }
 
 void
 stl_rotate_y(stl_file *stl, float angle) {
-  int i;
-  int j;
+  stl_rotate(stl, 2, 0, angle);
+}
+
+void
+stl_rotate_z(stl_file *stl, float angle) {
+  stl_rotate(stl, 0, 1, angle);
+}
+
+/* Rotates by angle degrees about the axis through the origin in the
+   direction of axis, counterclockwise looking against it.  An axis of no
+   length leaves the mesh alone. */
+void
+stl_rotate_axis(stl_file *stl, float axis[3], float angle) {
+  double m[12];
+  double u[3];
+  double length;
+  double radian_angle;
+  double c;
+  double s;
+  int    i;
+  int    j;
 
   if (stl->error) return;
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
+  length = sqrt((double)axis[0] * axis[0] + (double)axis[1] * axis[1] +
+                (double)axis[2] * axis[2]);
+  if(length == 0) return;
+  for(i = 0; i < 3; i++) {
+    u[i] = axis[i] / length;
+  }
+
+  radian_angle = (angle / 180.0) * M_PI;
+  c = cos(radian_angle);
+  s = sin(radian_angle);
+  for(i = 0; i < 3; i++) {
     for(j = 0; j < 3; j++) {
-      stl_rotate(&stl->facet_start[i].vertex[j].z,
-                 &stl->facet_start[i].vertex[j].x, angle);
+      m[4 * i + j] = (1 - c) * u[i] * u[j];
     }
+    m[5 * i] += c;
+    m[4 * i + 3] = 0;
   }
-  stl_get_size(stl);
-  calculate_normals(stl);
+  m[1] -= s * u[2];
+  m[2] += s * u[1];
+  m[4] += s * u[2];
+  m[6] -= s * u[0];
+  m[8] -= s * u[1];
+  m[9] += s * u[0];
+  stl_transform(stl, m);
 }
 
-void
-stl_rotate_z(stl_file *stl, float angle) {
-  int i;
-  int j;
+/* One row of an affine transformation.  Terms with a zero factor are left
+   out and the sum starts from -0, which adding leaves alone, so that
+   mirroring a 0 gives -0 as multiplying it by -1 does. */
+static float
+stl_transform_row(const double row[4], const stl_vertex *vertex) {
+  double sum = -0.0;
+
+  if(row[0] != 0) sum += row[0] * vertex->x;
+  if(row[1] != 0) sum += row[1] * vertex->y;
+  if(row[2] != 0) sum += row[2] * vertex->z;
+  if(row[3] != 0) sum += row[3];
+  return (float)sum;
+}
 
-  if (stl->error) return;
+/* Transforms count facets by m, swapping vertices 0 and 1 if reverse is
+   set, recalculates their normals and widens min and max to take in their
+   vertices */
+static void
+stl_transform_facets(const double m[12], int reverse, stl_facet *facet,
+                     stl_index count, stl_vertex *min, stl_vertex *max) {
+  stl_vertex vertex;
+  float      normal[3];
+  stl_index  i;
+  int        j;
+
+  for(i = 0; i < count; i++, facet++) {
+    for(j = 0; j < 3; j++) {
+      vertex = facet->vertex[j];
+      facet->vertex[j].x = stl_transform_row(m, &vertex);
+      facet->vertex[j].y = stl_transform_row(m + 4, &vertex);
+      facet->vertex[j].z = stl_transform_row(m + 8, &vertex);
+    }
+    if(reverse) {
+      vertex = facet->vertex[0];
+      facet->vertex[0] = facet->vertex[1];
+      facet->vertex[1] = vertex;
+    }
+
+    stl_calculate_normal(normal, facet);
+    stl_normalize_vector(normal);
+    facet->normal.x = normal[0];
+    facet->normal.y = normal[1];
+    facet->normal.z = normal[2];
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
     for(j = 0; j < 3; j++) {
-      stl_rotate(&stl->facet_start[i].vertex[j].x,
-                 &stl->facet_start[i].vertex[j].y, angle);
+      min->x = STL_MIN(min->x, facet->vertex[j].x);
+      min->y = STL_MIN(min->y, facet->vertex[j].y);
+      min->z = STL_MIN(min->z, facet->vertex[j].z);
+      max->x = STL_MAX(max->x, facet->vertex[j].x);
+      max->y = STL_MAX(max->y, facet->vertex[j].y);
+      max->z = STL_MAX(max->z, facet->vertex[j].z);
     }
   }
-  stl_get_size(stl);
-  calculate_normals(stl);
 }
 
+#ifdef STL_UTIL_AVX2
+/* The columns of a transformation, x, y and z to a lane, whether their
+   factors are other than zero and the translation, with -0 for zero */
+typedef struct {
+  __m256d column[3];
+  __m256d nonzero[3];
+  __m256d translation;
+} stl_avx2_transform;
+
+/* The vertex x, y, z in the low three lanes */
+__attribute__((target("avx2"))) static __m128
+stl_load_vertex(const stl_vertex *vertex) {
+  return _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)vertex),
+                       _mm_load_ss(&vertex->z));
+}
+
+__attribute__((target("avx2"))) static void
+stl_store_vertex(float *vertex, __m128 v) {
+  _mm_storel_pi((__m64 *)vertex, v);
+  _mm_store_ss(vertex + 2, _mm_movehl_ps(v, v));
+}
+
+/* stl_transform_row for all three rows at once: the columns are multiplied
+   by x, y and z and added in the same order, terms with a zero factor
+   being replaced by -0 */
+__attribute__((target("avx2"))) static __m128
+stl_transform_vertex_avx2(const stl_avx2_transform *m,
+                          const stl_vertex *vertex) {
+  __m256d negative_zero;
+  __m256d v;
+  __m256d sum;
+  __m256d product;
+
+  negative_zero = _mm256_set1_pd(-0.0);
+  v = _mm256_cvtps_pd(stl_load_vertex(vertex));
+  product = _mm256_mul_pd(m->column[0], _mm256_permute4x64_pd(v, 0x00));
+  sum = _mm256_blendv_pd(negative_zero, product, m->nonzero[0]);
+  product = _mm256_mul_pd(m->column[1], _mm256_permute4x64_pd(v, 0x55));
+  sum = _mm256_add_pd(sum, _mm256_blendv_pd(negative_zero, product,
+                                            m->nonzero[1]));
+  product = _mm256_mul_pd(m->column[2], _mm256_permute4x64_pd(v, 0xaa));
+  sum = _mm256_add_pd(sum, _mm256_blendv_pd(negative_zero, product,
+                                            m->nonzero[2]));
+  return _mm256_cvtpd_ps(_mm256_add_pd(sum, m->translation));
+}
+
+/* Transforms the vertices of a facet, widens low and high to take them in
+   and hands back the edges from vertex 0 to vertices 1 and 2 */
+__attribute__((target("avx2"))) static void
+stl_transform_facet_avx2(const stl_avx2_transform *m, int reverse,
+                         stl_facet *facet, __m128 *low, __m128 *high,
+                         __m128 *edge1, __m128 *edge2) {
+  __m128 p0;
+  __m128 p1;
+  __m128 p2;
+
+  if(reverse) {
+    p1 = stl_transform_vertex_avx2(m, &facet->vertex[0]);
+    p0 = stl_transform_vertex_avx2(m, &facet->vertex[1]);
+  } else {
+    p0 = stl_transform_vertex_avx2(m, &facet->vertex[0]);
+    p1 = stl_transform_vertex_avx2(m, &facet->vertex[1]);
+  }
+  p2 = stl_transform_vertex_avx2(m, &facet->vertex[2]);
+
+  stl_store_vertex(&facet->vertex[0].x, p0);
+  stl_store_vertex(&facet->vertex[1].x, p1);
+  stl_store_vertex(&facet->vertex[2].x, p2);
+  *low = _mm_min_ps(_mm_min_ps(_mm_min_ps(*low, p0), p1), p2);
+  *high = _mm_max_ps(_mm_max_ps(_mm_max_ps(*high, p0), p1), p2);
+  *edge1 = _mm_sub_ps(p1, p0);
+  *edge2 = _mm_sub_ps(p2, p0);
+}
 
+/* A component of the cross product as stl_calculate_normal works it out,
+   (float)(a b) - c d, rounded to float */
+__attribute__((target("avx2"))) static __m256d
+stl_cross_avx2(__m256d a, __m256d b, __m256d c, __m256d d) {
+  __m256d ab;
 
+  ab = _mm256_cvtps_pd(_mm256_cvtpd_ps(_mm256_mul_pd(a, b)));
+  return _mm256_cvtps_pd(_mm256_cvtpd_ps(_mm256_sub_pd(ab,
+                                                       _mm256_mul_pd(c, d))));
+}
+
+/* stl_transform_facets four facets at a time.  The vertices are
+   transformed one to a vector, then the edges of the four facets are
+   transposed so that their normals are worked out side by side, a facet to
+   a lane.  Nothing is fused and min, max, sqrt and the divide are exact,
+   so the results are the same to the bit as the scalar ones, bar the sign
+   of NaNs, which C leaves open. */
+__attribute__((target("avx2"))) static void
+stl_transform_facets_avx2(const double m[12], int reverse, stl_facet *facet,
+                          stl_index count, stl_vertex *min, stl_vertex *max) {
+  stl_avx2_transform transform;
+  __m256d   x1;
+  __m256d   y1;
+  __m256d   z1;
+  __m256d   x2;
+  __m256d   y2;
+  __m256d   z2;
+  __m256d   nx;
+  __m256d   ny;
+  __m256d   nz;
+  __m256d   length;
+  __m256d   factor;
+  __m256d   short_normal;
+  __m128    a[4];
+  __m128    b[4];
+  __m128    low;
+  __m128    high;
+  stl_index i;
+  int       j;
+
+  for(j = 0; j < 3; j++) {
+    transform.column[j] = _mm256_set_pd(0, m[8 + j], m[4 + j], m[j]);
+    transform.nonzero[j] = _mm256_cmp_pd(transform.column[j],
+                                         _mm256_setzero_pd(), _CMP_NEQ_UQ);
+  }
+  transform.translation = _mm256_set_pd(0, m[11], m[7], m[3]);
+  transform.translation = _mm256_blendv_pd(_mm256_set1_pd(-0.0),
+                                           transform.translation,
+                                           _mm256_cmp_pd(transform.translation,
+                                                         _mm256_setzero_pd(),
+                                                         _CMP_NEQ_UQ));
+  low = stl_load_vertex(min);
+  high = stl_load_vertex(max);
+
+  for(i = 0; i + 4 <= count; i += 4, facet += 4) {
+    stl_transform_facet_avx2(&transform, reverse, &facet[0], &low, &high,
+                             &a[0], &b[0]);
+    stl_transform_facet_avx2(&transform, reverse, &facet[1], &low, &high,
+                             &a[1], &b[1]);
+    stl_transform_facet_avx2(&transform, reverse, &facet[2], &low, &high,
+                             &a[2], &b[2]);
+    stl_transform_facet_avx2(&transform, reverse, &facet[3], &low, &high,
+                             &a[3], &b[3]);
+
+    /* stl_calculate_normal and stl_normalize_vector, a facet to a lane */
+    _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);
+    _MM_TRANSPOSE4_PS(b[0], b[1], b[2], b[3]);
+    x1 = _mm256_cvtps_pd(a[0]);
+    y1 = _mm256_cvtps_pd(a[1]);
+    z1 = _mm256_cvtps_pd(a[2]);
+    x2 = _mm256_cvtps_pd(b[0]);
+    y2 = _mm256_cvtps_pd(b[1]);
+    z2 = _mm256_cvtps_pd(b[2]);
+    nx = stl_cross_avx2(y1, z2, z1, y2);
+    ny = stl_cross_avx2(z1, x2, x1, z2);
+    nz = stl_cross_avx2(x1, y2, y1, x2);
+
+    length = _mm256_add_pd(_mm256_mul_pd(nx, nx), _mm256_mul_pd(ny, ny));
+    length = _mm256_sqrt_pd(_mm256_add_pd(length, _mm256_mul_pd(nz, nz)));
+    factor = _mm256_div_pd(_mm256_set1_pd(1.0), length);
+    short_normal = _mm256_cmp_pd(length,
+                                 _mm256_set1_pd((float)0.000000000001),
+                                 _CMP_LT_OQ);
+    a[0] = _mm256_cvtpd_ps(_mm256_blendv_pd(_mm256_mul_pd(nx, factor),
+                                            _mm256_setzero_pd(), short_normal));
+    a[1] = _mm256_cvtpd_ps(_mm256_blendv_pd(_mm256_mul_pd(ny, factor),
+                                            _mm256_setzero_pd(), short_normal));
+    a[2] = _mm256_cvtpd_ps(_mm256_blendv_pd(_mm256_mul_pd(nz, factor),
+                                            _mm256_setzero_pd(), short_normal));
+    a[3] = _mm_setzero_ps();
+    _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);
+    stl_store_vertex(&facet[0].normal.x, a[0]);
+    stl_store_vertex(&facet[1].normal.x, a[1]);
+    stl_store_vertex(&facet[2].normal.x, a[2]);
+    stl_store_vertex(&facet[3].normal.x, a[3]);
+  }
+
+  stl_store_vertex(&min->x, low);
+  stl_store_vertex(&max->x, high);
+  stl_transform_facets(m, reverse, facet, count - i, min, max);
+}
+#endif
+
+/* Puts the bounds of the ranges together, in order, and works out the
+   size of the mesh from them */
 static void
-stl_rotate(float *x, float *y, float angle) {
-  double r;
-  double theta;
-  double radian_angle;
+stl_range_bounds(stl_range_job *job) {
+  stl_stats *stats = &job->stl->stats;
+  int       range;
+
+  stats->min = job->min[0];
+  stats->max = job->max[0];
+  for(range = 1; range < job->num_ranges; range++) {
+    stats->min.x = STL_MIN(stats->min.x, job->min[range].x);
+    stats->min.y = STL_MIN(stats->min.y, job->min[range].y);
+    stats->min.z = STL_MIN(stats->min.z, job->min[range].z);
+    stats->max.x = STL_MAX(stats->max.x, job->max[range].x);
+    stats->max.y = STL_MAX(stats->max.y, job->max[range].y);
+    stats->max.z = STL_MAX(stats->max.z, job->max[range].z);
+  }
+  stats->size.x = stats->max.x - stats->min.x;
+  stats->size.y = stats->max.y - stats->min.y;
+  stats->size.z = stats->max.z - stats->min.z;
+  stats->bounding_diameter = sqrt(
+                               stats->size.x * stats->size.x +
+                               stats->size.y * stats->size.y +
+                               stats->size.z * stats->size.z
+                             );
+}
 
-  radian_angle = (angle / 180.0) * M_PI;
+static void
+stl_transform_range(void *arg, int range) {
+  stl_range_job *job = (stl_range_job*)arg;
+  stl_neighbors *neighbors;
+  stl_vertex    vertex;
+  stl_vertex    *min = &job->min[range];
+  stl_vertex    *max = &job->max[range];
+  stl_index     start = stl_range_start(job, range);
+  stl_index     end = stl_range_start(job, range + 1);
+  stl_index     neighbor;
+  int           vnot;
+  stl_index     i;
+  int           j;
+
+  /* The bounds start from the first vertex the range will end up with */
+  vertex = job->stl->facet_start[start].vertex[job->reverse ? 1 : 0];
+  min->x = stl_transform_row(job->m, &vertex);
+  min->y = stl_transform_row(job->m + 4, &vertex);
+  min->z = stl_transform_row(job->m + 8, &vertex);
+  *max = *min;
+
+#ifdef STL_UTIL_AVX2
+  if(__builtin_cpu_supports("avx2"))
+    stl_transform_facets_avx2(job->m, job->reverse,
+                              job->stl->facet_start + start, end - start,
+                              min, max);
+  else
+#endif
+    stl_transform_facets(job->m, job->reverse, job->stl->facet_start + start,
+                         end - start, min, max);
+
+  if(job->reverse) {
+    /* All facets are reversed together, so neighbors keep their relative
+       direction: edges 1 and 2 trade places and vertices 0 and 1 of
+       every neighbor do too. */
+    for(i = start; i < end; i++) {
+      neighbors = &job->stl->neighbors_start[i];
+      neighbor = neighbors->neighbor[1];
+      neighbors->neighbor[1] = neighbors->neighbor[2];
+      neighbors->neighbor[2] = neighbor;
+      vnot = neighbors->which_vertex_not[1];
+      neighbors->which_vertex_not[1] = neighbors->which_vertex_not[2];
+      neighbors->which_vertex_not[2] = vnot;
+      for(j = 0; j < 3; j++) {
+        vnot = neighbors->which_vertex_not[j];
+        if(neighbors->neighbor[j] != -1 && vnot % 3 < 2) {
+          neighbors->which_vertex_not[j] = vnot - vnot % 3 + 1 - vnot % 3;
+        }
+      }
+    }
+  }
+}
 
-  r = sqrt((*x **x) + (*y **y));
-  theta = atan2(*y, *x);
-  *x = r * cos(theta + radian_angle);
-  *y = r * sin(theta + radian_angle);
+/* Applies the affine transformation m to the mesh in one pass: m is a 3x4
+   matrix in row order with the translation in its last column, so that
+   x' = m[0] x + m[1] y + m[2] z + m[3] and so on.  The vertices are
+   transformed in double precision, the normals are recalculated and the
+   bounds are worked out along the way.  If m mirrors the mesh the facets
+   are reversed as well, so that they still point outwards. */
+void
+stl_transform(stl_file *stl, const double m[12]) {
+  stl_range_job job;
+  double        det;
+
+  if (stl->error) return;
+  stl_invalidate_soa(stl);
+
+  det = m[0] * (m[5] * m[10] - m[6] * m[9])
+        - m[1] * (m[4] * m[10] - m[6] * m[8])
+        + m[2] * (m[4] * m[9] - m[5] * m[8]);
+
+  if(stl->stats.number_of_facets > 0) {
+    stl_init_range_job(&job, stl);
+    job.m = m;
+    job.reverse = det < 0;
+    stl_parallel_for(job.num_ranges, stl_transform_range, &job);
+    stl_range_bounds(&job);
+  }
+
+  stl_invalidate_shared_vertices(stl);
+
+  if (stl->stats.volume > 0.0) {
+    stl->stats.volume *= fabs(det);
+  }
+  if (stl->stats.surface_area > 0.0) {
+    stl_calculate_surface_area(stl);
+  }
+}
+
+static void
+stl_get_size_range(void *arg, int range) {
+  stl_range_job *job = (stl_range_job*)arg;
+  stl_facet     *facet = job->stl->facet_start;
+  stl_vertex    min;
+  stl_vertex    max;
+  stl_index     start = stl_range_start(job, range);
+  stl_index     end = stl_range_start(job, range + 1);
+
+  min = facet[start].vertex[0];
+  max = facet[start].vertex[0];
+  if(stl_soa_current(job->stl))
+    stl_soa_bounds(&job->stl->soa, start, end, &min, &max);
+  else
+    stl_facets_bounds(facet + start, end - start, &min, &max);
+  job->min[range] = min;
+  job->max[range] = max;
 }
 
 extern void
 stl_get_size(stl_file *stl) {
-  int i;
-  int j;
+  stl_range_job job;
 
   if (stl->error) return;
   if (stl->stats.number_of_facets == 0) return;
 
-  stl->stats.min.x = stl->facet_start[0].vertex[0].x;
-  stl->stats.min.y = stl->facet_start[0].vertex[0].y;
-  stl->stats.min.z = stl->facet_start[0].vertex[0].z;
-  stl->stats.max.x = stl->facet_start[0].vertex[0].x;
-  stl->stats.max.y = stl->facet_start[0].vertex[0].y;
-  stl->stats.max.z = stl->facet_start[0].vertex[0].z;
-
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    for(j = 0; j < 3; j++) {
-      stl->stats.min.x = STL_MIN(stl->stats.min.x,
-                                 stl->facet_start[i].vertex[j].x);
-      stl->stats.min.y = STL_MIN(stl->stats.min.y,
-                                 stl->facet_start[i].vertex[j].y);
-      stl->stats.min.z = STL_MIN(stl->stats.min.z,
-                                 stl->facet_start[i].vertex[j].z);
-      stl->stats.max.x = STL_MAX(stl->stats.max.x,
-                                 stl->facet_start[i].vertex[j].x);
-      stl->stats.max.y = STL_MAX(stl->stats.max.y,
-                                 stl->facet_start[i].vertex[j].y);
-      stl->stats.max.z = STL_MAX(stl->stats.max.z,
-                                 stl->facet_start[i].vertex[j].z);
-    }
-  }
-  stl->stats.size.x = stl->stats.max.x - stl->stats.min.x;
-  stl->stats.size.y = stl->stats.max.y - stl->stats.min.y;
-  stl->stats.size.z = stl->stats.max.z - stl->stats.min.z;
-  stl->stats.bounding_diameter = sqrt(
-                                   stl->stats.size.x * stl->stats.size.x +
-                                   stl->stats.size.y * stl->stats.size.y +
-                                   stl->stats.size.z * stl->stats.size.z
-                                 );
+  stl_init_range_job(&job, stl);
+  stl_parallel_for(job.num_ranges, stl_get_size_range, &job);
+  stl_range_bounds(&job);
 }
 
 void
 stl_mirror_xy(stl_file *stl) {
-  int i;
+  stl_index i;
   int j;
   float temp_size;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   for(i = 0; i < stl->stats.number_of_facets; i++) {
     for(j = 0; j < 3; j++) {
@@ -374,11 +905,12 @@ stl_mirror_xy(stl_file *stl) {
 
 void
 stl_mirror_yz(stl_file *stl) {
-  int i;
+  stl_index i;
   int j;
   float temp_size;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   for(i = 0; i < stl->stats.number_of_facets; i++) {
     for(j = 0; j < 3; j++) {
@@ -396,11 +928,12 @@ stl_mirror_yz(stl_file *stl) {
 
 void
 stl_mirror_xz(stl_file *stl) {
-  int i;
+  stl_index i;
   int j;
   float temp_size;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   for(i = 0; i < stl->stats.number_of_facets; i++) {
     for(j = 0; j < 3; j++) {
@@ -416,86 +949,330 @@ stl_mirror_xz(stl_file *stl) {
   stl->stats.facets_reversed -= stl->stats.number_of_facets;  /* for not altering stats */
 }
 
-static float get_volume(stl_file *stl) {
-  long i;
-  stl_vertex p0;
-  stl_vertex p;
-  stl_normal n;
-  float height;
-  float area;
-  float volume = 0.0;
-
-  if (stl->error) return 0;
+/* Every facet spans a tetrahedron with the reference point, signed by the
+   direction of the facet, and these add up to the solid.  a, b and c are
+   the vertices relative to the reference point. */
+static void
+stl_mass_facet(const double a[3], const double b[3], const double c[3],
+               double sums[STL_MASS_SUMS]) {
+  double e1[3];
+  double e2[3];
+  double s[3];
+  double cross[3];
+  double det;
+  int    j;
+  int    k;
+
+  for(k = 0; k < 3; k++) {
+    e1[k] = b[k] - a[k];
+    e2[k] = c[k] - a[k];
+  }
+  cross[0] = e1[1] * e2[2] - e1[2] * e2[1];
+  cross[1] = e1[2] * e2[0] - e1[0] * e2[2];
+  cross[2] = e1[0] * e2[1] - e1[1] * e2[0];
+  sums[1] += sqrt(cross[0] * cross[0] + cross[1] * cross[1] +
+                  cross[2] * cross[2]);
+
+  det = a[0] * (b[1] * c[2] - b[2] * c[1])
+        + a[1] * (b[2] * c[0] - b[0] * c[2])
+        + a[2] * (b[0] * c[1] - b[1] * c[0]);
+  sums[0] += det;
+  sums[11] += fabs(det);
+  for(k = 0; k < 3; k++) {
+    s[k] = a[k] + b[k] + c[k];
+    sums[2 + k] += det * s[k];
+    sums[5 + k] += det * (s[k] * s[k] + a[k] * a[k] + b[k] * b[k] +
+                          c[k] * c[k]);
+  }
+  for(k = 0; k < 3; k++) {
+    j = (k + 1) % 3;
+    sums[8 + k] += det * (s[k] * s[j] + a[k] * a[j] + b[k] * b[j] +
+                          c[k] * c[j]);
+  }
+}
 
-  /* Choose a point, any point as the reference */
-  p0.x = stl->facet_start[0].vertex[0].x;
-  p0.y = stl->facet_start[0].vertex[0].y;
-  p0.z = stl->facet_start[0].vertex[0].z;
+/* Facets start to end one at a time into the lanes */
+static void
+stl_mass_facets(const stl_mass_job *job, stl_index start, stl_index end,
+                double lanes[STL_MASS_LANES][STL_MASS_SUMS]) {
+  double    a[3];
+  double    b[3];
+  double    c[3];
+  size_t    offset;
+  stl_index i;
+  int       k;
+
+  for(i = start; i < end; i++) {
+    offset = (size_t)i * job->stride;
+    for(k = 0; k < 3; k++) {
+      a[k] = job->coord[k][0][offset] - job->origin[k];
+      b[k] = job->coord[k][1][offset] - job->origin[k];
+      c[k] = job->coord[k][2][offset] - job->origin[k];
+    }
+    stl_mass_facet(a, b, c, lanes[i % STL_MASS_LANES]);
+  }
+}
 
-  for(i = 0; i < stl->stats.number_of_facets; i++) {
-    p.x = stl->facet_start[i].vertex[0].x - p0.x;
-    p.y = stl->facet_start[i].vertex[0].y - p0.y;
-    p.z = stl->facet_start[i].vertex[0].z - p0.z;
-    /* Do dot product to get distance from point to plane */
-    n = stl->facet_start[i].normal;
-    height = (n.x * p.x) + (n.y * p.y) + (n.z * p.z);
-    area = get_area(&stl->facet_start[i]);
-    volume += (area * height) / 3.0;
+#ifdef STL_UTIL_AVX2
+/* stl_mass_facet for four facets in the lanes of the vectors, with the
+   same operations in the same order */
+__attribute__((target("avx2"))) static void
+stl_mass_facet_avx2(const __m256d a[3], const __m256d b[3],
+                    const __m256d c[3], __m256d sums[STL_MASS_SUMS]) {
+  __m256d e1[3];
+  __m256d e2[3];
+  __m256d s[3];
+  __m256d cross[3];
+  __m256d det;
+  __m256d sum;
+  int     j;
+  int     k;
+
+  for(k = 0; k < 3; k++) {
+    e1[k] = _mm256_sub_pd(b[k], a[k]);
+    e2[k] = _mm256_sub_pd(c[k], a[k]);
+  }
+  cross[0] = _mm256_sub_pd(_mm256_mul_pd(e1[1], e2[2]),
+                           _mm256_mul_pd(e1[2], e2[1]));
+  cross[1] = _mm256_sub_pd(_mm256_mul_pd(e1[2], e2[0]),
+                           _mm256_mul_pd(e1[0], e2[2]));
+  cross[2] = _mm256_sub_pd(_mm256_mul_pd(e1[0], e2[1]),
+                           _mm256_mul_pd(e1[1], e2[0]));
+  sum = _mm256_add_pd(_mm256_mul_pd(cross[0], cross[0]),
+                      _mm256_mul_pd(cross[1], cross[1]));
+  sum = _mm256_add_pd(sum, _mm256_mul_pd(cross[2], cross[2]));
+  sums[1] = _mm256_add_pd(sums[1], _mm256_sqrt_pd(sum));
+
+  det = _mm256_mul_pd(a[0], _mm256_sub_pd(_mm256_mul_pd(b[1], c[2]),
+                                          _mm256_mul_pd(b[2], c[1])));
+  det = _mm256_add_pd(det, _mm256_mul_pd(a[1],
+                      _mm256_sub_pd(_mm256_mul_pd(b[2], c[0]),
+                                    _mm256_mul_pd(b[0], c[2]))));
+  det = _mm256_add_pd(det, _mm256_mul_pd(a[2],
+                      _mm256_sub_pd(_mm256_mul_pd(b[0], c[1]),
+                                    _mm256_mul_pd(b[1], c[0]))));
+  sums[0] = _mm256_add_pd(sums[0], det);
+  sums[11] = _mm256_add_pd(sums[11],
+                           _mm256_andnot_pd(_mm256_set1_pd(-0.0), det));
+  for(k = 0; k < 3; k++) {
+    s[k] = _mm256_add_pd(_mm256_add_pd(a[k], b[k]), c[k]);
+    sums[2 + k] = _mm256_add_pd(sums[2 + k], _mm256_mul_pd(det, s[k]));
+    sum = _mm256_add_pd(_mm256_mul_pd(s[k], s[k]), _mm256_mul_pd(a[k], a[k]));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(b[k], b[k]));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(c[k], c[k]));
+    sums[5 + k] = _mm256_add_pd(sums[5 + k], _mm256_mul_pd(det, sum));
+  }
+  for(k = 0; k < 3; k++) {
+    j = (k + 1) % 3;
+    sum = _mm256_add_pd(_mm256_mul_pd(s[k], s[j]), _mm256_mul_pd(a[k], a[j]));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(b[k], b[j]));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(c[k], c[j]));
+    sums[8 + k] = _mm256_add_pd(sums[8 + k], _mm256_mul_pd(det, sum));
   }
-  return volume;
 }
 
-static float get_surface_area(stl_file *stl) {
-  int i;
-  float area = 0.0;
+/* stl_mass_facets four facets at a time, for the dense arrays of the copy
+   in stl->soa.  start is a multiple of four, so the loads are aligned. */
+__attribute__((target("avx2"))) static void
+stl_mass_facets_avx2(const stl_mass_job *job, stl_index start,
+                     stl_index end,
+                     double lanes[STL_MASS_LANES][STL_MASS_SUMS]) {
+  double    out[STL_MASS_LANES];
+  __m256d   origin[3];
+  __m256d   a[3];
+  __m256d   b[3];
+  __m256d   c[3];
+  __m256d   sums[STL_MASS_SUMS];
+  stl_index i;
+  int       k;
+  int       lane;
+
+  for(k = 0; k < 3; k++) origin[k] = _mm256_set1_pd(job->origin[k]);
+  for(k = 0; k < STL_MASS_SUMS; k++) sums[k] = _mm256_setzero_pd();
+  for(i = start; i + STL_MASS_LANES <= end; i += STL_MASS_LANES) {
+    for(k = 0; k < 3; k++) {
+      a[k] = _mm256_sub_pd(_mm256_cvtps_pd(_mm_load_ps(job->coord[k][0] + i)),
+                           origin[k]);
+      b[k] = _mm256_sub_pd(_mm256_cvtps_pd(_mm_load_ps(job->coord[k][1] + i)),
+                           origin[k]);
+      c[k] = _mm256_sub_pd(_mm256_cvtps_pd(_mm_load_ps(job->coord[k][2] + i)),
+                           origin[k]);
+    }
+    stl_mass_facet_avx2(a, b, c, sums);
+  }
+  for(k = 0; k < STL_MASS_SUMS; k++) {
+    _mm256_storeu_pd(out, sums[k]);
+    for(lane = 0; lane < STL_MASS_LANES; lane++) lanes[lane][k] = out[lane];
+  }
+  stl_mass_facets(job, i, end, lanes);
+}
+#endif
 
-  if (stl->error) return 0;
+static void
+stl_mass_block(const stl_mass_job *job, stl_index block,
+               double sums[STL_MASS_SUMS]) {
+  double    lanes[STL_MASS_LANES][STL_MASS_SUMS];
+  stl_index start = (stl_index)block * STL_MASS_BLOCK_FACETS;
+  stl_index end;
+  int       k;
+
+  end = STL_MIN(job->stl->stats.number_of_facets,
+                start + STL_MASS_BLOCK_FACETS);
+#ifdef STL_UTIL_AVX2
+  if(job->stride == 1 && __builtin_cpu_supports("avx2")) {
+    stl_mass_facets_avx2(job, start, end, lanes);
+  } else
+#endif
+  {
+    memset(lanes, 0, sizeof(lanes));
+    stl_mass_facets(job, start, end, lanes);
+  }
+  for(k = 0; k < STL_MASS_SUMS; k++) {
+    sums[k] = (lanes[0][k] + lanes[1][k]) + (lanes[2][k] + lanes[3][k]);
+  }
+}
 
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    area += get_area(&stl->facet_start[i]);
+static void
+stl_mass_block_task(void *arg, int block) {
+  stl_mass_job *job = (stl_mass_job*)arg;
 
-  return area;
+  stl_mass_block(job, block, job->sums + (size_t)block * STL_MASS_SUMS);
 }
 
-void stl_calculate_volume(stl_file *stl) {
-  if (stl->error) return;
-  stl->stats.volume = get_volume(stl);
+/* Adds value to sum, keeping what rounding loses in carry (Neumaier) */
+static void
+stl_add_compensated(double *sum, double *carry, double value) {
+  double total = *sum + value;
+
+  if(fabs(*sum) >= fabs(value))
+    *carry += (*sum - total) + value;
+  else
+    *carry += (value - total) + *sum;
+  *sum = total;
 }
 
-void stl_calculate_surface_area(stl_file *stl) {
+/* stl_calculate_mass_properties, also leaving the unsigned volume in
+   absolute_volume unless it is NULL */
+static void
+stl_sum_mass_properties(stl_file *stl, stl_mass_properties *properties,
+                        double *absolute_volume) {
+  stl_mass_job        job;
+  stl_mass_properties result;
+  double              block_sums[STL_MASS_SUMS];
+  double              total[STL_MASS_SUMS];
+  double              carry[STL_MASS_SUMS];
+  double              second[6];
+  double              g[3];
+  double              *sums;
+  stl_index           num_blocks;
+  stl_index           block;
+  int                 j;
+  int                 k;
+
   if (stl->error) return;
-  stl->stats.surface_area = get_surface_area(stl);
-}
 
-static float get_area(stl_facet *facet) {
-  double cross[3][3];
-  float sum[3];
-  float n[3];
-  float area;
-  int i;
+  memset(&result, 0, sizeof(result));
+  for(k = 0; k < STL_MASS_SUMS; k++) total[k] = carry[k] = 0;
 
-  /* cast to double before calculating cross product because large coordinates
-     can result in overflowing product
-    (bad area is responsible for bad volume and bad facets reversal) */
-  for(i = 0; i < 3; i++) {
-    cross[i][0]=(((double)facet->vertex[i].y * (double)facet->vertex[(i + 1) % 3].z) -
-                 ((double)facet->vertex[i].z * (double)facet->vertex[(i + 1) % 3].y));
-    cross[i][1]=(((double)facet->vertex[i].z * (double)facet->vertex[(i + 1) % 3].x) -
-                 ((double)facet->vertex[i].x * (double)facet->vertex[(i + 1) % 3].z));
-    cross[i][2]=(((double)facet->vertex[i].x * (double)facet->vertex[(i + 1) % 3].y) -
-                 ((double)facet->vertex[i].y * (double)facet->vertex[(i + 1) % 3].x));
+  if(stl->stats.number_of_facets > 0) {
+    /* Summing relative to a point on the mesh keeps the terms small */
+    job.stl = stl;
+    for(j = 0; j < 3; j++) {
+      if(stl_soa_current(stl)) {
+        job.coord[0][j] = stl->soa.x[j];
+        job.coord[1][j] = stl->soa.y[j];
+        job.coord[2][j] = stl->soa.z[j];
+      } else {
+        job.coord[0][j] = &stl->facet_start[0].vertex[j].x;
+        job.coord[1][j] = &stl->facet_start[0].vertex[j].y;
+        job.coord[2][j] = &stl->facet_start[0].vertex[j].z;
+      }
+    }
+    job.stride = 1;
+    if(!stl_soa_current(stl)) job.stride = sizeof(stl_facet) / sizeof(float);
+    job.origin[0] = stl->facet_start[0].vertex[0].x;
+    job.origin[1] = stl->facet_start[0].vertex[0].y;
+    job.origin[2] = stl->facet_start[0].vertex[0].z;
+    num_blocks = (stl->stats.number_of_facets + STL_MASS_BLOCK_FACETS - 1)
+                 / STL_MASS_BLOCK_FACETS;
+
+    job.sums = NULL;
+    if(num_blocks > 1 && num_blocks <= INT_MAX && stl_thread_count() > 1) {
+      job.sums = (double*)malloc((size_t)num_blocks * STL_MASS_SUMS
+                                 * sizeof(double));
+    }
+    if(job.sums != NULL) {
+      stl_parallel_for((int)num_blocks, stl_mass_block_task, &job);
+    }
+    for(block = 0; block < num_blocks; block++) {
+      if(job.sums != NULL) {
+        sums = job.sums + (size_t)block * STL_MASS_SUMS;
+      } else {
+        /* One thread, or no room for the sums: the same blocks in turn */
+        stl_mass_block(&job, block, block_sums);
+        sums = block_sums;
+      }
+      for(k = 0; k < STL_MASS_SUMS; k++) {
+        stl_add_compensated(&total[k], &carry[k], sums[k]);
+      }
+    }
+    free(job.sums);
+    for(k = 0; k < STL_MASS_SUMS; k++) total[k] += carry[k];
+
+    result.volume = total[0] / 6;
+    result.surface_area = total[1] / 2;
+    for(k = 0; k < 3; k++) {
+      g[k] = 0;
+      if(result.volume != 0) g[k] = total[2 + k] / 24 / result.volume;
+      result.centroid[k] = job.origin[k] + g[k];
+    }
+
+    /* Second moments about the centroid, then the tensor from them */
+    for(k = 0; k < 3; k++) {
+      j = (k + 1) % 3;
+      second[k] = total[5 + k] / 120 - result.volume * g[k] * g[k];
+      second[3 + k] = total[8 + k] / 120 - result.volume * g[k] * g[j];
+    }
+    for(k = 0; k < 3; k++) {
+      j = (k + 1) % 3;
+      result.inertia[k][k] = second[j] + second[(k + 2) % 3];
+      result.inertia[k][j] = -second[3 + k];
+      result.inertia[j][k] = -second[3 + k];
+    }
   }
 
-  sum[0] = cross[0][0] + cross[1][0] + cross[2][0];
-  sum[1] = cross[0][1] + cross[1][1] + cross[2][1];
-  sum[2] = cross[0][2] + cross[1][2] + cross[2][2];
+  stl->stats.volume = result.volume;
+  stl->stats.surface_area = result.surface_area;
+  if(properties != NULL) *properties = result;
+  if(absolute_volume != NULL) *absolute_volume = total[11] / 6;
+}
+
+/* Works out the volume, surface area, centroid and inertia tensor in one
+   pass.  The volume and area go in the stats, everything in properties
+   unless it is NULL.  The volume follows the order of the vertices, and
+   comes out negative, along with the inertia, for a mesh whose facets
+   face inwards. */
+void
+stl_calculate_mass_properties(stl_file *stl, stl_mass_properties *properties) {
+  stl_sum_mass_properties(stl, properties, NULL);
+}
+
+void stl_calculate_volume(stl_file *stl) {
+  float surface_area;
+
+  if (stl->error) return;
+  surface_area = stl->stats.surface_area;
+  stl_calculate_mass_properties(stl, NULL);
+  stl->stats.surface_area = surface_area;
+}
 
-  /* This should already be done.  But just in case, let's do it again */
-  stl_calculate_normal(n, facet);
-  stl_normalize_vector(n);
+void stl_calculate_surface_area(stl_file *stl) {
+  float volume;
 
-  area = 0.5 * (n[0] * sum[0] + n[1] * sum[1] + n[2] * sum[2]);
-  return area;
+  if (stl->error) return;
+  volume = stl->stats.volume;
+  stl_calculate_mass_properties(stl, NULL);
+  stl->stats.volume = volume;
 }
 
 void stl_repair(stl_file *stl,
@@ -515,9 +1292,12 @@ void stl_repair(stl_file *stl,
                 int verbose_flag) {
 
   int i;
-  int last_edges_fixed = 0;
+  stl_index last_edges_fixed = 0;
+  stl_edge_worklist worklist = {NULL, 0};
+  double absolute_volume = 0;
 
   if (stl->error) return;
+  stl_invalidate_soa(stl);
 
   if(exact_flag || fixall_flag || nearby_flag || remove_unconnected_flag
       || fill_holes_flag || normal_directions_flag) {
@@ -552,9 +1332,9 @@ void stl_repair(stl_file *stl,
             printf("\
 Checking nearby. Tolerance= %f Iteration=%d of %d...",
                  tolerance, i + 1, iterations);
-          stl_check_facets_nearby(stl, tolerance);
+          stl_check_facets_nearby_worklist(stl, tolerance, &worklist);
           if (verbose_flag)
-            printf("  Fixed %d edges.\n",
+            printf("  Fixed %" STL_INDEX_FORMAT " edges.\n",
                  stl->stats.edges_fixed - last_edges_fixed);
           last_edges_fixed = stl->stats.edges_fixed;
           tolerance += increment;
@@ -569,6 +1349,7 @@ All facets connected.  No further nearby check necessary.\n");
       if (verbose_flag)
         printf("All facets connected.  No nearby check necessary.\n");
     }
+    stl_free_edge_worklist(&worklist);
   }
 
   if(remove_unconnected_flag || fixall_flag || fill_holes_flag) {
@@ -609,17 +1390,13 @@ All facets connected.  No further nearby check necessary.\n");
     stl_fix_normal_values(stl);
   }
 
-  /* Always calculate the volume.  It shouldn't take too long */
-  if (verbose_flag)
-    printf("Calculating volume...\n");
-  stl_calculate_volume(stl);
-
+  /* Always calculate the volume and area, in the one pass */
   if (verbose_flag)
-    printf("Calculate surfacea area...\n");
-  stl_calculate_surface_area(stl);
+    printf("Calculating volume and surface area...\n");
+  stl_sum_mass_properties(stl, NULL, &absolute_volume);
 
   if(fixall_flag) {
-    if(stl->stats.volume < 0.0) {
+    if(stl->stats.volume < -STL_VOLUME_SIGN_RATIO * absolute_volume) {
       if (verbose_flag)
         printf("Reversing all facets because volume is negative...\n");
       stl_reverse_all_facets(stl);
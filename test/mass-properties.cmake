@@ -0,0 +1,18 @@
+# Runs admesh on INPUT with --mass-properties and any OPTIONS, and compares
+# what it prints from the mass properties on with EXPECTED.  The statistics
+# before them are left out.
+execute_process(COMMAND ${ADMESH} ${INPUT} --mass-properties ${OPTIONS}
+                OUTPUT_VARIABLE output
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "admesh failed: ${result}")
+endif()
+string(FIND "${output}" "========= Mass Properties" start)
+if(start EQUAL -1)
+  message(FATAL_ERROR "No mass properties in:\n${output}")
+endif()
+string(SUBSTRING "${output}" ${start} -1 output)
+file(READ ${EXPECTED} expected)
+if(NOT output STREQUAL expected)
+  message(FATAL_ERROR "Expected:\n${expected}Got:\n${output}")
+endif()